@@ -0,0 +1,467 @@
+/*
+ * Microbenchmarks for logfs allocator and metadata paths
+ *
+ * More info:
+ * https://github.com/saikishu/logfs/blob/master/README.md
+ *
+ * Copyright (c) 2015 Sai Kishore
+ * Free to use under the MIT license
+ * https://github.com/saikishu/logfs/blob/master/LICENSE
+ *
+ */
+#define LOGFS_NO_MAIN
+#include "logfs.cpp"
+#include <sys/wait.h>
+#include <ctime>
+#include <cstdio>
+
+/* Benchmark */
+struct benchConfig {
+	string disk; //diskCapacity() args
+	string block; //blockSize() args
+	unsigned long long files; //files committed before timing lookups
+};
+
+enum benchFormatType {
+	BENCH_CSV, //header line, then one line per operation and configuration
+	BENCH_JSON //one object per line per operation and configuration
+};
+
+vector<string> benchDisks; //default 1GB,64GB,1TB
+vector<string> benchBlocks; //default 4KB,1MB
+vector<unsigned long long> benchFiles; //default 1000,100000
+benchFormatType benchFormat = BENCH_CSV;
+unsigned long long benchMaxBlocks = 1ULL << 24; //larger configurations are skipped
+unsigned long long benchDefragRounds = 10;
+unsigned long long benchSeed = 1;
+const unsigned long long benchDirectories = 64; //files are spread over /d<n>/
+const unsigned long long benchMaxFileBlocks = 256;
+
+void parseBenchOptions(int argc, char *argv[]);
+vector<string> splitList(const string &list);
+void runConfig(const benchConfig &config);
+unsigned long long benchClock();
+unsigned long long benchRandom(unsigned long long &state);
+string benchPath(unsigned long long k);
+void reportResult(const benchConfig &config, const char *operation,
+		vector<unsigned long long> &latencies, unsigned long long elapsed);
+
+/************************************************************************
+ Function: main
+ Description: Entry point of benchmark.
+ Args:
+ argc    int         number of command line arguments
+ argv    char*[]     command line arguments (see parseBenchOptions)
+ Returns: 0 when all configurations ran, 1 otherwise.
+ Notes:
+ Runs every combination of disk size, block size and file count. Each
+ runs in a child process, so storage starts empty every time. Results
+ go to standard output, skipped configurations to standard error.
+ ************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+	parseBenchOptions(argc, argv);
+
+	if (benchFormat == BENCH_CSV) {
+		printf("operation,disk,block,files,ops,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+		fflush(stdout);
+	}
+
+	int status = 0;
+	for (size_t d = 0; d < benchDisks.size(); d++) {
+		for (size_t b = 0; b < benchBlocks.size(); b++) {
+			for (size_t f = 0; f < benchFiles.size(); f++) {
+				benchConfig config = { benchDisks[d], benchBlocks[b],
+						benchFiles[f] };
+
+				string diskSuffix = config.disk.substr(config.disk.length() - 2);
+				string blockSuffix = config.block.substr(config.block.length() - 2);
+				unsigned long long bytes = convertSize(std::stoull(config.block),
+						blockSuffix, "B");
+				unsigned long long blocks =
+						bytes == 0 ? 0 :
+								convertSize(std::stoull(config.disk), diskSuffix,
+										"B") / bytes;
+				if (blocks == 0 || blocks > benchMaxBlocks
+						|| config.files > blocks / 2) {
+					fprintf(stderr, "Skipping disk %s, block %s, %llu files\n",
+							config.disk.c_str(), config.block.c_str(),
+							config.files);
+					continue;
+				}
+
+				pid_t child = fork();
+				if (child == 0) {
+					runConfig(config);
+					fflush(stdout);
+					_exit(0);
+				}
+				int childStatus = 1;
+				if (child < 0 || waitpid(child, &childStatus, 0) < 0
+						|| !WIFEXITED(childStatus)
+						|| WEXITSTATUS(childStatus) != 0) {
+					fprintf(stderr, "Failed disk %s, block %s, %llu files\n",
+							config.disk.c_str(), config.block.c_str(),
+							config.files);
+					status = 1;
+				}
+			}
+		}
+	}
+	return status;
+}
+
+/************************************************************************
+ Function: parseBenchOptions
+ Description: Parses command line options of benchmark
+ Args:
+ argc    int         number of command line arguments
+ argv    char*[]     command line arguments
+ Returns: none
+ Notes:
+ Options:
+ --disk=<list>           disk capacities, eg 1GB,64GB,1TB
+ --block=<list>          block sizes, eg 4KB,1MB
+ --files=<list>          file counts, eg 1000,100000
+ --output=<csv|json>     result format
+ --max-blocks=<n>        skip configurations with more blocks
+ --defrag-rounds=<n>     timed defragment() calls per configuration
+ --seed=<n>              seed of file sizes and lookup order
+ Lists are comma separated. Sizes use diskCapacity() and blockSize()
+ syntax.
+ On failure, exits with usage.
+ ************************************************************************/
+
+void parseBenchOptions(int argc, char *argv[]) {
+	static struct option longOptions[] = {
+			{ "disk", required_argument, 0, 'd' },
+			{ "block", required_argument, 0, 'b' },
+			{ "files", required_argument, 0, 'f' },
+			{ "output", required_argument, 0, 'o' },
+			{ "max-blocks", required_argument, 0, 'm' },
+			{ "defrag-rounds", required_argument, 0, 'r' },
+			{ "seed", required_argument, 0, 's' },
+			{ 0, 0, 0, 0 } };
+
+	benchDisks = splitList("1GB,64GB,1TB");
+	benchBlocks = splitList("4KB,1MB");
+	vector<string> files = splitList("1000,100000");
+	bool valid = true;
+	int opt = 0;
+	while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+		string value = optarg ? optarg : "";
+		switch (opt) {
+		case 'd':
+			benchDisks = splitList(value);
+			for (size_t i = 0; i < benchDisks.size(); i++) {
+				string &disk = benchDisks[i];
+				valid = valid && disk.length() > 2
+						&& isNumber(disk.substr(0, disk.length() - 2))
+						&& (disk.compare(disk.length() - 2, 2, "MB") == 0
+								|| disk.compare(disk.length() - 2, 2, "GB") == 0
+								|| disk.compare(disk.length() - 2, 2, "TB") == 0);
+			}
+			break;
+		case 'b':
+			benchBlocks = splitList(value);
+			for (size_t i = 0; i < benchBlocks.size(); i++) {
+				string &block = benchBlocks[i];
+				valid = valid && block.length() > 2
+						&& isNumber(block.substr(0, block.length() - 2))
+						&& (block.compare(block.length() - 2, 2, "KB") == 0
+								|| block.compare(block.length() - 2, 2, "MB") == 0);
+			}
+			break;
+		case 'f':
+			files = splitList(value);
+			break;
+		case 'o':
+			if (value.compare("csv") == 0) {
+				benchFormat = BENCH_CSV;
+			} else if (value.compare("json") == 0) {
+				benchFormat = BENCH_JSON;
+			} else {
+				valid = false;
+			}
+			break;
+		case 'm':
+			valid = valid && isNumber(value) && value.length() < 13;
+			benchMaxBlocks = valid ? std::stoull(value) : 0;
+			break;
+		case 'r':
+			valid = valid && isNumber(value) && value.length() < 7;
+			benchDefragRounds = valid ? std::stoull(value) : 0;
+			break;
+		case 's':
+			valid = valid && isNumber(value) && value.length() < 19;
+			benchSeed = valid ? std::stoull(value) : 0;
+			break;
+		default:
+			valid = false;
+		}
+	}
+
+	benchFiles.clear();
+	for (size_t i = 0; i < files.size(); i++) {
+		valid = valid && isNumber(files[i]) && files[i].length() < 10
+				&& std::stoull(files[i]) > 0;
+		if (valid) {
+			benchFiles.push_back(std::stoull(files[i]));
+		}
+	}
+
+	if (!valid || benchDisks.empty() || benchBlocks.empty()
+			|| benchFiles.empty()) {
+		fprintf(stderr,
+				"Usage: logfs_bench [--disk=<list>] [--block=<list>] [--files=<list>] [--output=<csv|json>]\n"
+						"[--max-blocks=<n>] [--defrag-rounds=<n>] [--seed=<n>]\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/************************************************************************
+ Function: splitList
+ Description: Splits a comma separated option value
+ Args:
+ list    string      comma separated items
+ Returns:
+ vector<string>  non empty items in order
+ ************************************************************************/
+
+vector<string> splitList(const string &list) {
+	vector<string> items;
+	size_t begin = 0;
+	while (begin <= list.length()) {
+		size_t end = list.find(',', begin);
+		if (end == string::npos) {
+			end = list.length();
+		}
+		if (end > begin) {
+			items.push_back(list.substr(begin, end - begin));
+		}
+		begin = end + 1;
+	}
+	return items;
+}
+
+/************************************************************************
+ Function: runConfig
+ Description: Times hot paths on one disk configuration
+ Args:
+ config  benchConfig     disk size, block size and file count
+ Returns: none
+ Notes:
+ Runs in a child process.
+ 1. commitFile(): files new files of 1 to benchMaxFileBlocks blocks,
+ sized so the disk stays about half full.
+ 2. findFile(), getStartingAddress() and getAbsolutePath(): one call per
+ file in random order, paths relative to /d1/.
+ 3. defragment(): each round deletes a tenth of the files, compacts, and
+ writes them again. Only compaction is timed.
+ Command output is captured and dropped.
+ ************************************************************************/
+
+void runConfig(const benchConfig &config) {
+	string discard;
+	outputCapture = &discard;
+	setDiskCapacity(config.disk);
+	setBlockSize(config.block);
+	initStorage();
+
+	unsigned long long state = benchSeed;
+	unsigned long long files = config.files;
+	unsigned long long maxFileBlocks = std::max((unsigned long long) 1,
+			std::min(benchMaxFileBlocks, blocksCount / (2 * files)));
+	vector<unsigned long long> sizes(files);
+	for (unsigned long long k = 0; k < files; k++) {
+		sizes[k] = (1 + benchRandom(state) % maxFileBlocks) * blockSize;
+	}
+
+	vector<unsigned long long> latencies;
+	latencies.reserve(files);
+	unsigned long long started = benchClock();
+	for (unsigned long long k = 0; k < files; k++) {
+		string path = benchPath(k);
+		unsigned long long before = benchClock();
+		commitFile(path, sizes[k], blockUnit, noHint);
+		latencies.push_back(benchClock() - before);
+		discard.clear();
+	}
+	reportResult(config, "commitFile", latencies, benchClock() - started);
+
+	vector<unsigned long long> order(files);
+	for (unsigned long long k = 0; k < files; k++) {
+		order[k] = k;
+	}
+	for (unsigned long long k = files - 1; k > 0; k--) {
+		std::swap(order[k], order[benchRandom(state) % (k + 1)]);
+	}
+	vector<string> paths(files);
+	for (unsigned long long k = 0; k < files; k++) {
+		paths[k] = benchPath(order[k]);
+	}
+
+	vector<unsigned long long> ids(files);
+	latencies.clear();
+	started = benchClock();
+	for (unsigned long long k = 0; k < files; k++) {
+		unsigned long long before = benchClock();
+		ids[k] = findFile(paths[k]);
+		latencies.push_back(benchClock() - before);
+	}
+	reportResult(config, "findFile", latencies, benchClock() - started);
+
+	unsigned long long checksum = 0;
+	latencies.clear();
+	started = benchClock();
+	for (unsigned long long k = 0; k < files; k++) {
+		unsigned long long address = 0;
+		unsigned long long before = benchClock();
+		getStartingAddress(ids[k], address);
+		latencies.push_back(benchClock() - before);
+		checksum += address;
+	}
+	reportResult(config, "getStartingAddress", latencies,
+			benchClock() - started);
+
+	changeDirectory("/d1");
+	discard.clear();
+	for (unsigned long long k = 0; k < files; k++) {
+		//relative to /d1/: files of /d1/ directly, others through ..
+		unsigned long long n = order[k];
+		paths[k] =
+				n % benchDirectories == 1 ?
+						"f" + std::to_string(n) :
+						"../d" + std::to_string(n % benchDirectories) + "/f"
+								+ std::to_string(n);
+	}
+	latencies.clear();
+	started = benchClock();
+	for (unsigned long long k = 0; k < files; k++) {
+		unsigned long long before = benchClock();
+		checksum += getAbsolutePath(paths[k]).length();
+		latencies.push_back(benchClock() - before);
+	}
+	reportResult(config, "getAbsolutePath", latencies, benchClock() - started);
+
+	latencies.clear();
+	unsigned long long elapsed = 0;
+	for (unsigned long long round = 0; round < benchDefragRounds; round++) {
+		vector<unsigned long long> deleted;
+		for (unsigned long long k = 0; k < files; k++) {
+			if (benchRandom(state) % 10 == 0) {
+				commitFile(benchPath(k), 0, blockUnit, noHint);
+				deleted.push_back(k);
+			}
+		}
+		discard.clear();
+		{
+			allocGuard guard;
+			unsigned long long before = benchClock();
+			defragment();
+			unsigned long long spent = benchClock() - before;
+			latencies.push_back(spent);
+			elapsed += spent;
+		}
+		for (size_t i = 0; i < deleted.size(); i++) {
+			commitFile(benchPath(deleted[i]), sizes[deleted[i]], blockUnit, noHint);
+		}
+		discard.clear();
+	}
+	reportResult(config, "defragment", latencies, elapsed);
+
+	if (checksum == 1) {
+		//keeps lookups from being optimized away
+		fprintf(stderr, "%llu\n", checksum);
+	}
+}
+
+/************************************************************************
+ Function: benchClock
+ Description: Reads monotonic clock
+ Args: none
+ Returns:
+ unsigned long long  nanoseconds
+ ************************************************************************/
+
+unsigned long long benchClock() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/************************************************************************
+ Function: benchRandom
+ Description: Next number of a xorshift64* generator
+ Args:
+ state   unsigned long long&     generator state, non zero
+ Returns:
+ unsigned long long  pseudo random number
+ Notes:
+ Same seed gives same file sizes and lookup order on every platform.
+ ************************************************************************/
+
+unsigned long long benchRandom(unsigned long long &state) {
+	if (state == 0) {
+		state = 1;
+	}
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+/************************************************************************
+ Function: benchPath
+ Description: Gets absolute path of a benchmark file
+ Args:
+ k       unsigned long long  file number
+ Returns:
+ string  /d<k % benchDirectories>/f<k>
+ ************************************************************************/
+
+string benchPath(unsigned long long k) {
+	return "/d" + std::to_string(k % benchDirectories) + "/f"
+			+ std::to_string(k);
+}
+
+/************************************************************************
+ Function: reportResult
+ Description: Outputs throughput and latency percentiles of one operation
+ Args:
+ config      benchConfig                 configuration measured
+ operation   const char*                 function timed
+ latencies   vector<unsigned long long>& nanoseconds per call, sorted here
+ elapsed     unsigned long long          nanoseconds of the whole run
+ Returns: none
+ Notes:
+ Percentile p is the smallest latency at or above a fraction p of calls.
+ ************************************************************************/
+
+void reportResult(const benchConfig &config, const char *operation,
+		vector<unsigned long long> &latencies, unsigned long long elapsed) {
+	std::sort(latencies.begin(), latencies.end());
+	unsigned long long ops = latencies.size();
+	unsigned long long percentiles[3] = { 0, 0, 0 };
+	const double fractions[3] = { 0.5, 0.99, 0.999 };
+	for (int i = 0; i < 3 && ops > 0; i++) {
+		unsigned long long rank = (unsigned long long) ceil(fractions[i] * ops);
+		percentiles[i] = latencies[rank > 0 ? rank - 1 : 0];
+	}
+	double opsPerSec = elapsed > 0 ? ops * 1e9 / elapsed : 0;
+
+	if (benchFormat == BENCH_CSV) {
+		printf("%s,%s,%s,%llu,%llu,%.0f,%llu,%llu,%llu\n", operation,
+				config.disk.c_str(), config.block.c_str(), config.files, ops,
+				opsPerSec, percentiles[0], percentiles[1], percentiles[2]);
+	} else {
+		printf("{\"operation\":\"%s\",\"disk\":\"%s\",\"block\":\"%s\","
+				"\"files\":%llu,\"ops\":%llu,\"ops_per_sec\":%.0f,"
+				"\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+				operation, config.disk.c_str(), config.block.c_str(),
+				config.files, ops, opsPerSec, percentiles[0], percentiles[1],
+				percentiles[2]);
+	}
+	fflush(stdout);
+}
@@ -14,59 +14,429 @@
 /************************************************************************
  Function: main
  Description: Entry point.
- Args: none
+ Args:
+ argc    int         number of command line arguments
+ argv    char*[]     command line arguments (see parseOptions)
  Returns: 0 on successful termination and non 0 on failure.
  Notes:
+ 0. Parse command line options.
  1. Initialize to check if first two commands are in order.
- 2. Validate each command.
+ 2. Tokenize and validate each command. With --script, all lines are
+ tokenized in parallel first (see runBatch). With --pipeline, lines are
+ tokenized in a separate thread (see runPipeline).
  2.a Illegal inputs: Wrong order, Syntax error, Invalid commands - Terminates the program.
  2.b Other invalid inputs: Skips to next command.
- 3. Executes given command.
+ 3. Executes given command. With --writers, writes are committed by
+ writer threads and their output is collected in command order.
+ With --record, each command is appended to a trace. With --replay,
+ commands come from a trace instead of standard input (see runReplay).
+ 4. With --stats, outputs stats() and amplification() when all commands
+ are done.
  ************************************************************************/
 
-int main() {
+#ifndef LOGFS_NO_MAIN //bench.cpp includes this file with its own main
+int main(int argc, char *argv[]) {
 
-	init();
-
-	string command = "";
-	string line = "";
-	string args = "";
+	parseOptions(argc, argv);
 
-	while (std::getline(std::cin, line)) {
-		removeSpaces(line);
+	if (!scriptPath.empty()) {
+		//Batch mode: script is parsed in parallel, then executed in order
+		runBatch(scriptPath);
+	} else if (!replayPath.empty()) {
+		//Commands come from a recorded trace
+		runReplay(replayPath);
+	} else if (pipelineInput) {
+		//Standard input is parsed in a thread while commands execute
+		runPipeline();
+	} else {
+		init();
 
-		if (!isValidSyntax(line, command, args)) {
-			terminate("Critical error: Invalid Syntax detected for: " + line);
-		}
+		string line = "";
+		parsedCommand command;
 
-		if (!isValidCommand(command)) {
-			terminate(
-					"Error: Invalid command entered:" + command
-							+ "\nNot a supported command. Check syntax and list of commands.");
+		while (std::getline(std::cin, line)) {
+			tokenizeLine(line, command);
+			traceCommand(command, 2);
+			if (operationLog >= 0 && !inputPending()) {
+				//logged operations are durable before waiting for more input
+				syncOperationLog();
+			}
 		}
+	}
 
-		//Prevent setting diskcapacity and blocksize again
-		if (commandsList["diskCapacity"].compare(command) == 0) {
-			cout << "Error: Disk Capacity already set. " << endl;
-			cout << "Skipping to next command..." << endl;
-		} else if (commandsList["blockSize"].compare(command) == 0) {
-			cout << "Error: Block Size already set. " << endl;
-			cout << "Skipping to next command..." << endl;
-		} else if (commandsList["mkdir"].compare(command) == 0) {
-			createDirectory(args);
-		} else if (commandsList["chdir"].compare(command) == 0) {
-			changeDirectory(args);
-		} else if (commandsList["read"].compare(command) == 0) {
-			readFile(args);
-		} else if (commandsList["write"].compare(command) == 0) {
-			writeFile(args);
-		}
+	stopWriters();
+	if (statsAtExit && blocksCount != 0) {
+		showStats("");
+		showAmplification("");
 	}
+	closeTrace();
+	closeCheckpoint();
+	stopBackgroundCleaner();
+	closeImage();
+	if (imageError != 0) {
+		terminate(
+				string("Critical error: Cannot write disk image: ")
+						+ strerror(imageError));
+	}
+	flushOutput();
 
 	//Handle memory leaks
 	delete[] memory;
+	delete[] freeMap;
+	delete[] segments;
 	return 0;
 }
+#endif
+
+/************************************************************************
+ Function: parseOptions
+ Description: Parses command line options
+ Args:
+ argc    int         number of command line arguments
+ argv    char*[]     command line arguments
+ Returns: none
+ Notes:
+ Options:
+ --allocation=<log|threshold>          fill holes when log head is full
+ --cleaner=<none|greedy|cost-benefit>  segment cleaner policy
+ --segment-blocks=<n>                  blocks per segment
+ --background-cleaner                  clean in a separate thread
+ --low-watermark=<percent>             start background cleaning below it
+ --high-watermark=<percent>            stop background cleaning at it
+ --output=<text|json|binary>           format of command results
+ --script=<file>                       run script file instead of standard input
+ --parse-threads=<n>                   threads tokenizing script, 0 for one per cpu
+ --pipeline                            tokenize standard input in a separate thread
+ --pipeline-depth=<n>                  lines tokenized ahead of execution
+ --writers=<n>                         threads committing writes, 1 writes in main thread
+ --lease-blocks=<n>                    blocks a writer leases from log head at a time
+ --checkpoint=<file>                   recover from and save storage to file
+ --checkpoint-interval=<n>             logged operations between checkpoints, 0 only at exit
+ --image=<file>                        write blocks to an image file backing the disk
+ --direct-io                           open image with O_DIRECT
+ --io-engine=<sync|uring|threads>      how image writes and relocation copies are issued
+ --io-depth=<n>                        image requests in flight with uring or threads
+ --cache-size=<MB>                     block cache of ranged reads, 0 for none
+ --cache-policy=<lru|arc>              block cache replacement policy
+ --readahead=<n>                       blocks fetched ahead of sequential reads, 0 for none
+ --record=<file>                       write executed commands with timing to a trace
+ --replay=<file>                       run commands of a trace instead of standard input
+ --replay-timing=<fast|original>       replay at once or at recorded start times
+ --stats                               output stats() and amplification() once all commands are done
+ --amplification-window=<n>            write() commands per amplification() window
+ --log-heads=<n>                       log heads writes are split across by hotness
+ --head-classifier=<rewrites|age>      how a write picks its log head
+ --max-extents=<n>                     most extents a write or the cleaner may split a file in
+ Output is flushed after every line only when it is a terminal.
+ On failure, terminates program.
+ ************************************************************************/
+
+void parseOptions(int argc, char *argv[]) {
+
+	static struct option longOptions[] = {
+			{ "allocation", required_argument, 0, 'a' },
+			{ "cleaner", required_argument, 0, 'c' },
+			{ "segment-blocks", required_argument, 0, 's' },
+			{ "background-cleaner", no_argument, 0, 'b' },
+			{ "low-watermark", required_argument, 0, 'l' },
+			{ "high-watermark", required_argument, 0, 'h' },
+			{ "output", required_argument, 0, 'o' },
+			{ "script", required_argument, 0, 'f' },
+			{ "parse-threads", required_argument, 0, 'p' },
+			{ "pipeline", no_argument, 0, 'q' },
+			{ "pipeline-depth", required_argument, 0, 'd' },
+			{ "writers", required_argument, 0, 'w' },
+			{ "lease-blocks", required_argument, 0, 'e' },
+			{ "checkpoint", required_argument, 0, 'k' },
+			{ "checkpoint-interval", required_argument, 0, 'i' },
+			{ "image", required_argument, 0, 'g' },
+			{ "direct-io", no_argument, 0, 'y' },
+			{ "io-engine", required_argument, 0, 'u' },
+			{ "io-depth", required_argument, 0, 'j' },
+			{ "cache-size", required_argument, 0, 'm' },
+			{ "cache-policy", required_argument, 0, 'r' },
+			{ "readahead", required_argument, 0, 't' },
+			{ "record", required_argument, 0, 'v' },
+			{ "replay", required_argument, 0, 'x' },
+			{ "replay-timing", required_argument, 0, 'z' },
+			{ "stats", no_argument, 0, 'n' },
+			{ "amplification-window", required_argument, 0, 'A' },
+			{ "log-heads", required_argument, 0, 'H' },
+			{ "head-classifier", required_argument, 0, 'C' },
+			{ "max-extents", required_argument, 0, 'E' },
+			{ 0, 0, 0, 0 } };
+
+	int opt = 0;
+	string value = "";
+	while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+		value = optarg ? optarg : "";
+		switch (opt) {
+		case 'a':
+			if (value.compare("log") == 0) {
+				allocationPolicy = ALLOCATION_LOG;
+			} else if (value.compare("threshold") == 0) {
+				allocationPolicy = ALLOCATION_THRESHOLD;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --allocation=<log|threshold>");
+			}
+			break;
+		case 'c':
+			if (value.compare("none") == 0) {
+				cleanerPolicy = CLEANER_NONE;
+			} else if (value.compare("greedy") == 0) {
+				cleanerPolicy = CLEANER_GREEDY;
+			} else if (value.compare("cost-benefit") == 0) {
+				cleanerPolicy = CLEANER_COST_BENEFIT;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --cleaner=<none|greedy|cost-benefit>");
+			}
+			break;
+		case 's':
+			if (value.empty() || !isNumber(value) || value.length() > 9
+					|| std::stoull(value) == 0) {
+				terminate(
+						"Critical error: Invalid option: --segment-blocks must be a positive whole number");
+			}
+			segmentBlocks = std::stoull(value);
+			break;
+		case 'b':
+			backgroundCleaner = true;
+			break;
+		case 'l':
+		case 'h':
+			if (value.empty() || !isNumber(value) || value.length() > 3
+					|| std::stoull(value) > 100) {
+				terminate(
+						"Critical error: Invalid option: watermarks must be a whole number percent from 0 to 100");
+			}
+			if (opt == 'l') {
+				lowWatermark = std::stoull(value);
+			} else {
+				highWatermark = std::stoull(value);
+			}
+			break;
+		case 'o':
+			if (value.compare("text") == 0) {
+				outputFormat = OUTPUT_TEXT;
+			} else if (value.compare("json") == 0) {
+				outputFormat = OUTPUT_JSON;
+			} else if (value.compare("binary") == 0) {
+				outputFormat = OUTPUT_BINARY;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --output=<text|json|binary>");
+			}
+			break;
+		case 'f':
+			if (value.empty()) {
+				terminate("Critical error: Invalid option: --script=<file>");
+			}
+			scriptPath = value;
+			break;
+		case 'p':
+			if (value.empty() || !isNumber(value) || value.length() > 4) {
+				terminate(
+						"Critical error: Invalid option: --parse-threads must be a whole number, 0 for one per cpu");
+			}
+			parseThreads = std::stoull(value);
+			break;
+		case 'q':
+			pipelineInput = true;
+			break;
+		case 'd':
+			if (value.empty() || !isNumber(value) || value.length() > 7
+					|| std::stoull(value) == 0) {
+				terminate(
+						"Critical error: Invalid option: --pipeline-depth must be a positive whole number");
+			}
+			pipelineInput = true;
+			pipelineDepth = std::stoull(value);
+			break;
+		case 'w':
+			if (value.empty() || !isNumber(value) || value.length() > 4
+					|| std::stoull(value) == 0
+					|| std::stoull(value) > maxWriters) {
+				terminate(
+						"Critical error: Invalid option: --writers must be a whole number from 1 to 1024");
+			}
+			writersCount = std::stoull(value);
+			break;
+		case 'e':
+			if (value.empty() || !isNumber(value) || value.length() > 9
+					|| std::stoull(value) == 0) {
+				terminate(
+						"Critical error: Invalid option: --lease-blocks must be a positive whole number");
+			}
+			leaseBlocks = std::stoull(value);
+			break;
+		case 'k':
+			if (value.empty()) {
+				terminate("Critical error: Invalid option: --checkpoint=<file>");
+			}
+			checkpointPath = value;
+			break;
+		case 'i':
+			if (value.empty() || !isNumber(value) || value.length() > 12) {
+				terminate(
+						"Critical error: Invalid option: --checkpoint-interval must be a whole number, 0 for only at exit");
+			}
+			checkpointInterval = std::stoull(value);
+			break;
+		case 'g':
+			if (value.empty()) {
+				terminate("Critical error: Invalid option: --image=<file>");
+			}
+			imagePath = value;
+			break;
+		case 'y':
+			imageDirect = true;
+			break;
+		case 'u':
+			if (value.compare("sync") == 0) {
+				ioEngine = IO_SYNC;
+			} else if (value.compare("uring") == 0) {
+				ioEngine = IO_URING;
+			} else if (value.compare("threads") == 0) {
+				ioEngine = IO_THREADS;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --io-engine=<sync|uring|threads>");
+			}
+			break;
+		case 'j':
+			if (value.empty() || !isNumber(value) || value.length() > 4
+					|| std::stoull(value) == 0
+					|| std::stoull(value) > maxIoDepth) {
+				terminate(
+						"Critical error: Invalid option: --io-depth must be a whole number from 1 to 1024");
+			}
+			ioDepth = std::stoull(value);
+			break;
+		case 'm':
+			if (value.empty() || !isNumber(value) || value.length() > 7) {
+				terminate(
+						"Critical error: Invalid option: --cache-size must be a whole number of MB, 0 for none");
+			}
+			cacheSize = std::stoull(value);
+			break;
+		case 'r':
+			if (value.compare("lru") == 0) {
+				cachePolicy = CACHE_LRU;
+			} else if (value.compare("arc") == 0) {
+				cachePolicy = CACHE_ARC;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --cache-policy=<lru|arc>");
+			}
+			break;
+		case 't':
+			if (value.empty() || !isNumber(value) || value.length() > 7) {
+				terminate(
+						"Critical error: Invalid option: --readahead must be a whole number of blocks, 0 for none");
+			}
+			readaheadBlocks = std::stoull(value);
+			break;
+		case 'v':
+			if (value.empty()) {
+				terminate("Critical error: Invalid option: --record=<file>");
+			}
+			recordPath = value;
+			break;
+		case 'x':
+			if (value.empty()) {
+				terminate("Critical error: Invalid option: --replay=<file>");
+			}
+			replayPath = value;
+			break;
+		case 'z':
+			if (value.compare("fast") == 0) {
+				replayOriginal = false;
+			} else if (value.compare("original") == 0) {
+				replayOriginal = true;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --replay-timing=<fast|original>");
+			}
+			break;
+		case 'n':
+			statsAtExit = true;
+			break;
+		case 'A':
+			if (value.empty() || !isNumber(value) || value.length() > 12
+					|| std::stoull(value) == 0) {
+				terminate(
+						"Critical error: Invalid option: --amplification-window must be a positive whole number");
+			}
+			amplificationWindow = std::stoull(value);
+			break;
+		case 'H':
+			if (value.empty() || !isNumber(value) || value.length() > 2
+					|| std::stoull(value) == 0
+					|| std::stoull(value) > maxLogHeads) {
+				terminate(
+						"Critical error: Invalid option: --log-heads must be a whole number from 1 to 16");
+			}
+			logHeads = std::stoull(value);
+			break;
+		case 'C':
+			if (value.compare("rewrites") == 0) {
+				headClassifier = CLASSIFY_REWRITES;
+			} else if (value.compare("age") == 0) {
+				headClassifier = CLASSIFY_AGE;
+			} else {
+				terminate(
+						"Critical error: Invalid option: --head-classifier=<rewrites|age>");
+			}
+			break;
+		case 'E':
+			if (value.empty() || !isNumber(value) || value.length() > 7
+					|| std::stoull(value) == 0) {
+				terminate(
+						"Critical error: Invalid option: --max-extents must be a positive whole number");
+			}
+			maxExtents = std::stoull(value);
+			extentsCapped = true;
+			break;
+		default:
+			terminate(
+					"Critical error: Invalid option.\nUsage: logfs [--allocation=<log|threshold>] [--cleaner=<none|greedy|cost-benefit>] [--segment-blocks=<n>]\n"
+							"[--background-cleaner] [--low-watermark=<percent>] [--high-watermark=<percent>] [--output=<text|json|binary>]\n"
+							"[--script=<file>] [--parse-threads=<n>] [--pipeline] [--pipeline-depth=<n>]\n"
+							"[--writers=<n>] [--lease-blocks=<n>] [--checkpoint=<file>] [--checkpoint-interval=<n>]\n"
+							"[--image=<file>] [--direct-io] [--io-engine=<sync|uring|threads>] [--io-depth=<n>]\n"
+							"[--cache-size=<MB>] [--cache-policy=<lru|arc>] [--readahead=<n>]\n"
+							"[--record=<file>] [--replay=<file>] [--replay-timing=<fast|original>] [--stats]\n"
+							"[--amplification-window=<n>] [--log-heads=<n>] [--head-classifier=<rewrites|age>]\n"
+							"[--max-extents=<n>]");
+		}
+	}
+
+	if (imageDirect && imagePath.empty()) {
+		terminate("Critical error: Invalid option: --direct-io needs --image=<file>");
+	}
+	if (ioEngine != IO_SYNC && imagePath.empty()) {
+		terminate("Critical error: Invalid option: --io-engine needs --image=<file>");
+	}
+	if (!replayPath.empty() && (!scriptPath.empty() || pipelineInput)) {
+		terminate(
+				"Critical error: Invalid option: --replay cannot be used with --script or --pipeline");
+	}
+
+	if (logHeads > 1 && writersCount > 1) {
+		terminate(
+				"Critical error: Invalid option: --log-heads cannot be used with --writers");
+	}
+
+	if (lowWatermark > highWatermark) {
+		terminate(
+				"Critical error: Invalid option: --low-watermark cannot be greater than --high-watermark");
+	}
+
+	outputLineFlush = isatty(STDOUT_FILENO);
+	return;
+}
 
 /************************************************************************
  Function: init
@@ -82,44 +452,14 @@ void init() {
 
 	int i = 0; //i=2 then done with first two commands.
 	string line = "";
-	string command = "";
-	string args = "";
+	parsedCommand command;
 
 	while (std::getline(std::cin, line)) {
-		removeSpaces(line); // Normalize string. data can have space in args. Eg: 4 MB instead of 4MB
-
+		//Tokenizer normalizes line. data can have space in args. Eg: 4 MB instead of 4MB
 		//Ignore if line is comment
 		if (!isComment(line)) {
-
-			if (!isValidSyntax(line, command, args)) {
-				terminate(
-						"Critical error: Invalid Syntax detected for: " + line
-								+ "\nFirst two commands must be diskCapacity and blockSize with valid syntax.");
-			} else {
-				if (i == 0) {
-					//first command must be diskCapacity
-					if (commandsList["diskCapacity"].compare(command) != 0) {
-						terminate(
-								"Critical error: Invalid command entered: "
-										+ command
-										+ "\nFirst command must be: diskCapacity(<size> <MB|GB|TB>)");
-					} else {
-						setDiskCapacity(args);
-					}
-
-				} else {
-					//second command must be blockSize
-					if (commandsList["blockSize"].compare(command) != 0) {
-						terminate(
-								"Critical error: Invalid command entered: "
-										+ command
-										+ "\nSecond command must be: blockSize(<size> <KB|MB>)");
-					} else {
-						setBlockSize(args);
-					}
-				}
-
-			}
+			tokenizeLine(line, command);
+			traceCommand(command, i);
 			i++;
 		}
 		if (i == 2) {
@@ -127,17 +467,228 @@ void init() {
 			break;
 		}
 	}
+	initStorage();
+	return;
+}
+
+/************************************************************************
+ Function: executeInitCommand
+ Description: Executes one of the first two commands
+ Args:
+ command     parsedCommand   tokenized command
+ step        int             0 for first command, 1 for second
+ Returns: none
+ Notes:
+ First command must be diskCapacity(), second must be blockSize().
+ Comments are skipped by caller.
+ On failure, terminates program.
+ ************************************************************************/
+
+void executeInitCommand(const parsedCommand &command, int step) {
+
+	if (command.syntaxError != NULL) {
+		out << command.syntaxError << endLine;
+		terminate(
+				"Critical error: Invalid Syntax detected for: "
+						+ sliceToString(command.line)
+						+ "\nFirst two commands must be diskCapacity and blockSize with valid syntax.");
+	}
+
+	if (step == 0) {
+		//first command must be diskCapacity
+		if (command.type != COMMAND_DISK_CAPACITY) {
+			terminate(
+					"Critical error: Invalid command entered: "
+							+ sliceToString(command.name)
+							+ "\nFirst command must be: diskCapacity(<size> <MB|GB|TB>)");
+		} else {
+			setDiskCapacity(sliceToString(command.args));
+		}
+
+	} else {
+		//second command must be blockSize
+		if (command.type != COMMAND_BLOCK_SIZE) {
+			terminate(
+					"Critical error: Invalid command entered: "
+							+ sliceToString(command.name)
+							+ "\nSecond command must be: blockSize(<size> <KB|MB>)");
+		} else {
+			setBlockSize(sliceToString(command.args));
+		}
+	}
+	return;
+}
+
+/************************************************************************
+ Function: initStorage
+ Description: Initializes memory block, free space and segments
+ Args: none.
+ Returns: none.
+ Notes:
+ Called once disk capacity and block size are set.
+ Opens disk image, starts background cleaner and writer threads if enabled.
+ With --checkpoint, recovers storage from checkpoint and operation log.
+ ************************************************************************/
+
+void initStorage() {
+
+	for (unsigned long long i = 0; i < fileShardCount; i++) {
+		pthread_mutex_init(&fileShards[i].lock, NULL);
+	}
+
 	//save initial dir
-	directoryMap[currentDir] = currentDir;
+	directory root;
+	root.parent = rootDirectory;
+	root.name = internName("");
+	root.created = true;
+	root.amplification = amplificationStats();
+	directories[rootDirectory] = root;
 
 	//Initialize block array
 	memory = new long long[blocksCount];
 	std::fill_n(memory, blocksCount, -1);
 
+	//Initialize free space bitmap, all blocks empty
+	freeMapWords = (blocksCount + 63) / 64;
+	freeMap = new unsigned long long[freeMapWords];
+	std::fill_n(freeMap, freeMapWords, 0);
+	markFreeMap(0, blocksCount, true);
+	addFreeExtent(0, blocksCount);
+
+	//Initialize segments, all clean. Last segment can be shorter.
+	if (segmentBlocks > blocksCount) {
+		segmentBlocks = blocksCount;
+	}
+	segmentsCount = segmentBlocks ? (blocksCount + segmentBlocks - 1) / segmentBlocks : 0;
+	segments = new segment[segmentsCount];
+	segment clean = { 0, 0 };
+	std::fill_n(segments, segmentsCount, clean);
+	cleanBlocks = blocksCount;
+	headLimit = blocksCount;
+
+	openImage();
+	initCache();
+	startBackgroundCleaner();
+	startWriters();
+	recoverCheckpoint();
+
 	return;
 
 }
 
+/************************************************************************
+ Function: executeLine
+ Description: Executes a tokenized line of pre-parsed input
+ Args:
+ command     parsedCommand   tokenized line
+ step        int&            number of first two commands done
+ Returns:
+ unsigned long long      latency in nanoseconds, 0 for a skipped comment
+ Notes:
+ Same as init() followed by main loop: comments are skipped before the
+ first two commands, storage is initialized after them.
+ ************************************************************************/
+
+unsigned long long executeLine(const parsedCommand &command, int &step) {
+	unsigned long long latency = 0;
+	if (step == 2) {
+		latency = traceCommand(command, step);
+	} else if (command.line.length == 0 || command.line.data[0] != '#') {
+		latency = traceCommand(command, step);
+		step++;
+		if (step == 2) {
+			initStorage();
+		}
+	}
+	return latency;
+}
+
+/************************************************************************
+ Function: executeCommand
+ Description: Executes a tokenized command after the first two
+ Args:
+ command     parsedCommand   tokenized command
+ Returns: none
+ Notes:
+ Syntax error or invalid command: Terminates program
+ ************************************************************************/
+
+void executeCommand(const parsedCommand &command) {
+
+	if (command.syntaxError != NULL || command.type != COMMAND_WRITE) {
+		//everything except writes sees the result of earlier writes
+		drainWriters();
+	}
+
+	if (imageError != 0) {
+		terminate(
+				string("Critical error: Cannot write disk image: ")
+						+ strerror(imageError));
+	}
+
+	if (command.syntaxError != NULL) {
+		out << command.syntaxError << endLine;
+		terminate(
+				"Critical error: Invalid Syntax detected for: "
+						+ sliceToString(command.line));
+	}
+
+	if (operationLog >= 0 && isLoggedCommand(command.type)
+			&& command.argsError == NULL) {
+		logOperation(command);
+	}
+
+	switch (command.type) {
+	case COMMAND_DISK_CAPACITY:
+		//Prevent setting diskcapacity and blocksize again
+		out << "Error: Disk Capacity already set. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(command.type, RESULT_REFUSED, "",
+				"Disk Capacity already set");
+		break;
+	case COMMAND_BLOCK_SIZE:
+		out << "Error: Block Size already set. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(command.type, RESULT_REFUSED, "", "Block Size already set");
+		break;
+	case COMMAND_MKDIR:
+		createDirectory(sliceToString(command.args));
+		break;
+	case COMMAND_CHDIR:
+		changeDirectory(sliceToString(command.args));
+		break;
+	case COMMAND_READ:
+		readFile(sliceToString(command.args));
+		break;
+	case COMMAND_WRITE:
+		writeFile(command);
+		break;
+	case COMMAND_APPEND:
+		appendFile(command);
+		break;
+	case COMMAND_FRAGMENTATION:
+		showFragmentation(sliceToString(command.args));
+		break;
+	case COMMAND_RENAME:
+		renamePath(sliceToString(command.args));
+		break;
+	case COMMAND_RMDIR:
+		removeDirectory(sliceToString(command.args));
+		break;
+	case COMMAND_STATS:
+		showStats(sliceToString(command.args));
+		break;
+	case COMMAND_AMPLIFICATION:
+		showAmplification(sliceToString(command.args));
+		break;
+	default:
+		terminate(
+				"Error: Invalid command entered:" + sliceToString(command.name)
+						+ "\nNot a supported command. Check syntax and list of commands.");
+	}
+	return;
+}
+
 /************************************************************************
  Function: setDiskCapacity
  Description: Sets Disk Capacity from args passed to diskCapacity() command.
@@ -185,7 +736,8 @@ void setDiskCapacity(string args) {
 				"Critical error: diskCapacity cannot be 0. Cannot set diskCapacity");
 	}
 
-	cout << "Disk Size set to: " << diskSize << diskUnit << endl;
+	out << "Disk Size set to: " << diskSize << diskUnit << endLine;
+	emitSizeRecord(COMMAND_DISK_CAPACITY, diskSize, diskUnit, 0);
 
 	return;
 }
@@ -263,8 +815,9 @@ void setBlockSize(string args) {
 		blocksCount = temp / blockSize;
 	}
 
-	cout << "Block Size set to: " << blockSize << blockUnit << endl;
-	cout << "Number of Blocks: " << blocksCount << endl;
+	out << "Block Size set to: " << blockSize << blockUnit << endLine;
+	out << "Number of Blocks: " << blocksCount << endLine;
+	emitSizeRecord(COMMAND_BLOCK_SIZE, blockSize, blockUnit, blocksCount);
 
 	return;
 
@@ -277,7 +830,7 @@ void setBlockSize(string args) {
  args    string      one or more paths (format: <path> {, <path>})
  Returns:    none
  Notes:
- Stores created dirs in directoryMap
+ Stores created dirs in directories
  Creates one or more dirs from absolute or relative paths unless dir already exists.
  On success, outputs each created directory message.
  On failure, skips to next command.
@@ -288,49 +841,33 @@ void createDirectory(string args) {
 
 	string temp = "";
 	//Check for single or multiple paths
-	size_t commapos = args.find_first_of(",");
-	if (commapos != string::npos) {
-		//multiple paths
-		char *cstr_args = new char[args.length() + 1];
-		std::strcpy(cstr_args, args.c_str());
-		char *token = std::strtok(cstr_args, ",");
-		while (token != NULL) {
-			//Syntax allows a space after ',''
-			temp = token;
-			ltrim(temp);
-			temp = getAbsolutePath(temp);
+	bool multiple = args.find_first_of(",") != string::npos;
+	size_t start = 0;
+	do {
+		size_t end = args.find_first_of(",", start);
+		if (end == string::npos) {
+			end = args.length();
+		}
+		//Empty paths between commas are skipped. Syntax allows a space after ','
+		if (end > start || !multiple) {
+			temp = getAbsolutePath(args.substr(start, end - start));
 
 			if (temp.find_last_of("/") != temp.length() - 1) {
 				temp = temp + "/";
 			}
 
-			if (directoryMap.count(temp) == 0) {
-				directoryMap[temp] = temp;
-				cout << "Created directory: " << temp << endl;
+			if (addDirectory(temp)) {
+				out << "Created directory: " << temp << endLine;
+				emitRecord(COMMAND_MKDIR, RESULT_OK, temp, NULL);
 			} else {
-				cout << "Directory already exists: " << temp << endl;
+				out << "Directory already exists: " << temp << endLine;
+				emitRecord(COMMAND_MKDIR, RESULT_EXISTS, temp,
+						"Directory already exists");
 			}
-
-			token = strtok(NULL, ",");
-		}
-		//handle memory leaks
-		delete[] cstr_args;
-		delete[] token;
-	} else {
-		//single path
-		temp = getAbsolutePath(args);
-		;
-		if (temp.find_last_of("/") != temp.length() - 1) {
-			temp = temp + "/";
-		}
-		if (directoryMap.count(temp) == 0) {
-			directoryMap[temp] = temp;
-			cout << "Created directory: " << temp << endl;
-		} else {
-			cout << "Directory already exists: " << temp << endl;
 		}
+		start = end + 1;
+	} while (start <= args.length());
 
-	}
 	return;
 
 }
@@ -357,15 +894,20 @@ void changeDirectory(string args) {
 		temp = temp + "/";
 	}
 
-	if (directoryMap.count(temp) == 0) {
-		cout << "Directory doesn't exist: " << temp << endl;
-		cout << "Skipping to next command..." << endl;
+	unsigned long long dirId = findDirectory(temp);
+	if (dirId == noEntry) {
+		out << "Directory doesn't exist: " << temp << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_CHDIR, RESULT_NOT_FOUND, temp,
+				"Directory doesn't exist");
 		return;
 	}
 
 	currentDir = temp;
+	currentDirId = dirId;
 
-	cout << "Current dir: " << currentDir << endl;
+	out << "Current dir: " << currentDir << endLine;
+	emitRecord(COMMAND_CHDIR, RESULT_OK, currentDir, NULL);
 	return;
 }
 
@@ -373,10 +915,10 @@ void changeDirectory(string args) {
  Function: writeFile
  Description: Allocates given size to file in memory from args passed to write() command.
  Args:
- args    string      file and size (format: <file>, <size> <B|KB|MB|GB>)
+ command parsedCommand       tokenized write() command
  Returns: none
  Notes:
- Validates syntactical correctness of write() command arguments.
+ Args are validated and size is parsed by tokenizer (see parseWriteArgs).
  Considers absolute and relative file path.
  Executes method to commit to memory. (Only simulation)
  On Success, calls method to commit to memory
@@ -384,88 +926,19 @@ void changeDirectory(string args) {
  Syntax error: Terminates program
  ************************************************************************/
 
-void writeFile(string args) {
-
-	string unit = "";
-	unsigned long long fileSize = 0;
+void writeFile(const parsedCommand &command) {
 
-	//Validate args
-	size_t commapos = args.find_first_of(",");
-	if (commapos == 0 || commapos == string::npos
-			|| commapos != args.find_last_of(",")) {
-		//Critical error: Bad syntax. Either no commas or more than one comma present.
-		terminate(
-				"Critical error: Invalid Syntax detected for: write command: write(<file>, <size><B|KB|MB|GB>)");
-	}
-
-	char *cstr_args = new char[args.length() + 1];
-	std::strcpy(cstr_args, args.c_str());
-
-	//It is guaranteed at this stage that we have only one ','. So 2 tokens.
-	char *token = std::strtok(cstr_args, ",");
-	//first token is file name
-	string file = token;
-	token = strtok(NULL, ",");
-	//second token is size.
-	string size = "";
-	if (token) {
-		size = token;
-		ltrim(size);
-	} else {
-		terminate(
-				"Critical error: Invalid Syntax detected for: write command: write(<file>, <size><B|KB|MB|GB>)");
+	if (command.argsError != NULL) {
+		drainWriters();
+		terminate(command.argsError);
 	}
 
-	delete[] cstr_args;
-
-	//validating size attrib
-	size_t len = size.length();
-
-	//only size = 0 is allowed.
-	if (len == 1) {
-		if (!isNumber(size) || ((isNumber(size)) && (std::stoi(size) != 0))) {
-			terminate(
-					"Critical error: Invalid Syntax detected for: write command: write(<file>, <size><B|KB|MB|GB>). Only 0 is allowed without units.");
-		}
-
-	} else {
-		//Unit can be B | KB | MB | GB; 1 or 2 chars
-		//Assume it is B
-		unit = size.substr(len - 1, 1);
-
-		if (unit.compare("B") != 0) {
-			//Fail safe. Everyunit ends with B.
-			terminate(
-					"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>). Unit must be B|KB|MB|GB.");
-		}
-
-		string tempSize = size.substr(0, len - 1); //Everything except last char
-
-		if (!isNumber(tempSize)) {
-			//Two possibilities: either it is invalid + B or assumption is wrong. It can be MB|KB|GB.
-			string tempSize2 = size.substr(0, len - 2); //Everything except last two chars
-			if (!isNumber(tempSize2)) {
-				terminate(
-						"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>). Size must be whole number.");
-			} else {
-				//Assumption is wrong. However string like 789XB can escape above case.
-				unit = size.substr(len - 2, 2);
-				if ((string::npos == unit.find("KB"))
-						&& (string::npos == unit.find("MB"))
-						&& (string::npos == unit.find("GB"))) {
-					terminate(
-							"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>): Unit must be B|KB|MB|GB.");
-				}
-				fileSize = std::stoull(tempSize2);
-			}
-		} else {
-			//Assumption is valid
-			fileSize = std::stoull(tempSize);
-		}
+	string file = getAbsolutePath(sliceToString(command.path));
+	if (writers != NULL) {
+		dispatchWrite(file, command.size, command.unit);
+		return;
 	}
-
-	file = getAbsolutePath(file);
-	commitFile(file, fileSize, unit);
+	commitFile(file, command.size, unitNames[command.unit], command.hint);
 
 	return;
 }
@@ -476,38 +949,32 @@ void writeFile(string args) {
  Args:
  filepath    string              Absolute file path
  fileSize    unsigned long long  file size to write
+ unit        string              unit of fileSize
+ hint        long long           log head hint of write(), noHint if none
  Returns: none
  Notes:
  Performs delete operation if size = 0
  Removes file info from file list
  Marks memory occupied to empty
- Checks for available space to accommodate given file.
- If not continuous but enough space is available calls defragment()
+ Checks for available space to accommodate given file (see
+ findWriteSpace). If not continuous but enough space is available
+ calls defragment(), or with max extents first splits file over holes.
+ With threshold allocation, first fills the best fitting hole.
+ With a cleaner policy, first cleans segments to move log head to a
+ run of clean segments and defragments only if that fails.
+ With several log heads, first moves to the head picked by
+ classifyWrite() (see selectLogHead).
  Writes sequentially
  Writes new file to memory (simulation => stores info in heap)
  If file exists, marks existing memory as empty and sequentially
  writes a new file with same meta data.
  On success, outputs written file info
  On failure, skips to next command.
+ In a writer thread, a new file is first appended to the writer's lease
+ without taking allocLock (see commitToLease).
  ************************************************************************/
-void commitFile(string filepath, unsigned long long fileSize, string unit) {
-
-	//if file size = 0 then delete operation on existing file.
-	unsigned long long searchFileId = findFile(filepath);
-	unsigned long long fileId = currentFileId;
-	if (fileSize == 0) {
-		//Existing file operation
-		if (searchFileId == 0) {
-			cout << "No such file exists to write. " << endl;
-			cout << "Skipping to next command..." << endl;
-			return;
-		}
-		resetMemory(searchFileId);
-		files.erase(searchFileId);
-		cout << filepath << ", " << searchFileId << ", " << "DELETED" << ", 0"
-				<< blockUnit << endl;
-		return;
-	}
+void commitFile(const string &filepath, unsigned long long fileSize,
+		const string &unit, long long hint) {
 
 	//Bounds check
 	string normalizedUnit = "B"; //least of <B|KB\MB|GB> vs <MB|GB|TB>
@@ -519,10 +986,12 @@ void commitFile(string filepath, unsigned long long fileSize, string unit) {
 			normalizedUnit);
 
 	//Check if filesize is greater than total capacity
-	if ((normalizedDiskSize / normalizedFileSize) < 1) {
-		cout << "Error: Cannot write files greater than disk capacity. "
-				<< endl;
-		cout << "Skipping to next command..." << endl;
+	if (fileSize != 0 && (normalizedDiskSize / normalizedFileSize) < 1) {
+		out << "Error: Cannot write files greater than disk capacity. "
+				<< endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_WRITE, RESULT_NO_SPACE, filepath,
+				"Cannot write files greater than disk capacity");
 		return;
 	}
 
@@ -530,42 +999,68 @@ void commitFile(string filepath, unsigned long long fileSize, string unit) {
 			normalizedFileSize / normalizedBlockSize);
 	unsigned long long allocatedFileSize = requiredBlocks * blockSize; //in block units
 
-	//if end is reached then try defragmenting before writing.
-	if (currentPos == blocksCount) {
-		//either memory full or need defragmentation
-		defragment();
+	if (fileSize != 0 && writerIndex >= 0
+			&& commitToLease(filepath, requiredBlocks, allocatedFileSize)) {
+		return;
 	}
 
-	unsigned long long availableBlocks = blocksCount - currentPos; //defragmentation done. If 0 then memory full.
+	//Background cleaner must not move blocks while allocating
+	allocGuard guard;
 
-	if (requiredBlocks > availableBlocks) {
-		//May not be continuously available
-		if (getTotalAvailableBlocks() >= requiredBlocks) {
-			//defragmentation will get desired blocks continuously.
-			defragment();
-			//now, currentPos should point to a continuous memory till end or points to end if full.
-			//@todo refactor and bring in a way to check continous memory availability
-			availableBlocks = blocksCount - currentPos;
-			if (requiredBlocks > availableBlocks) {
-				//defrag didnt help. Disk is really full.
-				cout << "Not enough memory to write. " << endl;
-				cout << "Skipping to next command..." << endl;
-				return;
-			}
-		} else {
-			cout << "Not enough memory to write. " << endl;
-			cout << "Skipping to next command..." << endl;
-			return;
-		}
-	}
+	//if file size = 0 then delete operation on existing file.
+	unsigned long long searchFileId = findFile(filepath);
+	unsigned long long fileId = 0;
+	if (fileSize == 0) {
+		//Existing file operation
+		if (searchFileId == 0) {
+			out << "No such file exists to write. " << endLine;
+			out << "Skipping to next command..." << endLine;
+			emitRecord(COMMAND_WRITE, RESULT_NOT_FOUND, filepath,
+					"No such file exists to write");
+			return;
+		}
+		resetMemory(searchFileId);
+		unlinkFile(searchFileId);
+		eraseFile(searchFileId);
+		wakeBackgroundCleaner();
+		out << filepath << ", " << searchFileId << ", " << "DELETED" << ", 0"
+				<< blockUnit << endLine;
+		emitFileRecord(COMMAND_WRITE, RESULT_DELETED, filepath, searchFileId);
+		return;
+	}
+
+	if (logHeads > 1) {
+		selectLogHead(classifyWrite(searchFileId, hint), requiredBlocks);
+	}
+
+	if (writerIndex >= 0) {
+		if (searchFileId == 0 && takeLease(writers[writerIndex], requiredBlocks)) {
+			appendToLease(writers[writerIndex], filepath, requiredBlocks,
+					allocatedFileSize);
+			return;
+		}
+		if (requiredBlocks > headLimit - currentPos) {
+			//leased blocks count as used, return them before looking for space
+			revokeLeases();
+		}
+	}
 
-	//At this stage there is enough memory to write
+	vector<blockExtent> pieces;
+	if (!findWriteSpace(requiredBlocks, maxExtents, pieces)) {
+		out << "Not enough memory to write. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_WRITE, RESULT_NO_SPACE, filepath,
+				"Not enough memory to write");
+		return;
+	}
 
-	unsigned long long i = 0;
 	file f1 = { };
-	f1.path = filepath;
 	f1.allocatedBlocks = requiredBlocks;
 	f1.allocatedFileSize = allocatedFileSize;
+	f1.modified = ++logClock;
+
+	//File is written as one continuous run, or in pieces with max extents
+	f1.extents = pieces;
 
 	//check if file exists first
 	if (searchFileId != 0) {
@@ -574,87 +1069,398 @@ void commitFile(string filepath, unsigned long long fileSize, string unit) {
 		//reset previous memory
 		resetMemory(searchFileId);
 
-		//continue to create new block from current pos
-		for (i = 0; i < requiredBlocks; i++) {
-			//currentPos+requiredBlocks is never out of bounds. Since requiredBlocks <= availableBlocks
-			memory[currentPos + i] = searchFileId;
-		}
-
-		//update file map
-		files[searchFileId] = f1;
+		//update file map, file stays at same path
+		f1.parent = getFile(searchFileId).parent;
+		f1.name = getFile(searchFileId).name;
+		f1.rewrites = getFile(searchFileId).rewrites + 1;
+		getFile(searchFileId) = f1;
 		fileId = searchFileId;
 
 	} else {
 		//new file
-		for (i = 0; i < requiredBlocks; i++) {
-			//currentPos+requiredBlocks is never out of bounds. Since requiredBlocks <= availableBlocks
-			memory[currentPos + i] = currentFileId;
-		}
-
-		files[currentFileId] = f1;
-		fileId = currentFileId;
-		currentFileId++;
+		fileId = currentFileId++;
+		getFile(fileId) = f1;
+		size_t slash = filepath.find_last_of("/");
+		linkFile(fileId, resolveDirectory(filepath, slash + 1, true),
+				internName(filepath.substr(slash + 1)));
 	}
 
-	currentPos = currentPos + requiredBlocks;
+	//pieces are never out of bounds, findWriteSpace() only returns empty blocks
+	placeBlocks(pieces, fileId, f1.modified);
+	countWritten(getFile(fileId).parent, requiredBlocks);
+	wakeBackgroundCleaner();
 
 	//Print file info
 	unsigned long long startAddress = 0;
 	getStartingAddress(fileId, startAddress);
-	cout << filepath << ", " << fileId << ", 0x" << std::hex << startAddress
-			<< ", " << std::dec << allocatedFileSize << blockUnit << endl;
+	out << filepath << ", " << fileId << ", 0x" << hexNumber(startAddress)
+			<< ", " << allocatedFileSize << blockUnit << endLine;
+	emitFileRecord(COMMAND_WRITE, RESULT_OK, filepath, fileId);
 
 	return;
 
 }
 
+/************************************************************************
+ Function: findWriteSpace
+ Description: Finds empty blocks for a write
+ Args:
+ requiredBlocks  unsigned long long      blocks to place
+ maxPieces       unsigned long long      most runs the blocks may be split in
+ pieces          vector<blockExtent>&    runs found, in order to write
+ Returns:
+ true if the blocks were found
+ false if disk is too full even after cleaning and defragmentation
+ Notes:
+ Caller holds allocGuard.
+ Run is at log head, or with threshold allocation a best fitting hole.
+ If neither fits and maxPieces is above 1, blocks are split over the
+ largest holes (see findScatteredSpace) before anything is moved.
+ Otherwise cleans segments (with a cleaner policy) and defragments, so
+ blocks of files may move.
+ ************************************************************************/
+
+bool findWriteSpace(unsigned long long requiredBlocks,
+		unsigned long long maxPieces, vector<blockExtent> &pieces) {
+
+	unsigned long long holeStart = blocksCount; //set if file goes into a hole
+	if (maxPieces > 1 && requiredBlocks > headLimit - currentPos
+			&& !findHole(requiredBlocks, holeStart)
+			&& findScatteredSpace(requiredBlocks, maxPieces, pieces)) {
+		return true;
+	}
+
+	//if end is reached then try defragmenting before writing.
+	if (currentPos == blocksCount && cleanerPolicy == CLEANER_NONE
+			&& allocationPolicy == ALLOCATION_LOG) {
+		//either memory full or need defragmentation
+		defragment();
+	}
+
+	unsigned long long availableBlocks = headLimit - currentPos; //defragmentation done. If 0 then memory full.
+
+	if (requiredBlocks > availableBlocks
+			&& !findHole(requiredBlocks, holeStart)) {
+		//May not be continuously available
+		if (getTotalAvailableBlocks() < requiredBlocks) {
+			return false;
+		}
+		if (cleanerPolicy != CLEANER_NONE) {
+			//cleaning segments can free a continuous run for log head
+			cleanSegments(requiredBlocks);
+			availableBlocks = headLimit - currentPos;
+		}
+		if (requiredBlocks > availableBlocks) {
+			//defragmentation will get desired blocks continuously.
+			defragment();
+		}
+		//now, currentPos should point to a continuous memory till end or points to end if full.
+		availableBlocks = headLimit - currentPos;
+		if (requiredBlocks > availableBlocks) {
+			//defrag didnt help. Disk is really full.
+			return false;
+		}
+	}
+
+	blockExtent run = { holeStart < blocksCount ? holeStart : currentPos,
+			requiredBlocks };
+	pieces.assign(1, run);
+	return true;
+}
+
+/************************************************************************
+ Function: findScatteredSpace
+ Description: Splits a write over the largest holes
+ Args:
+ requiredBlocks  unsigned long long      blocks to place
+ maxPieces       unsigned long long      most holes to use
+ pieces          vector<blockExtent>&    runs found, in order to write
+ Returns:
+ true if the blocks fit in at most maxPieces holes
+ false otherwise. pieces is left unchanged.
+ Notes:
+ Takes whole holes from the largest down until the rest of the write
+ fits in one, then the best fitting hole for the rest, so few large
+ holes are used and small ones are left alone. Each run starts at the
+ first block of its hole.
+ O(pieces * log runs) from the size keyed index of free runs.
+ ************************************************************************/
+
+bool findScatteredSpace(unsigned long long requiredBlocks,
+		unsigned long long maxPieces, vector<blockExtent> &pieces) {
+	vector<blockExtent> found;
+	unsigned long long remaining = requiredBlocks;
+	set<pair<unsigned long long, unsigned long long> >::reverse_iterator largest =
+			freeExtentsBySize.rbegin();
+	while (remaining > 0 && found.size() < maxPieces
+			&& largest != freeExtentsBySize.rend()) {
+		//holes after largest in size order are already taken
+		set<pair<unsigned long long, unsigned long long> >::iterator fit =
+				freeExtentsBySize.lower_bound(make_pair(remaining, 0ULL));
+		if (fit != freeExtentsBySize.end() && !(*largest < *fit)) {
+			blockExtent piece = { fit->second, remaining };
+			found.push_back(piece);
+			remaining = 0;
+			break;
+		}
+		blockExtent piece = { largest->second, largest->first };
+		found.push_back(piece);
+		remaining -= largest->first;
+		++largest;
+	}
+	if (remaining > 0) {
+		return false;
+	}
+	pieces.swap(found);
+	return true;
+}
+
+/************************************************************************
+ Function: placeBlocks
+ Description: Gives runs of empty blocks to a file
+ Args:
+ pieces      vector<blockExtent>     runs found by findWriteSpace()
+ fileId      unsigned long long      Id of the file
+ modified    unsigned long long      log clock of the write
+ Returns: none
+ Notes:
+ Caller holds allocGuard and updates extents of the file.
+ Moves log head past a run written at it or a hole running into it.
+ ************************************************************************/
+
+void placeBlocks(const vector<blockExtent> &pieces, unsigned long long fileId,
+		unsigned long long modified) {
+	for (size_t i = 0; i < pieces.size(); i++) {
+		unsigned long long writePos = pieces[i].start;
+		unsigned long long length = pieces[i].length;
+		assignBlocks(writePos, length, fileId);
+		writeImage(writePos, length, fileId);
+		ageSegments(writePos, length, modified);
+		if (writePos <= currentPos && writePos + length > currentPos) {
+			//written at log head or a hole running into it
+			currentPos = writePos + length;
+			headLimit = std::max(headLimit, currentPos);
+		}
+	}
+}
+
+/************************************************************************
+ Function: appendFile
+ Description: Extends an existing file by blocks at log head
+ Args:
+ command     parsedCommand   tokenized append() command
+ Returns: none
+ Notes:
+ Format: <file>, <size><B|KB|MB|GB>, with an optional log head hint as
+ in write(). Size must not be 0.
+ Only new blocks are written: size is rounded up to whole blocks and
+ placed like a write of that size, then linked to the file as more
+ extents, or merged with the last extent when it ends where they start.
+ With max extents, blocks may be split over as many holes as the file
+ has extents left, at least one.
+ Existing blocks of the file stay where they are.
+ On success, outputs file info as write() does, with the new size.
+ On failure, skips to next command.
+ ************************************************************************/
+
+void appendFile(const parsedCommand &command) {
+
+	if (command.argsError != NULL || command.size == 0) {
+		terminate(
+				"Critical error: Invalid syntax for append command: append(<file>, <size><B|KB|MB|GB>). Size must be a whole number greater than 0.");
+	}
+
+	string filepath = getAbsolutePath(sliceToString(command.path));
+	long double normalizedSize = convertSize(command.size,
+			unitNames[command.unit], "B");
+	long double normalizedDiskSize = convertSize(diskSize, diskUnit, "B");
+	long double normalizedBlockSize = convertSize(blockSize, blockUnit, "B");
+	if (normalizedSize > normalizedDiskSize) {
+		out << "Error: Cannot append more than disk capacity. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_APPEND, RESULT_NO_SPACE, filepath,
+				"Cannot append more than disk capacity");
+		return;
+	}
+	unsigned long long requiredBlocks = ceil(
+			normalizedSize / normalizedBlockSize);
+
+	//Background cleaner must not move blocks while allocating
+	allocGuard guard;
+
+	unsigned long long fileId = findFile(filepath);
+	if (fileId == 0) {
+		out << "No such file exists to append. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_APPEND, RESULT_NOT_FOUND, filepath,
+				"No such file exists to append");
+		return;
+	}
+
+	if (logHeads > 1) {
+		selectLogHead(classifyWrite(fileId, command.hint), requiredBlocks);
+	}
+
+	//extents the file already has count towards max extents
+	size_t extents = getFile(fileId).extents.size();
+	vector<blockExtent> pieces;
+	if (!findWriteSpace(requiredBlocks,
+			maxExtents > extents ? maxExtents - extents : 1, pieces)) {
+		out << "Not enough memory to append. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_APPEND, RESULT_NO_SPACE, filepath,
+				"Not enough memory to append");
+		return;
+	}
+
+	//found again, cleaning and defragmentation may have moved the file
+	file &f = getFile(fileId);
+	f.modified = ++logClock;
+	placeBlocks(pieces, fileId, f.modified);
+	for (size_t i = 0; i < pieces.size(); i++) {
+		if (!f.extents.empty()
+				&& f.extents.back().start + f.extents.back().length
+						== pieces[i].start) {
+			f.extents.back().length += pieces[i].length;
+		} else {
+			f.extents.push_back(pieces[i]);
+		}
+	}
+	f.allocatedBlocks += requiredBlocks;
+	f.allocatedFileSize += requiredBlocks * blockSize;
+	countWritten(f.parent, requiredBlocks);
+	wakeBackgroundCleaner();
+
+	unsigned long long startAddress = 0;
+	getStartingAddress(fileId, startAddress);
+	out << filepath << ", " << fileId << ", 0x" << hexNumber(startAddress)
+			<< ", " << f.allocatedFileSize << blockUnit << endLine;
+	emitFileRecord(COMMAND_APPEND, RESULT_OK, filepath, fileId);
+}
+
 /************************************************************************
  Function: defragment
  Description: Defragment and compacts disk space by adjusting memory blocks
  Args: none
- Returns: none
+ Returns:
+ unsigned long long      number of blocks moved
  Notes:
  Realigns memory blocks such that free space is available from
  current position to end unless memory is fully occupied.
+ Compaction itself is done by compactBlocks() without a limit.
  ************************************************************************/
-void defragment() {
+unsigned long long defragment() {
+
+	statsTimer timer(TIMER_DEFRAGMENT);
+	revokeLeases();
 
 	if (isMemoryFull()) {
 		//cannot defragment done
-		return;
+		return 0;
 	}
 	if (isMemoryEmpty()) {
 		//defragment not needed
-		return;
+		return 0;
 	}
 
-	//Design notes: After current position, it is either free space or end of memory.
+	defragmentCount++;
+	return compactBlocks(ULLONG_MAX);
 
-	long long i = 0;
-	long long j = 0;
+}
 
-	for (i = currentPos - 1; i >= 0; i--) {
+/************************************************************************
+ Function: compactBlocks
+ Description: Moves occupied blocks down into holes
+ Args:
+ maxBlocks   unsigned long long      stop after moving this many blocks
+ Returns:
+ unsigned long long      number of blocks moved
+ Notes:
+ Single pass with two positions: write position is the next hole to fill
+ and read position is the next occupied run after it. Each live block is
+ moved at most once and keeps its order, blocks before the first hole
+ are not touched.
+ With a cleaner policy, log head may be behind occupied blocks,
+ so compaction runs up to the last occupied block.
+ Whole extents are moved, so a limited pass can go a bit over maxBlocks.
+ A limited pass leaves a single hole where it stopped, next pass
+ continues from there. Current position is pulled back only when
+ every block is packed.
+ ************************************************************************/
+unsigned long long compactBlocks(unsigned long long maxBlocks) {
 
-		if ((memory[i] == -1) && (currentPos == i + 1)) {
-			//immediate empty space, pull the currentPos back
-			currentPos = i;
-		} else {
-			if (memory[i] == -1) {
-				for (int j = i; j < currentPos; j++) {
-					if (currentPos == j + 1) {
-						//prevent boundary overflow
-						memory[j] = -1;
-						currentPos--;
-					} else {
-						memory[j] = memory[j + 1];
-					}
-				}
+	//Design notes: After current position, it is either free space or end of memory.
 
-			}
+	unsigned long long lastUsed = findPrevBlock(blocksCount - 1, false);
+	unsigned long long lastPos = currentPos;
+	if (lastUsed < blocksCount) {
+		lastPos = std::max(currentPos, lastUsed + 1);
+	}
+	unsigned long long firstHole = findNextBlock(0, true);
+	unsigned long long writePos = firstHole;
+	unsigned long long readPos = firstHole;
+	unsigned long long moved = 0;
+	bool packed = false;
+
+	if (firstHole >= lastPos) {
+		//no holes before current position
+		currentPos = lastPos;
+		headLimit = blocksCount;
+		return 0;
+	}
+
+	unsigned long long firstSegment = firstHole / segmentBlocks;
+	unsigned long long lastSegment = (lastPos - 1) / segmentBlocks;
+	if (maxBlocks == ULLONG_MAX) {
+		//Segments after the first hole get their age from the data moved in
+		for (unsigned long long k = firstSegment + 1; k <= lastSegment; k++) {
+			segments[k].lastWrite = 0;
 		}
 	}
 
-	return;
+	while (true) {
+		readPos = findNextBlock(readPos, false);
+		if (readPos >= lastPos) {
+			packed = true;
+			break;
+		}
+		if (moved >= maxBlocks) {
+			break;
+		}
+		unsigned long long runEnd = std::min(findNextBlock(readPos, true),
+				lastPos);
+
+		//a run can hold several extents, move each one
+		while (readPos < runEnd && moved < maxBlocks) {
+			long long owner = memory[readPos];
+			unsigned long long length = relocateExtent(owner, readPos,
+					writePos);
+			countRelocated(owner, length, false);
+			ageSegments(writePos, length, getFile(owner).modified);
+			std::memmove(memory + writePos, memory + readPos,
+					length * sizeof(long long));
+			copyImage(readPos, writePos, length);
+			moved += length;
+			writePos += length;
+			readPos += length;
+		}
+	}
+
+	//Live blocks are now packed before write position
+	unsigned long long freeEnd = packed ? lastPos : readPos;
+	amplification.scanned += freeEnd - firstHole;
+	std::fill_n(memory + writePos, freeEnd - writePos, -1);
+	markFreeMap(firstHole, writePos - firstHole, false);
+	markFreeMap(writePos, freeEnd - writePos, true);
+	rebuildFreeExtents(firstHole, freeEnd);
+	recountSegments(firstHole, freeEnd);
+
+	if (packed) {
+		currentPos = writePos;
+		headLimit = blocksCount;
+	}
+
+	return moved;
 
 }
 
@@ -666,205 +1472,732 @@ void defragment() {
  Returns: none
  Notes:
  All blocks occupied by file are flagged empty.
+ Only the file's extents are visited, not the whole memory.
+ Clears the extent list of the file.
  ************************************************************************/
 
 void resetMemory(unsigned long long fileId) {
-	unsigned long long i = 0;
-	for (i = 0; i < blocksCount; i++) {
-		if (memory[i] == fileId) {
-			memory[i] = -1;
-		}
+	vector<blockExtent> &extents = getFile(fileId).extents;
+	for (size_t i = 0; i < extents.size(); i++) {
+		assignBlocks(extents[i].start, extents[i].length, -1);
 	}
+	extents.clear();
 }
 
 /************************************************************************
  Function: readFile
  Description: Reads file info of file from read() command
  Args:
- file    string      path to string from read() command
+ args    string      args of read() command (format: <file>[, <offset>, <length>])
  Returns: none
  Notes:
  Accepts relative and absolute file paths
  Searches if file exists
+ With a byte range, also reads the blocks of the range through the block
+ cache and outputs how many were cached.
  On success, outputs file info.
  On failure, skips to next command.
+ Syntax error: Terminates program
  ************************************************************************/
 
-void readFile(string file) {
+void readFile(string args) {
+	string file = args;
+	bool ranged = false;
+	unsigned long long offset = 0;
+	unsigned long long length = 0;
+	size_t comma = args.find(',');
+	if (comma != string::npos) {
+		size_t second = args.find(',', comma + 1);
+		if (comma == 0 || second == string::npos
+				|| args.find(',', second + 1) != string::npos
+				|| !parseByteCount(args.substr(comma + 1, second - comma - 1),
+						offset)
+				|| !parseByteCount(args.substr(second + 1), length)) {
+			terminate(
+					"Critical error: Invalid Syntax detected for: read command: read(<file>, <offset><B|KB|MB|GB>, <length><B|KB|MB|GB>)");
+		}
+		file = args.substr(0, comma);
+		ranged = true;
+	}
 	file = getAbsolutePath(file);
+
+	//Background cleaner must not move blocks while reading
+	allocGuard guard;
+
 	unsigned long long searchFileId = findFile(file);
 	if (searchFileId == 0) {
-		cout << "File not found: " << file << endl;
-		cout << "Skipping to next command..." << endl;
+		out << "File not found: " << file << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_READ, RESULT_NOT_FOUND, file, "File not found");
+		return;
+	}
+
+	string path = getFilePath(searchFileId);
+	if (ranged
+			&& (offset + length < offset
+					|| offset + length
+							> getFile(searchFileId).allocatedBlocks
+									* cacheBlockBytes)) {
+		out << "Read beyond end of file: " << path << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_READ, RESULT_REFUSED, path,
+				"Read beyond end of file");
 		return;
 	}
 
 	unsigned long long startAddress = 0;
 	getStartingAddress(searchFileId, startAddress);
 
-	cout << files[searchFileId].path << ", " << searchFileId << ", 0x"
-			<< std::hex << startAddress << ", " << std::dec
-			<< files[searchFileId].allocatedFileSize << blockUnit << endl;
+	out << path << ", " << searchFileId << ", 0x" << hexNumber(startAddress)
+			<< ", " << getFile(searchFileId).allocatedFileSize << blockUnit
+			<< endLine;
+	if (!ranged) {
+		emitFileRecord(COMMAND_READ, RESULT_OK, path, searchFileId);
+		return;
+	}
+
+	readStats stats = { 0, 0, 0, 0 };
+	readRange(searchFileId, offset, length, stats);
+	out << "Read " << length << "B at " << offset << "B: " << stats.blocks
+			<< " blocks, " << stats.hits << " hits, " << stats.misses
+			<< " misses, " << stats.ahead << " read ahead" << endLine;
+	emitReadRecord(path, searchFileId, stats);
 
 	return;
 }
 
-/************** Validators ************************************************/
-
 /************************************************************************
- Function: isComment
- Description: Checks if given input string/line is a comment
+ Function: readRange
+ Description: Reads blocks of a byte range of a file
  Args:
- line    string      input line to check
- Returns:
- true if comment
- false if not a comment
+ fileId  unsigned long long  file to read
+ offset  unsigned long long  first byte
+ length  unsigned long long  number of bytes, within allocated blocks
+ stats   readStats&          blocks of the range, hits and misses
+ Returns: none
  Notes:
- Comments start with #
+ Caller holds allocGuard.
+ A read starting where the previous read of the file ended is
+ sequential, and the next readaheadBlocks blocks of the file are fetched
+ into the cache too.
  ************************************************************************/
 
-bool isComment(string line) {
-	if (line.find_first_of("#") == 0) {
-		return true;
+void readRange(unsigned long long fileId, unsigned long long offset,
+		unsigned long long length, readStats &stats) {
+	if (length == 0) {
+		return;
 	}
-	return false;
+	file &f = getFile(fileId);
+	unsigned long long first = offset / cacheBlockBytes;
+	unsigned long long end = (offset + length - 1) / cacheBlockBytes + 1;
+	stats.blocks = end - first;
+	fetchFileBlocks(fileId, f, first, end - first, false, stats);
+	if (cacheShards != NULL && readaheadBlocks > 0 && f.readNext == first
+			&& end < f.allocatedBlocks) {
+		fetchFileBlocks(fileId, f, end,
+				std::min(readaheadBlocks, f.allocatedBlocks - end), true,
+				stats);
+	}
+	f.readNext = end;
+
+	cacheHits += stats.hits;
+	cacheMisses += stats.misses;
+	cacheReadahead += stats.ahead;
 }
 
 /************************************************************************
- Function: isValidCommand
- Description: Checks if given command is valid.
+ Function: renamePath
+ Description: Renames or moves a file or directory from args passed to rename() or mv() command
  Args:
- command     string      input command to validate
- Returns:
- true if command is valid
- false if command is invalid
+ args    string      source and target paths (format: <path>, <path>)
+ Returns: none
  Notes:
- Searches global commands list.
- It is a map with command name as unique key
- Todo:
+ Considers absolute and relative paths.
+ If source is a file, target is its new path. If target is an existing
+ directory or ends with '/', file is moved into it keeping its name.
+ If source is a directory, it is moved with everything below it. If
+ target is an existing directory, source is moved into it.
+ Only the entry in parent directory changes, cost does not depend on
+ number of files below a directory.
+ Current directory follows if it is moved.
+ On success, outputs old and new path.
+ On failure, skips to next command.
+ Syntax error: Terminates program
  ************************************************************************/
 
-bool isValidCommand(string command) {
+void renamePath(string args) {
 
-	if (commandsList.count(command) == 0) {
-		//Not a supported command
-		return false;
+	//Validate args
+	size_t commapos = args.find_first_of(",");
+	if (commapos == 0 || commapos == string::npos
+			|| commapos != args.find_last_of(",")
+			|| commapos == args.length() - 1) {
+		//Critical error: Bad syntax. Either no commas or more than one comma present.
+		terminate(
+				"Critical error: Invalid Syntax detected for: rename command: rename(<path>, <path>)");
 	}
-	return true;
-}
 
-/************************************************************************
- Function: isValidSyntax
- Description: General check for command syntax.
- Args:
- line        string   input full string/command to validate
- command     string&  if validated: command part is stored in this var
- args        string&  if validated: args part is stored in this var
- Returns:
- true if syntax is valid
- false if syntax is invalid
- Notes:
- Arguments check is done at respective command methods.
- It checks for following syntax format: <string>(<string(s)>)
- Rules:
- 1. Each command should start with char specified in
- validCommandStartPattern global var
- 2. Each command should have '(' and ')' and
- position('(') < position(')')
- 3. Between ( and ) are command args which is a string
- and rules within varies based on command.
- 4. After ')' only a comment is valid. Rest renders invalid syntax.
- On success,
- dissects the command and extracts command and arguments.
- ************************************************************************/
+	string source = getAbsolutePath(args.substr(0, commapos));
+	string target = getAbsolutePath(args.substr(commapos + 1));
+	string targetDirPath = target;
+	if (targetDirPath.find_last_of("/") != targetDirPath.length() - 1) {
+		targetDirPath = targetDirPath + "/";
+	}
+	unsigned long long intoDir = findDirectory(targetDirPath);
+
+	unsigned long long fileId = findFile(source);
+	if (fileId != 0) {
+		file &f = getFile(fileId);
+		unsigned long long newParent = noEntry;
+		unsigned long long newName = f.name;
+
+		if (intoDir != noEntry) {
+			newParent = intoDir;
+		} else if (target.find_last_of("/") == target.length() - 1) {
+			out << "Directory doesn't exist: " << target << endLine;
+			out << "Skipping to next command..." << endLine;
+			emitRecord(COMMAND_RENAME, RESULT_NOT_FOUND, target,
+					"Directory doesn't exist");
+			return;
+		} else {
+			size_t slash = target.find_last_of("/");
+			newParent = resolveDirectory(target, slash + 1, true);
+			newName = internName(target.substr(slash + 1));
+		}
+
+		if (directories[newParent].children.count(newName) != 0) {
+			string existing = getDirectoryPath(newParent) + names[newName];
+			out << "File already exists: " << existing << endLine;
+			out << "Skipping to next command..." << endLine;
+			emitRecord(COMMAND_RENAME, RESULT_EXISTS, existing,
+					"File already exists");
+			pruneDirectory(newParent);
+			return;
+		}
 
-bool isValidSyntax(string line, string &command, string &args) {
+		unsigned long long oldParent = f.parent;
+		directories[oldParent].children.erase(f.name);
+		linkFile(fileId, newParent, newName);
+		pruneDirectory(oldParent);
 
-	if (line.find_first_of(validCommandStartPattern) != 0) {
-		cout
-				<< "Invalid character found at beginning. Check for valid commands list."
-				<< endl;
-		return false;
+		string renamed = getFilePath(fileId);
+		out << "Renamed: " << source << " -> " << renamed << endLine;
+		emitRenameRecord(source, renamed);
+		return;
 	}
 
-	size_t lpos = line.find_first_of('(');
-	size_t rpos = line.find_first_of(')');
-
-	if (string::npos == lpos || string::npos == rpos) {
-		//either ( or ) missing
-		cout << "Bad syntax: Missing parenthesis" << endl;
-		return false;
-	} else if (lpos > rpos) {
-		//'(' occurs after ')'
-		cout << "Bad syntax: Bad parenthesis order." << endl;
-		return false;
+	string sourceDirPath = source;
+	if (sourceDirPath.find_last_of("/") != sourceDirPath.length() - 1) {
+		sourceDirPath = sourceDirPath + "/";
 	}
-	if (string::npos != rpos) {
-		//Something exists after ')'
-		string tail = line.substr(rpos + 1);
-		ltrim(tail);
-		//Ignore if it is only a whitespace or comment
-		if ("" != tail && !isComment(tail)) {
-			//This means command didn't terminate after ')'
-			cout
-					<< "Bad syntax: Only comments allowed after closing parenthesis."
-					<< endl;
-			return false;
-		}
+	unsigned long long dirId = findDirectory(sourceDirPath);
+	if (dirId == noEntry) {
+		out << "No such file or directory: " << source << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RENAME, RESULT_NOT_FOUND, source,
+				"No such file or directory");
+		return;
+	}
+	if (dirId == rootDirectory) {
+		out << "Cannot rename root directory. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RENAME, RESULT_REFUSED, sourceDirPath,
+				"Cannot rename root directory");
+		return;
 	}
 
-	//Valid syntaxt dissect the command.
-	command = line.substr(0, lpos);
-	args = line.substr(lpos + 1, rpos - lpos - 1);
-
-	return true;
-}
+	directory &dir = directories[dirId];
+	unsigned long long newParent = intoDir;
+	unsigned long long newName = dir.name;
+	if (intoDir == noEntry) {
+		//target is the new path of directory
+		size_t slash = targetDirPath.find_last_of("/", targetDirPath.length() - 2);
+		newParent = resolveDirectory(targetDirPath, slash + 1, true);
+		newName = internName(
+				targetDirPath.substr(slash + 1,
+						targetDirPath.length() - slash - 2));
+	}
 
-/************************************************************************
- Function: isNumber
- Description: Checks if a given string is a whole number in string representation
- Args:
- number  string      input string to check
- Returns:
- true if number
- false if not number
- Notes:
- Checks existence of (0-9)* digits in given string.
- Todo: Extend to fractions, negatives etc.
- ************************************************************************/
+	if (isAncestor(dirId, newParent)) {
+		out << "Cannot move a directory into itself: " << sourceDirPath << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RENAME, RESULT_REFUSED, sourceDirPath,
+				"Cannot move a directory into itself");
+		pruneDirectory(newParent);
+		return;
+	}
+	if (directories[newParent].subdirs.count(newName) != 0) {
+		string existing = getDirectoryPath(newParent) + names[newName] + "/";
+		out << "Directory already exists: " << existing << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RENAME, RESULT_EXISTS, existing,
+				"Directory already exists");
+		pruneDirectory(newParent);
+		return;
+	}
 
-/*
- Checks if given string is a number in string representation.
- */
-bool isNumber(string number) {
+	unsigned long long oldParent = dir.parent;
+	directories[oldParent].subdirs.erase(dir.name);
+	dir.parent = newParent;
+	dir.name = newName;
+	directories[newParent].subdirs[newName] = dirId;
+	pruneDirectory(oldParent);
 
-	if (number.find_first_not_of("0123456789") == string::npos) {
-		return true;
+	if (isAncestor(dirId, currentDirId)) {
+		currentDir = getDirectoryPath(currentDirId);
 	}
 
-	return false;
+	string renamed = getDirectoryPath(dirId);
+	out << "Renamed: " << sourceDirPath << " -> " << renamed << endLine;
+	emitRenameRecord(sourceDirPath, renamed);
+	return;
 }
 
-/************** Helper Methods ********************************************/
-
 /************************************************************************
- Function: removeSpaces
- Description: Removes space in a given string and compacts it.
+ Function: removeDirectory
+ Description: Removes an empty directory given in rmdir() command
  Args:
- line    string&     input string to remove spaces
+ args    string      path (format: <path>)
  Returns: none
  Notes:
- Helps in whitespace free formate convention.
- Todo: Extend to consider valid/volutary spaces.
+ Considers absolute and relative path.
+ Directory must have no files or directories in it. Root, current
+ directory and its parents cannot be removed.
+ On success, outputs removed directory.
+ On failure, skips to next command.
  ************************************************************************/
-void removeSpaces(string &line) {
-	line.erase(remove(line.begin(), line.end(), ' '), line.end());
-}
 
-/************************************************************************
- Function: ltrim
- Description: Trims all white space present on left of input string
- Args:
+void removeDirectory(string args) {
+
+	string temp = getAbsolutePath(args);
+
+	if (temp.find_last_of("/") != temp.length() - 1) {
+		temp = temp + "/";
+	}
+
+	unsigned long long dirId = findDirectory(temp);
+	if (dirId == noEntry) {
+		out << "Directory doesn't exist: " << temp << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RMDIR, RESULT_NOT_FOUND, temp,
+				"Directory doesn't exist");
+		return;
+	}
+	if (isAncestor(dirId, currentDirId)) {
+		out << "Cannot remove current directory or its parent: " << temp
+				<< endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RMDIR, RESULT_REFUSED, temp,
+				"Cannot remove current directory or its parent");
+		return;
+	}
+
+	directory &dir = directories[dirId];
+	if (!dir.subdirs.empty() || !dir.children.empty()) {
+		out << "Directory not empty: " << temp << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_RMDIR, RESULT_REFUSED, temp, "Directory not empty");
+		return;
+	}
+
+	unsigned long long parent = dir.parent;
+	directories[parent].subdirs.erase(dir.name);
+	addAmplification(directories[parent].amplification, dir.amplification);
+	directories.erase(dirId);
+	pruneDirectory(parent);
+
+	out << "Removed directory: " << temp << endLine;
+	emitRecord(COMMAND_RMDIR, RESULT_OK, temp, NULL);
+	return;
+}
+
+/************** Validators ************************************************/
+
+/************************************************************************
+ Function: isComment
+ Description: Checks if given input string/line is a comment
+ Args:
+ line    string      input line to check
+ Returns:
+ true if comment
+ false if not a comment
+ Notes:
+ Comments start with #. Spaces before # are ignored.
+ ************************************************************************/
+
+bool isComment(string line) {
+	size_t first = line.find_first_not_of(" ");
+	if (first != string::npos && line[first] == '#') {
+		return true;
+	}
+	return false;
+}
+
+/************************************************************************
+ Function: isNumber
+ Description: Checks if a given string is a whole number in string representation
+ Args:
+ number  string      input string to check
+ Returns:
+ true if number
+ false if not number
+ Notes:
+ Checks existence of (0-9)* digits in given string.
+ Todo: Extend to fractions, negatives etc.
+ ************************************************************************/
+
+/*
+ Checks if given string is a number in string representation.
+ */
+bool isNumber(string number) {
+
+	if (number.find_first_not_of("0123456789") == string::npos) {
+		return true;
+	}
+
+	return false;
+}
+
+/************** Tokenizer *************************************************/
+
+/************************************************************************
+ Function: tokenizeLine
+ Description: Tokenizes an input line
+ Args:
+ line        string&         input line, spaces are removed in place
+ command     parsedCommand&  tokenized command
+ Returns:
+ true if syntax is valid
+ false if syntax is invalid
+ Notes:
+ See tokenizeText. Slices stay valid until line changes.
+ ************************************************************************/
+
+bool tokenizeLine(string &line, parsedCommand &command) {
+	bool isValid = tokenizeText(&line[0], line.length(), command);
+	line.resize(command.line.length);
+	return isValid;
+}
+
+/************************************************************************
+ Function: tokenizeText
+ Description: Splits a line of text into command and args in one pass
+ Args:
+ text        char*           first char of line, spaces are removed in place
+ length      size_t          length of line without newline
+ command     parsedCommand&  tokenized command
+ Returns:
+ true if syntax is valid
+ false if syntax is invalid
+ Notes:
+ Line, name and args are slices of text. No memory is allocated and no
+ global state is used, so lines can be tokenized in parallel.
+ It checks for following syntax format: <string>(<string(s)>)
+ Rules:
+ 1. Each command should start with a lower case letter
+ 2. Each command should have '(' and ')' and
+ position('(') < position(')')
+ 3. Between ( and ) are command args which is a string
+ and rules within varies based on command.
+ 4. After ')' only a comment is valid. Rest renders invalid syntax.
+ On failure, syntaxError is set. It is output when command is executed.
+ Unsupported command names are returned as COMMAND_UNKNOWN.
+ For write(), args are also parsed (see parseWriteArgs).
+ ************************************************************************/
+
+bool tokenizeText(char *text, size_t length, parsedCommand &command) {
+
+	//Remove spaces and find first '(' and ')' in same pass
+	size_t lpos = string::npos;
+	size_t rpos = string::npos;
+	size_t compacted = 0;
+	for (size_t i = 0; i < length; i++) {
+		char c = text[i];
+		if (c == ' ') {
+			continue;
+		}
+		if (c == '(' && lpos == string::npos) {
+			lpos = compacted;
+		} else if (c == ')' && rpos == string::npos) {
+			rpos = compacted;
+		}
+		text[compacted++] = c;
+	}
+	length = compacted;
+
+	command.line.data = text;
+	command.line.length = length;
+	command.type = COMMAND_UNKNOWN;
+	command.syntaxError = NULL;
+
+	if (length == 0 || text[0] < 'a' || text[0] > 'z') {
+		command.syntaxError =
+				"Invalid character found at beginning. Check for valid commands list.";
+		return false;
+	}
+
+	if (string::npos == lpos || string::npos == rpos) {
+		//either ( or ) missing
+		command.syntaxError = "Bad syntax: Missing parenthesis";
+		return false;
+	} else if (lpos > rpos) {
+		//'(' occurs after ')'
+		command.syntaxError = "Bad syntax: Bad parenthesis order.";
+		return false;
+	}
+
+	//Ignore if only a whitespace or comment exists after ')'
+	size_t tail = rpos + 1;
+	while (tail < length && text[tail] == '\t') {
+		tail++;
+	}
+	if (tail < length && text[tail] != '#') {
+		//This means command didn't terminate after ')'
+		command.syntaxError =
+				"Bad syntax: Only comments allowed after closing parenthesis.";
+		return false;
+	}
+
+	//Valid syntax dissect the command.
+	command.name.data = text;
+	command.name.length = lpos;
+	command.args.data = text + lpos + 1;
+	command.args.length = rpos - lpos - 1;
+	command.type = lookupCommand(command.name);
+	command.path.data = command.args.data;
+	command.path.length = 0;
+	command.size = 0;
+	command.unit = UNIT_NONE;
+	command.hint = noHint;
+	command.argsError = NULL;
+
+	if (command.type == COMMAND_WRITE || command.type == COMMAND_APPEND) {
+		parseWriteArgs(command);
+	}
+	return true;
+}
+
+/************************************************************************
+ Function: lookupCommand
+ Description: Gets command type for a command name
+ Args:
+ name    textSlice   command name
+ Returns:
+ commandType     COMMAND_UNKNOWN if not a supported command
+ Notes:
+ Searches global commands list.
+ ************************************************************************/
+
+commandType lookupCommand(textSlice name) {
+	for (size_t i = 0; i < commandsCount; i++) {
+		if (commandsList[i].length == name.length
+				&& memcmp(commandsList[i].name, name.data, name.length) == 0) {
+			return commandsList[i].type;
+		}
+	}
+	return COMMAND_UNKNOWN;
+}
+
+/************************************************************************
+ Function: parseWriteArgs
+ Description: Parses file and size from args of write() command
+ Args:
+ command     parsedCommand&  tokenized write() command
+ Returns: none
+ Notes:
+ Format: <file>, <size><B|KB|MB|GB>. Only 0 is allowed without units.
+ An optional third arg is a log head hint: hot, cold or a head number.
+ On success, sets path, size, unit and hint.
+ On failure, sets argsError. Error is reported when command is
+ executed, so wrong command order is reported first in init().
+ ************************************************************************/
+
+void parseWriteArgs(parsedCommand &command) {
+
+	const char *args = command.args.data;
+	size_t len = command.args.length;
+
+	//One ',' with file before it and size after it, a second one before hint
+	const char *comma = (const char *) memchr(args, ',', len);
+	const char *hint = comma == NULL ? NULL :
+			(const char *) memchr(comma + 1, ',', args + len - comma - 1);
+	if (hint != NULL) {
+		len = hint - args;
+		hint++;
+	}
+	if (comma == NULL || comma == args || comma == args + len - 1
+			|| (hint != NULL
+					&& memchr(hint, ',', command.args.data
+							+ command.args.length - hint) != NULL)) {
+		command.argsError =
+				"Critical error: Invalid Syntax detected for: write command: write(<file>, <size><B|KB|MB|GB>)";
+		return;
+	}
+	command.path.data = args;
+	command.path.length = comma - args;
+
+	if (hint != NULL) {
+		size_t hintLength = command.args.data + command.args.length - hint;
+		unsigned long long head = 0;
+		if (hintLength == 3 && memcmp(hint, "hot", 3) == 0) {
+			command.hint = LLONG_MAX;
+		} else if (hintLength == 4 && memcmp(hint, "cold", 4) == 0) {
+			command.hint = 0;
+		} else if (hintLength <= 9 && parseWholeNumber(hint, hintLength, head)) {
+			command.hint = head;
+		} else {
+			command.argsError =
+					"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>, <hot|cold|head>). Hint must be hot, cold or a head number.";
+			return;
+		}
+	}
+
+	const char *size = comma + 1;
+	size_t sizeLength = args + len - size;
+	while (sizeLength > 0 && *size == '\t') {
+		size++;
+		sizeLength--;
+	}
+
+	//only size = 0 is allowed without units.
+	if (sizeLength == 1) {
+		if (*size != '0') {
+			command.argsError =
+					"Critical error: Invalid Syntax detected for: write command: write(<file>, <size><B|KB|MB|GB>). Only 0 is allowed without units.";
+		}
+		return;
+	}
+
+	//Fail safe. Every unit ends with B.
+	if (sizeLength == 0 || size[sizeLength - 1] != 'B') {
+		command.argsError =
+				"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>). Unit must be B|KB|MB|GB.";
+		return;
+	}
+
+	unsigned long long value = 0;
+	if (parseWholeNumber(size, sizeLength - 1, value)) {
+		command.size = value;
+		command.unit = UNIT_B;
+		return;
+	}
+
+	//Unit is KB|MB|GB
+	bool isWhole = parseWholeNumber(size, sizeLength - 2, value);
+	if (!isWhole && sizeLength > 2) {
+		command.argsError =
+				"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>). Size must be whole number.";
+		return;
+	}
+	switch (size[sizeLength - 2]) {
+	case 'K':
+		command.unit = UNIT_KB;
+		break;
+	case 'M':
+		command.unit = UNIT_MB;
+		break;
+	case 'G':
+		command.unit = UNIT_GB;
+		break;
+	default:
+		command.argsError =
+				"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>): Unit must be B|KB|MB|GB.";
+		return;
+	}
+	if (!isWhole) {
+		//Unit without size
+		command.argsError =
+				"Critical error: Invalid syntax for write command: write(<file>, <size><B|KB|MB|GB>). Size must be whole number.";
+		return;
+	}
+	command.size = value;
+	return;
+}
+
+/************************************************************************
+ Function: parseWholeNumber
+ Description: Parses a whole number from a run of digits
+ Args:
+ text    const char*             first char
+ length  size_t                  number of chars
+ value   unsigned long long&     parsed number
+ Returns:
+ true if text is one or more digits and fits in value
+ false otherwise
+ ************************************************************************/
+
+bool parseWholeNumber(const char *text, size_t length,
+		unsigned long long &value) {
+	if (length == 0) {
+		return false;
+	}
+	value = 0;
+	for (size_t i = 0; i < length; i++) {
+		unsigned digit = (unsigned char) text[i] - '0';
+		if (digit > 9 || value > (ULLONG_MAX - digit) / 10) {
+			return false;
+		}
+		value = value * 10 + digit;
+	}
+	return true;
+}
+
+/************************************************************************
+ Function: parseByteCount
+ Description: Parses a byte count of read() command
+ Args:
+ text    string                  count, with optional B|KB|MB|GB unit
+ bytes   unsigned long long&     count in bytes
+ Returns:
+ true if text is a whole number, optionally followed by a unit, that
+ fits in bytes
+ false otherwise
+ Notes:
+ Surrounding spaces and tabs are ignored.
+ ************************************************************************/
+
+bool parseByteCount(string text, unsigned long long &bytes) {
+	size_t begin = text.find_first_not_of(" \t");
+	if (begin == string::npos) {
+		return false;
+	}
+	text = text.substr(begin, text.find_last_not_of(" \t") - begin + 1);
+
+	size_t digits = text.find_first_not_of("0123456789");
+	if (digits == string::npos) {
+		digits = text.length();
+	}
+	string unit = digits < text.length() ? text.substr(digits) : "B";
+	unsigned long long multiplier = convertSize(1, unit, "B");
+	unsigned long long value = 0;
+	if (multiplier == 0 || unit.compare("TB") == 0
+			|| !parseWholeNumber(text.data(), digits, value)
+			|| value > ULLONG_MAX / multiplier) {
+		return false;
+	}
+	bytes = value * multiplier;
+	return true;
+}
+
+/************************************************************************
+ Function: sliceToString
+ Description: Copies a slice of input line to a string
+ Args:
+ slice   textSlice   slice to copy
+ Returns:
+ string  copy of slice
+ ************************************************************************/
+
+string sliceToString(textSlice slice) {
+	return string(slice.data, slice.length);
+}
+
+/************** Helper Methods ********************************************/
+
+/************************************************************************
+ Function: ltrim
+ Description: Trims all white space present on left of input string
+ Args:
  line    string&     input string to trim
  Returns: none
  Notes: Helps in whitespace free formate convention.
@@ -1056,21 +2389,19 @@ unsigned long long convertSize(unsigned long long size, string fromUnit,
  false if not full
  Notes:
  Stops checking if it finds any empty block
+ Scans free space bitmap a word at a time from the end.
  If full, current position is set to number of blocks.
  Helps in writing and defragmentation.
  ************************************************************************/
 bool isMemoryFull() {
 
 	unsigned long long firstHit = blocksCount;
-	long long i = 0;
-	for (i = blocksCount - 1; i >= 0; i--) {
-		if ((memory[i] == -1) && (firstHit == blocksCount)) {
-			firstHit = i;
-			break;
-		}
+	if (blocksCount > 0) {
+		firstHit = findPrevBlock(blocksCount - 1, true);
 	}
 	if (firstHit == blocksCount) {
 		currentPos = blocksCount;
+		headLimit = blocksCount;
 		return true; //memory full
 	}
 	return false;
@@ -1085,25 +2416,18 @@ bool isMemoryFull() {
  false if not empty
  Notes:
  Stops checking if it finds any occupied block
+ Scans free space bitmap a word at a time.
  If empty, current position is set to start.
  Helps in reading, writing and defragmentation.
  ************************************************************************/
 
 bool isMemoryEmpty() {
 
-	unsigned long long firstHit = blocksCount;
-	long long i = 0;
-
-	for (i = blocksCount - 1; i >= 0; i--) {
-
-		if ((memory[i] != -1)) {
-			firstHit = i;
-			break;
-		}
-	}
+	unsigned long long firstHit = findNextBlock(0, false);
 
 	if (firstHit == blocksCount) {
 		currentPos = 0;
+		headLimit = blocksCount;
 		return true; //memory empty
 	}
 
@@ -1120,19 +2444,31 @@ bool isMemoryEmpty() {
  0 if not found
  Notes:
  File list is a map with file id's as unique keys.
+ Path is resolved one component at a time through directory child
+ tables, so cost depends on path depth only.
  Helps in writing, reading and updating files.
  Todo:
  ************************************************************************/
 
-unsigned long long findFile(string filepath) {
+unsigned long long findFile(const string &filepath) {
 
-	for (map<unsigned long long, file>::iterator i = files.begin();
-			i != files.end(); ++i) {
-		if ((((*i).second.path).compare(filepath)) == 0) {
-			return (*i).first;
-		}
+	statsTimer timer(TIMER_FIND_FILE);
+	size_t slash = filepath.find_last_of("/");
+	if (slash == string::npos) {
+		return 0;
 	}
-	return 0;
+	unsigned long long dirId = resolveDirectory(filepath, slash + 1, false);
+	unsigned long long name = findName(filepath.substr(slash + 1));
+	if (dirId == noEntry || name == noEntry) {
+		return 0;
+	}
+	directory &dir = directories[dirId];
+	unordered_map<unsigned long long, unsigned long long>::iterator i =
+			dir.children.find(name);
+	if (i == dir.children.end()) {
+		return 0;
+	}
+	return (*i).second;
 }
 
 /************************************************************************
@@ -1150,14 +2486,7 @@ unsigned long long getTotalAvailableBlocks() {
 	if (isMemoryFull()) {
 		return 0;
 	}
-	unsigned long long i = 0;
-	unsigned long long count = 0;
-	for (i = 0; i < blocksCount; i++) {
-		if (memory[i] == -1) {
-			count++;
-		}
-	}
-	return count;
+	return countFreeBlocks();
 }
 
 /************************************************************************
@@ -1168,20 +2497,20 @@ unsigned long long getTotalAvailableBlocks() {
  address     unsigned long long&     stores the starting address
  Returns: none
  Notes:
- Searches memory blocks and calculates address based on position
+ Takes the first block of file from its extents and calculates address
+ based on position
  Helps in file info output
  ************************************************************************/
 void getStartingAddress(unsigned long long fileId,
 		unsigned long long &address) {
 
+	statsTimer timer(TIMER_STARTING_ADDRESS);
 	unsigned long long blockPosition = 0;
 
-	for (unsigned long long i = 0; i < blocksCount; i++) {
-		if (memory[i] == fileId) {
-			//get the first position of file id in memory
-			blockPosition = i;
-			break;
-		}
+	file *f = lookupFile(fileId);
+	if (f != NULL && !f->extents.empty()) {
+		//get the first position of file id in memory
+		blockPosition = f->extents[0].start;
 	}
 
 	unsigned long long blockSizeInBytes = convertSize(blockSize, blockUnit,
@@ -1190,25 +2519,5425 @@ void getStartingAddress(unsigned long long fileId,
 	return;
 }
 
-/*******************  Cleanup  **************************************************/
+/************************************************************************
+ Function: relocateExtent
+ Description: Updates the extent of a file after its blocks are moved
+ Args:
+ fileId      unsigned long long      Id of the file owning the blocks
+ oldStart    unsigned long long      block position before the move
+ newStart    unsigned long long      block position after the move
+ Returns:
+ unsigned long long      length of the moved extent
+ Notes:
+ Used by defragment(). Only the extent starting at oldStart is changed.
+ ************************************************************************/
+
+unsigned long long relocateExtent(unsigned long long fileId, unsigned long long oldStart,
+		unsigned long long newStart) {
+	vector<blockExtent> &extents = getFile(fileId).extents;
+	for (size_t i = 0; i < extents.size(); i++) {
+		if (extents[i].start == oldStart) {
+			extents[i].start = newStart;
+			return extents[i].length;
+		}
+	}
+	return 1;
+}
+
+/************** Namespace *************************************************/
 
 /************************************************************************
- Function: terminate
- Description: Terminates the program and cleanups memory.
+ Function: internName
+ Description: Gets id of a path component, adding it if new
  Args:
- message     string      message to output before terminating
- Returns: none
+ name    string      path component without '/'
+ Returns:
+ unsigned long long      name id
  Notes:
- Controlled termination
- Cleanups memory and prevents leaks.
- Exits with EXIT_FAILURE
+ Each distinct component is stored once and shared by every file and
+ directory with that name.
  ************************************************************************/
 
-void terminate(string message) {
-	cout << message << endl;
-	cout << "Terminating..." << endl;
-	if (memory) {
-		delete[] memory;
+unsigned long long internName(const string &name) {
+	unordered_map<string, unsigned long long>::iterator i = nameIds.find(name);
+	if (i != nameIds.end()) {
+		return (*i).second;
+	}
+	names.push_back(name);
+	nameIds[name] = names.size() - 1;
+	return names.size() - 1;
+}
+
+/************************************************************************
+ Function: findName
+ Description: Gets id of a path component without adding it
+ Args:
+ name    string      path component without '/'
+ Returns:
+ unsigned long long      name id
+ noEntry if never used
+ ************************************************************************/
+
+unsigned long long findName(const string &name) {
+	unordered_map<string, unsigned long long>::iterator i = nameIds.find(name);
+	if (i == nameIds.end()) {
+		return noEntry;
+	}
+	return (*i).second;
+}
+
+/************************************************************************
+ Function: makeDirectory
+ Description: Adds a directory under a parent directory
+ Args:
+ parent  unsigned long long      directory id of parent
+ name    unsigned long long      name id
+ Returns:
+ unsigned long long      directory id
+ Notes:
+ New directory is implied: it is not visible to chdir() until mkdir()
+ marks it created.
+ ************************************************************************/
+
+unsigned long long makeDirectory(unsigned long long parent,
+		unsigned long long name) {
+	unsigned long long dirId = nextDirectoryId++;
+	directory &dir = directories[dirId];
+	dir.parent = parent;
+	dir.name = name;
+	dir.created = false;
+	directories[parent].subdirs[name] = dirId;
+	return dirId;
+}
+
+/************************************************************************
+ Function: resolveDirectory
+ Description: Walks an absolute path to its directory
+ Args:
+ path    string      absolute path
+ end     size_t      length of directory part of path, ends with '/'
+ create  bool        add missing directories as implied ones
+ Returns:
+ unsigned long long      directory id
+ noEntry if a component is missing and create is false
+ Notes:
+ Components are split on '/'. Empty components (Eg: "//") are kept as
+ names so paths are stored exactly as given.
+ ************************************************************************/
+
+unsigned long long resolveDirectory(const string &path, size_t end,
+		bool create) {
+	unsigned long long dirId = rootDirectory;
+	size_t pos = path.find_first_of("/") == 0 ? 1 : 0;
+	while (pos < end) {
+		size_t next = path.find("/", pos);
+		if (next == string::npos || next >= end) {
+			next = end;
+		}
+		string component = path.substr(pos, next - pos);
+		unsigned long long name =
+				create ? internName(component) : findName(component);
+		if (name == noEntry) {
+			return noEntry;
+		}
+		directory &dir = directories[dirId];
+		unordered_map<unsigned long long, unsigned long long>::iterator i =
+				dir.subdirs.find(name);
+		if (i != dir.subdirs.end()) {
+			dirId = (*i).second;
+		} else if (create) {
+			dirId = makeDirectory(dirId, name);
+		} else {
+			return noEntry;
+		}
+		pos = next + 1;
+	}
+	return dirId;
+}
+
+/************************************************************************
+ Function: addDirectory
+ Description: Marks a directory created for mkdir()
+ Args:
+ path    string      absolute directory path ending with '/'
+ Returns:
+ true if directory is created now
+ false if it already exists
+ ************************************************************************/
+
+bool addDirectory(const string &path) {
+	directory &dir = directories[resolveDirectory(path, path.length(), true)];
+	if (dir.created) {
+		return false;
+	}
+	dir.created = true;
+	return true;
+}
+
+/************************************************************************
+ Function: findDirectory
+ Description: Finds a directory created by mkdir()
+ Args:
+ path    string      absolute directory path ending with '/'
+ Returns:
+ unsigned long long      directory id
+ noEntry if not found or only implied by a file path
+ ************************************************************************/
+
+unsigned long long findDirectory(const string &path) {
+	unsigned long long dirId = resolveDirectory(path, path.length(), false);
+	if (dirId == noEntry || !directories[dirId].created) {
+		return noEntry;
+	}
+	return dirId;
+}
+
+/************************************************************************
+ Function: linkFile
+ Description: Adds a file to a directory
+ Args:
+ fileId  unsigned long long      Id of the file
+ dirId   unsigned long long      directory id
+ name    unsigned long long      name id
+ Returns: none
+ ************************************************************************/
+
+void linkFile(unsigned long long fileId, unsigned long long dirId,
+		unsigned long long name) {
+	file &f = getFile(fileId);
+	f.parent = dirId;
+	f.name = name;
+	directories[dirId].children[name] = fileId;
+}
+
+/************************************************************************
+ Function: unlinkFile
+ Description: Removes a file from its directory
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns: none
+ Notes:
+ Implied directories left empty are removed.
+ ************************************************************************/
+
+void unlinkFile(unsigned long long fileId) {
+	file &f = getFile(fileId);
+	directories[f.parent].children.erase(f.name);
+	pruneDirectory(f.parent);
+}
+
+/************************************************************************
+ Function: pruneDirectory
+ Description: Removes a directory and its parents while they are implied and empty
+ Args:
+ dirId   unsigned long long      directory id
+ Returns: none
+ Notes:
+ Directories created by mkdir() are kept until rmdir().
+ ************************************************************************/
+
+void pruneDirectory(unsigned long long dirId) {
+	while (dirId != rootDirectory) {
+		directory &dir = directories[dirId];
+		if (dir.created || !dir.subdirs.empty() || !dir.children.empty()) {
+			return;
+		}
+		unsigned long long parent = dir.parent;
+		directories[parent].subdirs.erase(dir.name);
+		addAmplification(directories[parent].amplification, dir.amplification);
+		directories.erase(dirId);
+		dirId = parent;
+	}
+}
+
+/************************************************************************
+ Function: isAncestor
+ Description: Checks if a directory is another directory or one of its parents
+ Args:
+ ancestor    unsigned long long      directory id to look for
+ dirId       unsigned long long      directory id to start from
+ Returns:
+ true if ancestor is dirId or above it
+ false otherwise
+ ************************************************************************/
+
+bool isAncestor(unsigned long long ancestor, unsigned long long dirId) {
+	while (true) {
+		if (dirId == ancestor) {
+			return true;
+		}
+		if (dirId == rootDirectory) {
+			return false;
+		}
+		dirId = directories[dirId].parent;
+	}
+}
+
+/************************************************************************
+ Function: getDirectoryPath
+ Description: Builds absolute path of a directory
+ Args:
+ dirId   unsigned long long      directory id
+ Returns:
+ string  absolute path ending with '/'
+ Notes:
+ Walks parents up to root, cost depends on depth only.
+ ************************************************************************/
+
+string getDirectoryPath(unsigned long long dirId) {
+	vector<unsigned long long> parts;
+	while (dirId != rootDirectory) {
+		directory &dir = directories[dirId];
+		parts.push_back(dir.name);
+		dirId = dir.parent;
+	}
+	string path = "/";
+	for (size_t i = parts.size(); i > 0; i--) {
+		path += names[parts[i - 1]];
+		path += "/";
+	}
+	return path;
+}
+
+/************************************************************************
+ Function: getFilePath
+ Description: Builds absolute path of a file
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns:
+ string  absolute path
+ ************************************************************************/
+
+string getFilePath(unsigned long long fileId) {
+	file &f = getFile(fileId);
+	return getDirectoryPath(f.parent) + names[f.name];
+}
+
+/************** File table ************************************************/
+
+/************************************************************************
+ Function: getFileShard
+ Description: Gets shard of file list holding a file id
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns:
+ fileShard&      shard
+ Notes:
+ Consecutive ids go to different shards, so concurrent writers seldom
+ wait on the same shard lock.
+ ************************************************************************/
+
+fileShard &getFileShard(unsigned long long fileId) {
+	return fileShards[fileId % fileShardCount];
+}
+
+/************************************************************************
+ Function: getFile
+ Description: Gets file info, adding it if missing
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns:
+ file&   file info, stays valid until file is erased
+ Notes:
+ Caller holds allocLock, or the shard lock in a concurrent writer.
+ ************************************************************************/
+
+file &getFile(unsigned long long fileId) {
+	return getFileShard(fileId).files[fileId];
+}
+
+/************************************************************************
+ Function: lookupFile
+ Description: Finds file info
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns:
+ file*   file info, NULL if no such file
+ ************************************************************************/
+
+file *lookupFile(unsigned long long fileId) {
+	map<unsigned long long, file> &shard = getFileShard(fileId).files;
+	map<unsigned long long, file>::iterator it = shard.find(fileId);
+	if (it == shard.end()) {
+		return NULL;
+	}
+	return &it->second;
+}
+
+/************************************************************************
+ Function: eraseFile
+ Description: Removes file info from file list
+ Args:
+ fileId  unsigned long long      Id of the file
+ Returns: none
+ ************************************************************************/
+
+void eraseFile(unsigned long long fileId) {
+	getFileShard(fileId).files.erase(fileId);
+}
+
+/************** Free space bitmap ****************************************/
+
+/************************************************************************
+ Function: assignBlocks
+ Description: Sets owner of a run of blocks
+ Args:
+ start   unsigned long long      first block of the run
+ length  unsigned long long      number of blocks in the run
+ owner   long long               file id or -1 for empty
+ Returns: none
+ Notes:
+ Keeps memory, free space bitmap, free extent index and segment live
+ blocks in sync.
+ Run must be all empty when assigning a file and all occupied when
+ assigning -1.
+ ************************************************************************/
+
+void assignBlocks(unsigned long long start, unsigned long long length,
+		long long owner) {
+	std::fill_n(memory + start, length, owner);
+	markFreeMap(start, length, owner == -1);
+	if (owner == -1) {
+		addFreeExtent(start, length);
+	} else {
+		removeFreeExtent(start, length);
+	}
+
+	unsigned long long end = start + length;
+	while (start < end) {
+		unsigned long long k = start / segmentBlocks;
+		unsigned long long segEnd = std::min((k + 1) * segmentBlocks, end);
+		if (owner == -1) {
+			setSegmentLive(k, segments[k].liveBlocks - (segEnd - start));
+		} else {
+			setSegmentLive(k, segments[k].liveBlocks + (segEnd - start));
+		}
+		start = segEnd;
+	}
+	if (owner == -1 && length > 0) {
+		freeGeneration++;
+	}
+}
+
+/************************************************************************
+ Function: markFreeMap
+ Description: Flags a run of blocks as empty or occupied in free space bitmap
+ Args:
+ start   unsigned long long      first block of the run
+ length  unsigned long long      number of blocks in the run
+ isFree  bool                    true to flag empty, false to flag occupied
+ Returns: none
+ Notes:
+ Whole words are set at once, only the partial words at both ends are masked.
+ Bits past blocksCount are never set.
+ ************************************************************************/
+
+void markFreeMap(unsigned long long start, unsigned long long length,
+		bool isFree) {
+	if (length == 0) {
+		return;
+	}
+	unsigned long long end = start + length; //exclusive
+	unsigned long long first = start / 64;
+	unsigned long long last = (end - 1) / 64;
+
+	for (unsigned long long w = first; w <= last; w++) {
+		unsigned long long mask = ~0ULL;
+		if (w == first) {
+			mask &= ~0ULL << (start % 64);
+		}
+		if (w == last && end % 64 != 0) {
+			mask &= ~0ULL >> (64 - end % 64);
+		}
+		if (isFree) {
+			freeMap[w] |= mask;
+		} else {
+			freeMap[w] &= ~mask;
+		}
+	}
+}
+
+/************************************************************************
+ Function: countFreeBlocks
+ Description: Counts empty blocks in free space bitmap
+ Args: none
+ Returns:
+ unsigned long long      number of empty blocks
+ Notes:
+ Population count of every word.
+ ************************************************************************/
+
+unsigned long long countFreeBlocks() {
+	return countFreeRange(0, blocksCount);
+}
+
+/************************************************************************
+ Function: countFreeRange
+ Description: Counts empty blocks in a range of free space bitmap
+ Args:
+ start   unsigned long long      first block of the range
+ end     unsigned long long      block after the range
+ Returns:
+ unsigned long long      number of empty blocks
+ Notes:
+ Partial words at both ends are masked. Four accumulators keep
+ independent popcounts in flight.
+ ************************************************************************/
+
+unsigned long long countFreeRange(unsigned long long start,
+		unsigned long long end) {
+	if (start >= end) {
+		return 0;
+	}
+	unsigned long long first = start / 64;
+	unsigned long long last = (end - 1) / 64;
+	unsigned long long headMask = ~0ULL << (start % 64);
+	unsigned long long tailMask = end % 64 ? ~0ULL >> (64 - end % 64) : ~0ULL;
+
+	if (first == last) {
+		return __builtin_popcountll(freeMap[first] & headMask & tailMask);
+	}
+
+	unsigned long long c0 = __builtin_popcountll(freeMap[first] & headMask);
+	unsigned long long c1 = 0, c2 = 0, c3 = 0;
+	unsigned long long w = first + 1;
+	for (; w + 4 <= last; w += 4) {
+		c0 += __builtin_popcountll(freeMap[w]);
+		c1 += __builtin_popcountll(freeMap[w + 1]);
+		c2 += __builtin_popcountll(freeMap[w + 2]);
+		c3 += __builtin_popcountll(freeMap[w + 3]);
+	}
+	for (; w < last; w++) {
+		c0 += __builtin_popcountll(freeMap[w]);
+	}
+	c0 += __builtin_popcountll(freeMap[last] & tailMask);
+	return c0 + c1 + c2 + c3;
+}
+
+/************************************************************************
+ Function: findNextBlock
+ Description: Finds first empty or occupied block at or after a position
+ Args:
+ from    unsigned long long      block to start search from
+ isFree  bool                    true to find empty, false to find occupied
+ Returns:
+ unsigned long long      block position
+ blocksCount if not found
+ Notes:
+ Skips uniform words 64 blocks at a time, 256 blocks at a time with AVX2.
+ ************************************************************************/
+
+unsigned long long findNextBlock(unsigned long long from, bool isFree) {
+	if (from >= blocksCount) {
+		return blocksCount;
+	}
+	unsigned long long flip = isFree ? 0 : ~0ULL; //search for set bits
+	unsigned long long w = from / 64;
+	unsigned long long bits = (freeMap[w] ^ flip) & (~0ULL << (from % 64));
+
+	while (bits == 0) {
+		w++;
+#ifdef __AVX2__
+		__m256i skip = _mm256_set1_epi64x(flip);
+		while (w + 4 <= freeMapWords) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) (freeMap + w));
+			if (!_mm256_testz_si256(_mm256_xor_si256(v, skip),
+					_mm256_set1_epi64x(-1))) {
+				break;
+			}
+			w += 4;
+		}
+#endif
+		if (w >= freeMapWords) {
+			return blocksCount;
+		}
+		bits = freeMap[w] ^ flip;
+	}
+
+	unsigned long long pos = w * 64 + __builtin_ctzll(bits);
+	return pos < blocksCount ? pos : blocksCount;
+}
+
+/************************************************************************
+ Function: findPrevBlock
+ Description: Finds last empty or occupied block at or before a position
+ Args:
+ from    unsigned long long      block to start search from
+ isFree  bool                    true to find empty, false to find occupied
+ Returns:
+ unsigned long long      block position
+ blocksCount if not found
+ Notes:
+ Reverse of findNextBlock()
+ ************************************************************************/
+
+unsigned long long findPrevBlock(unsigned long long from, bool isFree) {
+	if (from >= blocksCount) {
+		from = blocksCount - 1;
+	}
+	unsigned long long flip = isFree ? 0 : ~0ULL;
+	unsigned long long w = from / 64;
+	unsigned long long bits = (freeMap[w] ^ flip)
+			& (~0ULL >> (63 - from % 64));
+	if (w == freeMapWords - 1 && blocksCount % 64 != 0) {
+		//ignore bits past blocksCount
+		bits &= ~0ULL >> (64 - blocksCount % 64);
+	}
+
+	while (bits == 0) {
+		if (w == 0) {
+			return blocksCount;
+		}
+		w--;
+#ifdef __AVX2__
+		__m256i skip = _mm256_set1_epi64x(flip);
+		while (w >= 4) {
+			__m256i v = _mm256_loadu_si256(
+					(const __m256i *) (freeMap + w - 3));
+			if (!_mm256_testz_si256(_mm256_xor_si256(v, skip),
+					_mm256_set1_epi64x(-1))) {
+				break;
+			}
+			w -= 4;
+		}
+#endif
+		bits = freeMap[w] ^ flip;
+	}
+
+	return w * 64 + 63 - __builtin_clzll(bits);
+}
+
+/************************************************************************
+ Function: findFreeRun
+ Description: Finds first run of continuous empty blocks of a minimum length
+ Args:
+ from        unsigned long long      block to start search from
+ minLength   unsigned long long      required number of continuous blocks
+ Returns:
+ unsigned long long      first block of the run
+ blocksCount if no such run exists
+ Notes:
+ Alternates findNextBlock() for start and end of each empty run,
+ so occupied and empty stretches are both skipped word wise.
+ ************************************************************************/
+
+unsigned long long findFreeRun(unsigned long long from,
+		unsigned long long minLength) {
+	unsigned long long start = findNextBlock(from, true);
+	while (start < blocksCount) {
+		unsigned long long end = findNextBlock(start, false);
+		if (end - start >= minLength) {
+			return start;
+		}
+		start = findNextBlock(end, true);
+	}
+	return blocksCount;
+}
+
+/************** Free extent index *****************************************/
+
+/************************************************************************
+ Function: addFreeExtent
+ Description: Adds a run of empty blocks to free extent index
+ Args:
+ start   unsigned long long      first block of the run
+ length  unsigned long long      number of blocks in the run
+ Returns: none
+ Notes:
+ Coalesces with free runs right before and right after it, so index
+ always holds maximal runs.
+ ************************************************************************/
+
+void addFreeExtent(unsigned long long start, unsigned long long length) {
+	if (length == 0) {
+		return;
+	}
+	map<unsigned long long, unsigned long long>::iterator next =
+			freeExtents.lower_bound(start);
+
+	if (next != freeExtents.begin()) {
+		map<unsigned long long, unsigned long long>::iterator prev = next;
+		--prev;
+		if (prev->first + prev->second == start) {
+			//merge with previous run
+			freeExtentsBySize.erase(make_pair(prev->second, prev->first));
+			start = prev->first;
+			length += prev->second;
+			freeExtents.erase(prev);
+		}
+	}
+	if (next != freeExtents.end() && start + length == next->first) {
+		//merge with next run
+		freeExtentsBySize.erase(make_pair(next->second, next->first));
+		length += next->second;
+		freeExtents.erase(next);
+	}
+
+	freeExtents[start] = length;
+	freeExtentsBySize.insert(make_pair(length, start));
+}
+
+/************************************************************************
+ Function: removeFreeExtent
+ Description: Removes a run of blocks being occupied from free extent index
+ Args:
+ start   unsigned long long      first block of the run
+ length  unsigned long long      number of blocks in the run
+ Returns: none
+ Notes:
+ Run must lie within one free run. What is left of it on either side
+ stays in the index.
+ ************************************************************************/
+
+void removeFreeExtent(unsigned long long start, unsigned long long length) {
+	if (length == 0) {
+		return;
+	}
+	map<unsigned long long, unsigned long long>::iterator it =
+			freeExtents.upper_bound(start);
+	if (it == freeExtents.begin()) {
+		return;
+	}
+	--it;
+	unsigned long long runStart = it->first;
+	unsigned long long runEnd = it->first + it->second;
+	if (start + length > runEnd) {
+		return;
+	}
+
+	freeExtentsBySize.erase(make_pair(it->second, it->first));
+	freeExtents.erase(it);
+	if (runStart < start) {
+		freeExtents[runStart] = start - runStart;
+		freeExtentsBySize.insert(make_pair(start - runStart, runStart));
+	}
+	if (start + length < runEnd) {
+		freeExtents[start + length] = runEnd - start - length;
+		freeExtentsBySize.insert(
+				make_pair(runEnd - start - length, start + length));
+	}
+}
+
+/************************************************************************
+ Function: rebuildFreeExtents
+ Description: Rebuilds free extent index for a range from free space bitmap
+ Args:
+ start   unsigned long long      first block of changed range
+ end     unsigned long long      block after changed range
+ Returns: none
+ Notes:
+ Used after blocks are moved without assignBlocks().
+ Runs crossing range boundaries are cut and parts outside are kept.
+ ************************************************************************/
+
+void rebuildFreeExtents(unsigned long long start, unsigned long long end) {
+	if (start >= end) {
+		return;
+	}
+
+	//drop every run overlapping the range, keep parts outside it
+	map<unsigned long long, unsigned long long>::iterator it =
+			freeExtents.upper_bound(start);
+	if (it != freeExtents.begin()) {
+		--it;
+	}
+	while (it != freeExtents.end() && it->first < end) {
+		unsigned long long runStart = it->first;
+		unsigned long long runEnd = it->first + it->second;
+		freeExtentsBySize.erase(make_pair(it->second, it->first));
+		freeExtents.erase(it++);
+		if (runEnd <= start) {
+			//ends before range, untouched
+			addFreeExtent(runStart, runEnd - runStart);
+			continue;
+		}
+		if (runStart < start) {
+			addFreeExtent(runStart, start - runStart);
+		}
+		if (runEnd > end) {
+			addFreeExtent(end, runEnd - end);
+		}
+	}
+
+	//add runs inside the range from bitmap
+	unsigned long long pos = findNextBlock(start, true);
+	while (pos < end) {
+		unsigned long long runEnd = std::min(findNextBlock(pos, false), end);
+		addFreeExtent(pos, runEnd - pos);
+		pos = findNextBlock(runEnd, true);
+	}
+}
+
+/************************************************************************
+ Function: findHole
+ Description: Finds best fitting hole for a write in threshold allocation
+ Args:
+ requiredBlocks  unsigned long long      continuous blocks needed
+ start           unsigned long long&     first block of the hole
+ Returns:
+ true if a hole is found
+ false otherwise or if allocation policy is log
+ Notes:
+ Smallest free run that can hold the write, found from the size keyed
+ index in O(log runs). Writing into holes delays compaction.
+ ************************************************************************/
+
+bool findHole(unsigned long long requiredBlocks, unsigned long long &start) {
+	if (allocationPolicy != ALLOCATION_THRESHOLD) {
+		return false;
+	}
+	set<pair<unsigned long long, unsigned long long> >::iterator it =
+			freeExtentsBySize.lower_bound(make_pair(requiredBlocks, 0ULL));
+	if (it == freeExtentsBySize.end()) {
+		return false;
+	}
+	start = it->second;
+	return true;
+}
+
+/************** Segments and cleaner **************************************/
+
+/************************************************************************
+ Function: ageSegments
+ Description: Records age of data written into segments
+ Args:
+ start       unsigned long long      first block of the run
+ length      unsigned long long      number of blocks in the run
+ modified    unsigned long long      log clock of the data written
+ Returns: none
+ Notes:
+ Age of a segment is the age of its youngest data.
+ Copies made by cleaner keep the age of the file, not time of copy.
+ ************************************************************************/
+
+void ageSegments(unsigned long long start, unsigned long long length,
+		unsigned long long modified) {
+	if (length == 0) {
+		return;
+	}
+	unsigned long long last = (start + length - 1) / segmentBlocks;
+	for (unsigned long long k = start / segmentBlocks; k <= last; k++) {
+		segments[k].lastWrite = std::max(segments[k].lastWrite, modified);
+	}
+}
+
+/************************************************************************
+ Function: setSegmentLive
+ Description: Sets live blocks of a segment
+ Args:
+ k           unsigned long long      segment number
+ liveBlocks  unsigned long long      occupied blocks in segment
+ Returns: none
+ Notes:
+ Keeps cleanBlocks in sync when segment becomes clean or dirty.
+ Clean segment has no age.
+ ************************************************************************/
+
+void setSegmentLive(unsigned long long k, unsigned long long liveBlocks) {
+	unsigned long long size = std::min(segmentBlocks,
+			blocksCount - k * segmentBlocks);
+	if (segments[k].liveBlocks == 0 && liveBlocks != 0) {
+		cleanBlocks -= size;
+	} else if (segments[k].liveBlocks != 0 && liveBlocks == 0) {
+		cleanBlocks += size;
+	}
+	segments[k].liveBlocks = liveBlocks;
+	if (liveBlocks == 0) {
+		segments[k].lastWrite = 0;
+	}
+}
+
+/************************************************************************
+ Function: recountSegments
+ Description: Recounts live blocks of segments from free space bitmap
+ Args:
+ start   unsigned long long      first block of changed range
+ end     unsigned long long      block after changed range
+ Returns: none
+ Notes:
+ Used after blocks are moved without assignBlocks().
+ Every segment overlapping the range is recounted.
+ ************************************************************************/
+
+void recountSegments(unsigned long long start, unsigned long long end) {
+	if (start >= end) {
+		return;
+	}
+	unsigned long long last = (end - 1) / segmentBlocks;
+	for (unsigned long long k = start / segmentBlocks; k <= last; k++) {
+		unsigned long long segStart = k * segmentBlocks;
+		unsigned long long segEnd = std::min(segStart + segmentBlocks,
+				blocksCount);
+		setSegmentLive(k,
+				segEnd - segStart - countFreeRange(segStart, segEnd));
+	}
+}
+
+/************************************************************************
+ Function: findCleanRun
+ Description: Finds first run of continuous clean segments of a minimum length
+ Args:
+ minLength   unsigned long long      required number of continuous blocks
+ Returns:
+ unsigned long long      first block of the run
+ blocksCount if no such run exists
+ Notes:
+ Clean segment has no live blocks. Log head only moves to clean segments.
+ ************************************************************************/
+
+unsigned long long findCleanRun(unsigned long long minLength) {
+	unsigned long long runStart = 0;
+	unsigned long long runLength = 0;
+	for (unsigned long long k = 0; k < segmentsCount; k++) {
+		if (segments[k].liveBlocks != 0) {
+			runLength = 0;
+			continue;
+		}
+		if (runLength == 0) {
+			runStart = k * segmentBlocks;
+		}
+		runLength += std::min(segmentBlocks, blocksCount - k * segmentBlocks);
+		if (runLength >= minLength) {
+			return runStart;
+		}
+	}
+	return blocksCount;
+}
+
+/************************************************************************
+ Function: selectVictim
+ Description: Picks the next segment to clean as per cleaner policy
+ Args:
+ visited     vector<bool>&       segments already tried in this pass
+ Returns:
+ long long       segment number
+ -1 if no segment is worth cleaning
+ Notes:
+ Only segments that are partially occupied are candidates.
+ greedy:         least live blocks
+ cost-benefit:   highest age * free / (1 + utilization)
+ ************************************************************************/
+
+long long selectVictim(vector<bool> &visited) {
+	long long victim = -1;
+	long double bestScore = -1;
+	for (unsigned long long k = 0; k < segmentsCount; k++) {
+		unsigned long long size = std::min(segmentBlocks,
+				blocksCount - k * segmentBlocks);
+		if (visited[k] || segments[k].liveBlocks == 0
+				|| segments[k].liveBlocks == size) {
+			continue;
+		}
+		long double utilization = (long double) segments[k].liveBlocks / size;
+		long double score = 0;
+		if (cleanerPolicy == CLEANER_GREEDY) {
+			score = 1 - utilization;
+		} else {
+			long double age = logClock - segments[k].lastWrite + 1;
+			score = age * (1 - utilization) / (1 + utilization);
+		}
+		if (score > bestScore) {
+			bestScore = score;
+			victim = k;
+		}
+	}
+	return victim;
+}
+
+/************************************************************************
+ Function: findEvacuationSpace
+ Description: Finds empty blocks to copy live blocks of a victim segment to
+ Args:
+ length      unsigned long long      number of blocks to place
+ maxPieces   unsigned long long      most runs blocks may be split in
+ victim      unsigned long long      segment being cleaned
+ cursor      unsigned long long&     block to continue search from
+ pieces      vector<blockExtent>&    empty runs found
+ Returns:
+ true if all blocks could be placed
+ false otherwise. pieces and cursor are left unchanged.
+ Notes:
+ Only holes in other partially occupied segments are used. Filling a
+ clean segment would dirty as much as cleaning frees.
+ Free run at log head is left alone.
+ Holes are only filled during a pass, so cursor never moves back, except
+ to the first hole passed over for being too small for the last piece.
+ ************************************************************************/
+
+bool findEvacuationSpace(unsigned long long length,
+		unsigned long long maxPieces, unsigned long long victim,
+		unsigned long long &cursor, vector<blockExtent> &pieces) {
+	vector<blockExtent> found;
+	unsigned long long pos = cursor;
+	unsigned long long skipped = blocksCount;
+	while (length > 0) {
+		pos = findNextBlock(pos, true);
+		if (pos >= blocksCount) {
+			return false;
+		}
+		unsigned long long k = pos / segmentBlocks;
+		unsigned long long segEnd = std::min((k + 1) * segmentBlocks,
+				blocksCount);
+		if (k == victim || segments[k].liveBlocks == 0) {
+			pos = segEnd;
+			continue;
+		}
+		if (pos >= currentPos && pos < headLimit) {
+			pos = headLimit;
+			continue;
+		}
+		unsigned long long runEnd = std::min(findNextBlock(pos, false),
+				segEnd);
+		if (pos < currentPos && runEnd > currentPos) {
+			runEnd = currentPos;
+		}
+		if (found.size() + 1 == maxPieces && runEnd - pos < length) {
+			//last piece must hold the rest
+			skipped = std::min(skipped, pos);
+			pos = runEnd;
+			continue;
+		}
+		unsigned long long take = std::min(runEnd - pos, length);
+		blockExtent piece = { pos, take };
+		found.push_back(piece);
+		length -= take;
+		pos += take;
+	}
+	pieces.swap(found);
+	cursor = std::min(skipped, pos);
+	return true;
+}
+
+/************************************************************************
+ Function: cleanSegment
+ Description: Copies live blocks out of a segment so it becomes clean
+ Args:
+ victim      unsigned long long      segment to clean
+ cursor      unsigned long long&     search position for empty blocks
+ Returns:
+ unsigned long long      number of blocks copied
+ Notes:
+ Each live run of a file inside the segment is copied to holes of
+ other segments. The extent holding it is split around the run.
+ With --max-extents, a file is not split in more extents than the cap,
+ or than it already has.
+ Stops early if holes run out, or a run cannot be placed within the cap.
+ Segment then stays partially occupied.
+ ************************************************************************/
+
+unsigned long long cleanSegment(unsigned long long victim,
+		unsigned long long &cursor) {
+	unsigned long long segStart = victim * segmentBlocks;
+	unsigned long long segEnd = std::min(segStart + segmentBlocks,
+			blocksCount);
+	unsigned long long moved = 0;
+	vector<blockExtent> pieces;
+	amplification.scanned += segEnd - segStart;
+
+	unsigned long long pos = findNextBlock(segStart, false);
+	while (pos < segEnd) {
+		unsigned long long fileId = memory[pos];
+		file &f = getFile(fileId);
+
+		size_t k = 0;
+		while (k < f.extents.size()
+				&& !(f.extents[k].start <= pos
+						&& pos < f.extents[k].start + f.extents[k].length)) {
+			k++;
+		}
+		if (k == f.extents.size()) {
+			//block not owned by any extent, should not happen
+			return moved;
+		}
+		blockExtent old = f.extents[k];
+		unsigned long long runEnd = std::min(old.start + old.length, segEnd);
+		unsigned long long length = runEnd - pos;
+
+		unsigned long long maxPieces = blocksCount;
+		if (extentsCapped) {
+			//extents left of file once run is moved out of its extent
+			unsigned long long kept = f.extents.size() - 1
+					+ (old.start < pos ? 1 : 0)
+					+ (runEnd < old.start + old.length ? 1 : 0);
+			unsigned long long cap = std::max(maxExtents,
+					(unsigned long long) f.extents.size());
+			if (kept >= cap) {
+				return moved;
+			}
+			maxPieces = cap - kept;
+		}
+
+		if (!findEvacuationSpace(length, maxPieces, victim, cursor, pieces)) {
+			return moved;
+		}
+
+		countRelocated(fileId, length, true);
+		unsigned long long from = pos;
+		for (size_t i = 0; i < pieces.size(); i++) {
+			assignBlocks(pieces[i].start, pieces[i].length, fileId);
+			ageSegments(pieces[i].start, pieces[i].length, f.modified);
+			copyImage(from, pieces[i].start, pieces[i].length);
+			from += pieces[i].length;
+		}
+		assignBlocks(pos, length, -1);
+
+		//Split extent: part before run, copies of run, part after run
+		vector<blockExtent> replaced;
+		if (old.start < pos) {
+			blockExtent before = { old.start, pos - old.start };
+			replaced.push_back(before);
+		}
+		replaced.insert(replaced.end(), pieces.begin(), pieces.end());
+		if (runEnd < old.start + old.length) {
+			blockExtent after = { runEnd, old.start + old.length - runEnd };
+			replaced.push_back(after);
+		}
+		f.extents.erase(f.extents.begin() + k);
+		f.extents.insert(f.extents.begin() + k, replaced.begin(),
+				replaced.end());
+
+		moved += length;
+		pos = findNextBlock(runEnd, false);
+	}
+	return moved;
+}
+
+/************************************************************************
+ Function: cleanSegments
+ Description: Cleans segments until log head can fit a write
+ Args:
+ requiredBlocks  unsigned long long  continuous blocks needed at log head
+ Returns:
+ unsigned long long      number of blocks copied by cleaner
+ Notes:
+ Victims are picked by selectVictim() one at a time, so work is bounded
+ by the segments actually cleaned.
+ On success, log head is moved to start of a run of clean segments.
+ Stops when no victim is left or holes to copy into run out. Caller then
+ falls back to defragment().
+ ************************************************************************/
+
+unsigned long long cleanSegments(unsigned long long requiredBlocks) {
+	revokeLeases();
+	unsigned long long moved = 0;
+	unsigned long long cursor = 0;
+	vector<bool> visited(segmentsCount, false);
+
+	while (true) {
+		unsigned long long start = findCleanRun(requiredBlocks);
+		if (start < blocksCount) {
+			currentPos = start;
+			headLimit = findNextBlock(start, false);
+			return moved;
+		}
+		long long victim = selectVictim(visited);
+		if (victim < 0) {
+			return moved;
+		}
+		visited[victim] = true;
+		moved += cleanSegment(victim, cursor);
+	}
+}
+
+/************** Log heads *************************************************/
+
+/************************************************************************
+ Function: classifyWrite
+ Description: Picks log head of a write
+ Args:
+ fileId  unsigned long long  file being overwritten, 0 for a new file
+ hint    long long           head hint of write(), noHint if none
+ Returns:
+ unsigned long long      head, 0 (coldest) to logHeads - 1 (hottest)
+ Notes:
+ A hint always wins, hot is the hottest head.
+ New files go to head 0. With rewrites, an overwritten file goes to
+ head log2(rewrites + 1), so files rewritten more often go hotter.
+ With age, it goes to head log2(files / age), where age is number of
+ writes since file was last written. A file rewritten twice as often as
+ under uniform access goes to head 1.
+ ************************************************************************/
+
+unsigned long long classifyWrite(unsigned long long fileId, long long hint) {
+	if (hint != noHint) {
+		return std::min((unsigned long long) hint, logHeads - 1);
+	}
+	if (fileId == 0) {
+		return 0;
+	}
+	const file &f = getFile(fileId);
+	unsigned long long level = 0;
+	if (headClassifier == CLASSIFY_REWRITES) {
+		for (unsigned long long n = f.rewrites + 1; n > 1; n >>= 1) {
+			level++;
+		}
+	} else {
+		unsigned long long files = 0;
+		for (unsigned long long i = 0; i < fileShardCount; i++) {
+			files += fileShards[i].files.size();
+		}
+		unsigned long long age = std::max(1ULL, logClock - f.modified);
+		for (unsigned long long n = files / age; n > 1; n >>= 1) {
+			level++;
+		}
+	}
+	return std::min(level, logHeads - 1);
+}
+
+/************************************************************************
+ Function: selectLogHead
+ Description: Makes a head the log head for a write
+ Args:
+ head            unsigned long long  head to write at
+ requiredBlocks  unsigned long long  blocks of the write
+ Returns: none
+ Notes:
+ Caller holds allocGuard.
+ Head that was active keeps only the rest of the segment it was
+ appending to, so heads fill separate segments.
+ Saved run of a head is taken again only up to its first used block:
+ other heads, cleaning, holes and defragmentation may have used it.
+ When the run cannot fit the write, head moves to the first run of
+ clean segments that can. If there is none, commitFile() goes on with
+ the run it has and cleans or defragments as with a single log head.
+ ************************************************************************/
+
+void selectLogHead(unsigned long long head, unsigned long long requiredBlocks) {
+	if (head == activeHead) {
+		return;
+	}
+	logHead &parked = heads[activeHead];
+	parked.pos = currentPos;
+	parked.limit = currentPos;
+	if (currentPos % segmentBlocks != 0) {
+		parked.limit = std::min(headLimit,
+				(currentPos / segmentBlocks + 1) * segmentBlocks);
+	}
+
+	logHead &next = heads[head];
+	unsigned long long limit = next.pos;
+	if (next.pos < next.limit) {
+		limit = std::min(next.limit, findNextBlock(next.pos, false));
+	}
+	if (limit - next.pos < requiredBlocks) {
+		unsigned long long start = findCleanRun(requiredBlocks);
+		if (start < blocksCount) {
+			next.pos = start;
+			limit = findNextBlock(start, false);
+		}
+	}
+	next.limit = limit;
+	currentPos = next.pos;
+	headLimit = limit;
+	activeHead = head;
+}
+
+/************** Background cleaner ****************************************/
+
+/************************************************************************
+ Function: getLogFreeBlocks
+ Description: Gets the number of blocks log head can move into without cleaning
+ Args: none
+ Returns:
+ unsigned long long      number of blocks
+ Notes:
+ With a cleaner policy these are blocks of clean segments.
+ Without, it is the free space after current position.
+ Watermarks are checked against this.
+ ************************************************************************/
+
+unsigned long long getLogFreeBlocks() {
+	if (cleanerPolicy != CLEANER_NONE) {
+		return cleanBlocks;
+	}
+	return blocksCount - currentPos;
+}
+
+/************************************************************************
+ Function: cleanerStep
+ Description: Does one bounded unit of background cleaning
+ Args:
+ visited     vector<bool>&           segments already tried in this burst
+ cursor      unsigned long long&     search position for empty blocks
+ Returns:
+ true if progress was made
+ false if nothing more can be cleaned
+ Notes:
+ Caller holds allocLock and writerLock exclusively. Leases are revoked
+ first, writers take new ones from the cleaned log head.
+ With a cleaner policy, cleans one victim segment.
+ Without, compacts up to one segment worth of blocks.
+ ************************************************************************/
+
+bool cleanerStep(vector<bool> &visited, unsigned long long &cursor) {
+	revokeLeases();
+	if (cleanerPolicy != CLEANER_NONE) {
+		long long victim = selectVictim(visited);
+		if (victim < 0) {
+			return false;
+		}
+		visited[victim] = true;
+		cleanSegment(victim, cursor);
+		return true;
+	}
+
+	unsigned long long lastPos = currentPos;
+	unsigned long long moved = compactBlocks(segmentBlocks);
+	return moved > 0 || currentPos != lastPos;
+}
+
+/************************************************************************
+ Function: runBackgroundCleaner
+ Description: Background cleaner thread
+ Args:
+ arg     void*       unused
+ Returns: NULL
+ Notes:
+ Sleeps until free space for log drops below low watermark, then cleans
+ until high watermark is reached.
+ allocLock is released after every step so foreground writes wait for
+ at most one step.
+ If nothing can be cleaned, sleeps until some blocks are freed.
+ ************************************************************************/
+
+void *runBackgroundCleaner(void *) {
+	unsigned long long low = blocksCount * lowWatermark / 100;
+	unsigned long long high = blocksCount * highWatermark / 100;
+	unsigned long long stalledGeneration = ULLONG_MAX;
+
+	pthread_mutex_lock(&allocLock);
+	while (!cleanerStop) {
+		if (getLogFreeBlocks() >= low
+				|| freeGeneration == stalledGeneration) {
+			pthread_cond_wait(&cleanerWake, &allocLock);
+			continue;
+		}
+
+		vector<bool> visited(segmentsCount, false);
+		unsigned long long cursor = 0;
+		while (!cleanerStop && getLogFreeBlocks() < high) {
+			pthread_rwlock_wrlock(&writerLock);
+			bool progress = cleanerStep(visited, cursor);
+			pthread_rwlock_unlock(&writerLock);
+			if (!progress) {
+				stalledGeneration = freeGeneration;
+				break;
+			}
+			//let foreground in between steps
+			pthread_mutex_unlock(&allocLock);
+			sched_yield();
+			pthread_mutex_lock(&allocLock);
+		}
+	}
+	pthread_mutex_unlock(&allocLock);
+	return NULL;
+}
+
+/************************************************************************
+ Function: startBackgroundCleaner
+ Description: Starts background cleaner thread if enabled
+ Args: none
+ Returns: none
+ Notes:
+ Called once memory and segments are initialized.
+ ************************************************************************/
+
+void startBackgroundCleaner() {
+	if (!backgroundCleaner || blocksCount == 0) {
+		return;
+	}
+	if (pthread_create(&cleanerThread, NULL, runBackgroundCleaner, NULL)
+			!= 0) {
+		terminate("Critical error: Cannot start background cleaner.");
+	}
+	cleanerRunning = true;
+}
+
+/************************************************************************
+ Function: wakeBackgroundCleaner
+ Description: Wakes background cleaner if free space for log is low
+ Args: none
+ Returns: none
+ Notes:
+ Caller holds allocLock.
+ ************************************************************************/
+
+void wakeBackgroundCleaner() {
+	if (cleanerRunning
+			&& getLogFreeBlocks() < blocksCount * lowWatermark / 100) {
+		pthread_cond_signal(&cleanerWake);
+	}
+}
+
+/************************************************************************
+ Function: stopBackgroundCleaner
+ Description: Stops background cleaner thread and waits for it
+ Args: none
+ Returns: none
+ Notes:
+ Must be called before memory is released.
+ ************************************************************************/
+
+void stopBackgroundCleaner() {
+	if (!cleanerRunning) {
+		return;
+	}
+	pthread_mutex_lock(&allocLock);
+	cleanerStop = true;
+	pthread_cond_signal(&cleanerWake);
+	pthread_mutex_unlock(&allocLock);
+	pthread_join(cleanerThread, NULL);
+	cleanerRunning = false;
+}
+
+/************** Batch input ***********************************************/
+
+/************************************************************************
+ Function: runBatch
+ Description: Executes a script file given with --script
+ Args:
+ path    string      script file
+ Returns: none
+ Notes:
+ Script is memory mapped and split into line aligned chunks. A window
+ of chunks is tokenized in parallel (see parseChunks), then executed
+ in order. Tokenizing does not depend on file system state, so output
+ is the same as reading script from standard input.
+ Lines are tokenized in place in a private mapping, script file is not
+ changed.
+ On failure to open script, terminates program.
+ ************************************************************************/
+
+void runBatch(const string &path) {
+
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		terminate("Critical error: Cannot open script: " + path);
+	}
+
+	size_t length = info.st_size;
+	char *text = NULL;
+	if (length > 0) {
+		void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				fd, 0);
+		if (mapped == MAP_FAILED) {
+			close(fd);
+			terminate("Critical error: Cannot map script: " + path);
+		}
+		text = (char *) mapped;
+		madvise(text, length, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	unsigned long long threads = parseThreads;
+	if (threads == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? online : 1;
+	}
+
+	vector<batchChunk> chunks(threads * batchWindowChunks);
+	char *next = text;
+	char *end = text + length;
+	int step = 0; //first two commands set disk capacity and block size
+
+	while (next < end) {
+
+		//Split window into chunks ending at a newline
+		size_t count = 0;
+		while (count < chunks.size() && next < end) {
+			batchChunk &chunk = chunks[count++];
+			chunk.begin = next;
+			if ((size_t) (end - next) <= batchChunkBytes) {
+				next = end;
+			} else {
+				char *newline = (char *) memchr(next + batchChunkBytes, '\n',
+						end - next - batchChunkBytes);
+				next = newline ? newline + 1 : end;
+			}
+			chunk.end = next;
+		}
+
+		parseChunks(chunks, count, threads);
+
+		//Execute in order
+		for (size_t c = 0; c < count; c++) {
+			vector<parsedCommand> &commands = chunks[c].commands;
+			for (size_t i = 0; i < commands.size(); i++) {
+				executeLine(commands[i], step);
+			}
+			commands.clear();
+		}
+		syncOperationLog();
+	}
+
+	if (step < 2) {
+		initStorage();
+	}
+	if (text != NULL) {
+		munmap(text, length);
+	}
+	return;
+}
+
+/************************************************************************
+ Function: parseChunks
+ Description: Tokenizes chunks of a script in parallel
+ Args:
+ chunks      vector<batchChunk>&     chunks, first count are tokenized
+ count       size_t                  number of chunks to tokenize
+ threads     unsigned long long      number of threads to use
+ Returns: none
+ Notes:
+ Thread k tokenizes chunks k, k + threads, ...
+ Calling thread takes share of thread 0 and of any thread that could
+ not be started.
+ ************************************************************************/
+
+void parseChunks(vector<batchChunk> &chunks, size_t count,
+		unsigned long long threads) {
+
+	if (threads > count) {
+		threads = count;
+	}
+	vector<batchWorker> workers(threads);
+	vector<pthread_t> ids(threads);
+	vector<bool> started(threads, false);
+	for (size_t k = 0; k < threads; k++) {
+		workers[k].chunks = &chunks;
+		workers[k].first = k;
+		workers[k].count = count;
+		workers[k].step = threads;
+		if (k > 0) {
+			started[k] = pthread_create(&ids[k], NULL, parseChunkRange,
+					&workers[k]) == 0;
+		}
+	}
+	for (size_t k = 0; k < threads; k++) {
+		if (started[k]) {
+			pthread_join(ids[k], NULL);
+		} else {
+			//Calling thread, or thread could not be started
+			parseChunkRange(&workers[k]);
+		}
+	}
+	return;
+}
+
+/************************************************************************
+ Function: parseChunkRange
+ Description: Thread body tokenizing every line of some chunks
+ Args:
+ arg     void*       batchWorker
+ Returns:
+ void*   NULL
+ Notes:
+ Newline is not part of line. Last line may have no newline.
+ ************************************************************************/
+
+void *parseChunkRange(void *arg) {
+
+	batchWorker *worker = (batchWorker *) arg;
+	vector<batchChunk> &chunks = *worker->chunks;
+	parsedCommand command;
+
+	for (size_t c = worker->first; c < worker->count; c += worker->step) {
+		batchChunk &chunk = chunks[c];
+		char *line = chunk.begin;
+		while (line < chunk.end) {
+			char *newline = (char *) memchr(line, '\n', chunk.end - line);
+			char *lineEnd = newline ? newline : chunk.end;
+			tokenizeText(line, lineEnd - line, command);
+			chunk.commands.push_back(command);
+			line = lineEnd + 1;
+		}
+	}
+	return NULL;
+}
+
+/************** Pipelined input *******************************************/
+
+/************************************************************************
+ Function: runPipeline
+ Description: Executes standard input while it is read and tokenized in a separate thread
+ Args: none
+ Returns: none
+ Notes:
+ Parser thread (see runParser) fills a ring of tokenized lines, this
+ thread executes them in order and frees their slots. Only this thread
+ outputs, so output is the same as without --pipeline.
+ Ring has a single producer and a single consumer and needs no lock:
+ parser only moves tail and executor only moves head.
+ Waiting side spins briefly, then yields, then sleeps (see waitForRing).
+ If parser thread cannot be started, input is read without it.
+ ************************************************************************/
+
+void runPipeline() {
+
+	size_t capacity = 1;
+	while (capacity < pipelineDepth) {
+		capacity <<= 1;
+	}
+	//Not freed: parser may still be blocked reading when program terminates
+	commandRing *ring = new commandRing;
+	ring->slots = new pipelineSlot[capacity];
+	ring->mask = capacity - 1;
+	ring->head.store(0);
+	ring->tail.store(0);
+	ring->done.store(false);
+	ring->started = false;
+
+	pthread_t parser;
+	if (pthread_create(&parser, NULL, runParser, ring) != 0) {
+		runParser(ring);
+	} else {
+		ring->started = true;
+	}
+
+	int step = 0; //first two commands set disk capacity and block size
+	size_t head = 0;
+	while (true) {
+		unsigned spins = 0;
+		while (head == ring->tail.load(std::memory_order_acquire)) {
+			if (ring->done.load(std::memory_order_acquire)
+					&& head == ring->tail.load(std::memory_order_acquire)) {
+				break;
+			}
+			if (spins == 0) {
+				//logged operations are durable before waiting for parser
+				syncOperationLog();
+			}
+			waitForRing(spins);
+		}
+		if (head == ring->tail.load(std::memory_order_acquire)) {
+			//Input ended
+			break;
+		}
+		executeLine(ring->slots[head & ring->mask].command, step);
+		head++;
+		ring->head.store(head, std::memory_order_release);
+	}
+
+	if (step < 2) {
+		initStorage();
+	}
+	if (ring->started) {
+		pthread_join(parser, NULL);
+	}
+	return;
+}
+
+/************************************************************************
+ Function: runParser
+ Description: Thread body reading and tokenizing standard input into a ring
+ Args:
+ arg     void*       commandRing
+ Returns:
+ void*   NULL
+ Notes:
+ Waits while ring is full. Line buffers of slots are reused, so no
+ memory is allocated once they have grown to line length.
+ Sets done after last line.
+ ************************************************************************/
+
+void *runParser(void *arg) {
+
+	commandRing *ring = (commandRing *) arg;
+	size_t capacity = ring->mask + 1;
+	size_t tail = 0;
+	while (true) {
+		unsigned spins = 0;
+		while (tail - ring->head.load(std::memory_order_acquire) == capacity) {
+			waitForRing(spins);
+		}
+		pipelineSlot &slot = ring->slots[tail & ring->mask];
+		if (!std::getline(std::cin, slot.line)) {
+			break;
+		}
+		tokenizeLine(slot.line, slot.command);
+		tail++;
+		ring->tail.store(tail, std::memory_order_release);
+	}
+	ring->done.store(true, std::memory_order_release);
+	return NULL;
+}
+
+/************************************************************************
+ Function: waitForRing
+ Description: Waits a little for the other side of the ring
+ Args:
+ spins   unsigned&   number of waits so far, incremented
+ Returns: none
+ Notes:
+ Busy waits first, then yields cpu, then sleeps so an idle pipe does
+ not keep a cpu busy.
+ ************************************************************************/
+
+void waitForRing(unsigned &spins) {
+	spins++;
+	if (spins > 2 * pipelineSpins) {
+		usleep(pipelineSleep);
+	} else if (spins > pipelineSpins) {
+		sched_yield();
+	}
+}
+
+/************** Concurrent writers ****************************************/
+
+/************************************************************************
+ Function: startWriters
+ Description: Starts writer threads if enabled
+ Args: none
+ Returns: none
+ Notes:
+ Called once memory and segments are initialized.
+ With a single writer, writes are committed in main thread.
+ On failure, terminates program.
+ ************************************************************************/
+
+void startWriters() {
+	if (writersCount <= 1 || blocksCount == 0) {
+		return;
+	}
+	writers = new writerState[writersCount];
+	for (unsigned long long k = 0; k < writersCount; k++) {
+		pthread_mutex_init(&writers[k].lock, NULL);
+		pthread_cond_init(&writers[k].wake, NULL);
+		writers[k].leaseNext = 0;
+		writers[k].leaseEnd = 0;
+	}
+	for (unsigned long long k = 0; k < writersCount; k++) {
+		if (pthread_create(&writers[k].thread, NULL, runWriter, (void *) k)
+				!= 0) {
+			terminate("Critical error: Cannot start writer threads.");
+		}
+	}
+}
+
+/************************************************************************
+ Function: stopWriters
+ Description: Collects outstanding writes and stops writer threads
+ Args: none
+ Returns: none
+ Notes:
+ Unwritten leased blocks are returned to free space.
+ ************************************************************************/
+
+void stopWriters() {
+	if (writers == NULL) {
+		return;
+	}
+	drainWriters();
+	writersStop = true;
+	for (unsigned long long k = 0; k < writersCount; k++) {
+		pthread_mutex_lock(&writers[k].lock);
+		pthread_cond_signal(&writers[k].wake);
+		pthread_mutex_unlock(&writers[k].lock);
+		pthread_join(writers[k].thread, NULL);
+	}
+	{
+		allocGuard guard;
+		revokeLeases();
+	}
+	for (unsigned long long k = 0; k < writersCount; k++) {
+		pthread_mutex_destroy(&writers[k].lock);
+		pthread_cond_destroy(&writers[k].wake);
+	}
+	delete[] writers;
+	writers = NULL;
+}
+
+/************************************************************************
+ Function: dispatchWrite
+ Description: Queues a write for its writer thread
+ Args:
+ path    string              absolute file path
+ size    unsigned long long  file size, 0 to delete
+ unit    sizeUnitType        unit of size
+ Returns: none
+ Notes:
+ Writer is picked by hash of path, so writes to one path are committed
+ in command order by the same writer.
+ Writes to different paths commit in any order. They are dispatched
+ together only while free space covers all of them. A write that may
+ run out of space is committed alone, so it sees the same free space as
+ in command order.
+ Waits for writers once writerBacklog writes are outstanding.
+ ************************************************************************/
+
+void dispatchWrite(const string &path, unsigned long long size,
+		sizeUnitType unit) {
+	unsigned long long requiredBlocks = 0;
+	if (size != 0) {
+		long double fileBytes = convertSize(size, unitNames[unit], "B");
+		long double blockBytes = convertSize(blockSize, blockUnit, "B");
+		requiredBlocks = ceil(fileBytes / blockBytes);
+	}
+	bool alone = false;
+	if (requiredBlocks > writeBudget) {
+		drainWriters();
+		allocGuard guard;
+		writeBudget = countFreeBlocks() + countLeasedBlocks();
+		alone = requiredBlocks > writeBudget;
+	}
+	//overwritten blocks are freed only after the write, not counted back
+	writeBudget -= std::min(requiredBlocks, writeBudget);
+
+	pendingWrite write = { path, size, unit, "" };
+	pendingWrites.push_back(write);
+
+	writerState &writer = writers[std::hash<string>()(path) % writersCount];
+	pthread_mutex_lock(&writer.lock);
+	writer.queue.push_back(&pendingWrites.back());
+	pthread_cond_signal(&writer.wake);
+	pthread_mutex_unlock(&writer.lock);
+
+	if (alone || pendingWrites.size() >= writerBacklog) {
+		drainWriters();
+	}
+}
+
+/************************************************************************
+ Function: drainWriters
+ Description: Waits for dispatched writes and outputs their results
+ Args: none
+ Returns: none
+ Notes:
+ Output of writes is appended in command order, whichever writer
+ finished first. Does nothing without outstanding writes.
+ ************************************************************************/
+
+void drainWriters() {
+	if (pendingWrites.empty()) {
+		return;
+	}
+	pthread_mutex_lock(&writersLock);
+	while (completedWrites < pendingWrites.size()) {
+		pthread_cond_wait(&writersDone, &writersLock);
+	}
+	completedWrites = 0;
+	pthread_mutex_unlock(&writersLock);
+
+	for (deque<pendingWrite>::iterator i = pendingWrites.begin();
+			i != pendingWrites.end(); ++i) {
+		appendOutput((*i).output.data(), (*i).output.length());
+	}
+	pendingWrites.clear();
+	if (outputLineFlush) {
+		flushOutput();
+	}
+}
+
+/************************************************************************
+ Function: runWriter
+ Description: Writer thread, commits queued writes
+ Args:
+ arg     void*   index of writer
+ Returns: NULL
+ Notes:
+ Output of each write is captured in its pendingWrite.
+ ************************************************************************/
+
+void *runWriter(void *arg) {
+	writerIndex = (long long) arg;
+	writerState &writer = writers[writerIndex];
+
+	pthread_mutex_lock(&writer.lock);
+	while (true) {
+		if (writer.queue.empty()) {
+			if (writersStop) {
+				break;
+			}
+			pthread_cond_wait(&writer.wake, &writer.lock);
+			continue;
+		}
+		pendingWrite *write = writer.queue.front();
+		writer.queue.pop_front();
+		pthread_mutex_unlock(&writer.lock);
+
+		outputCapture = &write->output;
+		commitFile(write->path, write->size, unitNames[write->unit], noHint);
+		outputCapture = NULL;
+
+		pthread_mutex_lock(&writersLock);
+		completedWrites++;
+		pthread_cond_signal(&writersDone);
+		pthread_mutex_unlock(&writersLock);
+
+		pthread_mutex_lock(&writer.lock);
+	}
+	pthread_mutex_unlock(&writer.lock);
+	return NULL;
+}
+
+/************************************************************************
+ Function: commitToLease
+ Description: Writes a new file into lease of current writer
+ Args:
+ filepath            string              absolute file path
+ requiredBlocks      unsigned long long  blocks to write
+ allocatedFileSize   unsigned long long  size in block units
+ Returns:
+ true if file was written
+ false if file exists or lease is too short, commitFile then allocates
+ Notes:
+ Takes writerLock shared, so writers append to their leases in parallel
+ and only exclude allocation, cleaning and defragmentation.
+ No other writer can create the same path, paths are hashed to writers.
+ ************************************************************************/
+
+bool commitToLease(const string &filepath, unsigned long long requiredBlocks,
+		unsigned long long allocatedFileSize) {
+	writerState &writer = writers[writerIndex];
+
+	pthread_rwlock_rdlock(&writerLock);
+	bool fits = writer.leaseEnd - writer.leaseNext >= requiredBlocks;
+	if (fits) {
+		pthread_mutex_lock(&namespaceLock);
+		fits = findFile(filepath) == 0;
+		pthread_mutex_unlock(&namespaceLock);
+	}
+	if (fits) {
+		appendToLease(writer, filepath, requiredBlocks, allocatedFileSize);
+	}
+	pthread_rwlock_unlock(&writerLock);
+	return fits;
+}
+
+/************************************************************************
+ Function: takeLease
+ Description: Leases a run of blocks at log head to a writer
+ Args:
+ writer          writerState&        writer taking the lease
+ requiredBlocks  unsigned long long  blocks needed at least
+ Returns:
+ true if lease has requiredBlocks
+ false if log head is too short
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ Rest of previous lease is returned first.
+ Leased blocks are owned by leasedBlock until written, so they count as
+ used in bitmap, free extent index and segments.
+ ************************************************************************/
+
+bool takeLease(writerState &writer, unsigned long long requiredBlocks) {
+	revokeLease(writer);
+	unsigned long long length = std::min(
+			std::max(requiredBlocks, leaseBlocks), headLimit - currentPos);
+	if (length < requiredBlocks) {
+		return false;
+	}
+	assignBlocks(currentPos, length, leasedBlock);
+	writer.leaseNext = currentPos;
+	writer.leaseEnd = currentPos + length;
+	currentPos += length;
+	wakeBackgroundCleaner();
+	return true;
+}
+
+/************************************************************************
+ Function: appendToLease
+ Description: Writes a new file at the start of a writer's lease
+ Args:
+ writer              writerState&        writer owning the lease
+ filepath            string              absolute file path
+ requiredBlocks      unsigned long long  blocks to write, fit in lease
+ allocatedFileSize   unsigned long long  size in block units
+ Returns: none
+ Notes:
+ Caller holds writerLock, shared or exclusively.
+ Shared structures are updated under namespaceLock, shard lock of the
+ file and segmentLock. Outputs written file info.
+ ************************************************************************/
+
+void appendToLease(writerState &writer, const string &filepath,
+		unsigned long long requiredBlocks,
+		unsigned long long allocatedFileSize) {
+	unsigned long long writePos = writer.leaseNext;
+	writer.leaseNext += requiredBlocks;
+	unsigned long long fileId = currentFileId++;
+	std::fill_n(memory + writePos, requiredBlocks, (long long) fileId);
+	writeImage(writePos, requiredBlocks, fileId);
+
+	file f1 = { };
+	f1.allocatedBlocks = requiredBlocks;
+	f1.allocatedFileSize = allocatedFileSize;
+	f1.modified = ++logClock;
+	blockExtent e1 = { writePos, requiredBlocks };
+	f1.extents.push_back(e1);
+
+	size_t slash = filepath.find_last_of("/");
+	pthread_mutex_lock(&namespaceLock);
+	f1.parent = resolveDirectory(filepath, slash + 1, true);
+	f1.name = internName(filepath.substr(slash + 1));
+	directories[f1.parent].children[f1.name] = fileId;
+	countWritten(f1.parent, requiredBlocks);
+	pthread_mutex_unlock(&namespaceLock);
+
+	pthread_mutex_lock(&segmentLock);
+	ageSegments(writePos, requiredBlocks, f1.modified);
+	pthread_mutex_unlock(&segmentLock);
+
+	fileShard &shard = getFileShard(fileId);
+	pthread_mutex_lock(&shard.lock);
+	shard.files[fileId] = f1;
+
+	//Print file info
+	unsigned long long startAddress = 0;
+	getStartingAddress(fileId, startAddress);
+	out << filepath << ", " << fileId << ", 0x" << hexNumber(startAddress)
+			<< ", " << allocatedFileSize << blockUnit << endLine;
+	emitFileRecord(COMMAND_WRITE, RESULT_OK, filepath, fileId);
+	pthread_mutex_unlock(&shard.lock);
+}
+
+/************************************************************************
+ Function: revokeLease
+ Description: Returns unwritten blocks of a writer's lease to free space
+ Args:
+ writer  writerState&    writer owning the lease
+ Returns: none
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ A lease ending at log head moves log head back to its first
+ unwritten block.
+ ************************************************************************/
+
+void revokeLease(writerState &writer) {
+	if (writer.leaseNext < writer.leaseEnd) {
+		assignBlocks(writer.leaseNext, writer.leaseEnd - writer.leaseNext, -1);
+		if (writer.leaseEnd == currentPos) {
+			currentPos = writer.leaseNext;
+		}
+	}
+	writer.leaseNext = 0;
+	writer.leaseEnd = 0;
+}
+
+/************************************************************************
+ Function: countLeasedBlocks
+ Description: Counts leased blocks not written yet
+ Args: none
+ Returns:
+ unsigned long long      number of unwritten leased blocks
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ ************************************************************************/
+
+unsigned long long countLeasedBlocks() {
+	unsigned long long leased = 0;
+	for (unsigned long long k = 0; writers != NULL && k < writersCount; k++) {
+		leased += writers[k].leaseEnd - writers[k].leaseNext;
+	}
+	return leased;
+}
+
+/************************************************************************
+ Function: revokeLeases
+ Description: Returns unwritten blocks of all leases to free space
+ Args: none
+ Returns: none
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ Called before blocks are moved or free space is counted, so only files
+ own blocks then. Does nothing without writer threads.
+ ************************************************************************/
+
+void revokeLeases() {
+	if (writers == NULL) {
+		return;
+	}
+	for (unsigned long long k = 0; k < writersCount; k++) {
+		revokeLease(writers[k]);
+	}
+}
+
+/************** Checkpoint ************************************************/
+
+/************************************************************************
+ Function: recoverCheckpoint
+ Description: Loads checkpoint and rolls operation log forward
+ Args: none
+ Returns: none
+ Notes:
+ Called once storage is initialized, with --checkpoint only.
+ Without a checkpoint file, storage starts empty. Logged operations are
+ executed again with their output dropped. Working directory is root
+ again afterwards. A new checkpoint empties the log unless checkpoint
+ is already up to date.
+ On failure, terminates program.
+ ************************************************************************/
+
+void recoverCheckpoint() {
+	if (checkpointPath.empty()) {
+		return;
+	}
+
+	int fd = open(checkpointPath.c_str(), O_RDONLY);
+	if (fd < 0 && errno != ENOENT) {
+		terminate("Critical error: Cannot open checkpoint: " + checkpointPath);
+	}
+	if (fd >= 0) {
+		struct stat info;
+		void *mapped = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (mapped == MAP_FAILED) {
+			terminate("Critical error: Cannot read checkpoint: " + checkpointPath);
+		}
+		madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+
+		checkpointReader reader = { (const char *) mapped,
+				(size_t) info.st_size, 0, false };
+		const char *error = NULL;
+		{
+			allocGuard guard;
+			error = restoreCheckpoint(reader);
+		}
+		munmap(mapped, info.st_size);
+		if (error != NULL) {
+			terminate(string(error) + checkpointPath);
+		}
+	}
+
+	replayOperationLog();
+	bool current = logSequence == checkpointSequence && currentDir == "/";
+	currentDir = "/";
+	currentDirId = rootDirectory;
+
+	string logPath = checkpointPath + ".log";
+	operationLog = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (operationLog < 0) {
+		terminate("Critical error: Cannot open operation log: " + logPath);
+	}
+	if (!current) {
+		writeCheckpoint();
+	}
+}
+
+/************************************************************************
+ Function: restoreCheckpoint
+ Description: Restores files, directories and log head from a checkpoint
+ Args:
+ reader  checkpointReader&   checkpoint file contents
+ Returns:
+ const char*     error message, NULL on success
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ Storage must be empty. Block map is rebuilt from file extents, then
+ free space bitmap, free extent index and segments are recounted.
+ Version 1 checkpoints have no log heads, rewrite or amplification
+ counters. They start from zero, which is refused with --log-heads.
+ ************************************************************************/
+
+const char *restoreCheckpoint(checkpointReader &reader) {
+	if (reader.length < sizeof(checkpointMagic)
+			|| memcmp(reader.data, checkpointMagic, sizeof(checkpointMagic))
+					!= 0) {
+		return "Critical error: Not a checkpoint file: ";
+	}
+	reader.pos = sizeof(checkpointMagic);
+	unsigned long long version = getNumber(reader);
+	if (version != 1 && version != checkpointVersion) {
+		return "Critical error: Unsupported checkpoint version: ";
+	}
+	if (version == 1 && logHeads > 1) {
+		//classifier and head cursors would start again from zero
+		return "Critical error: --log-heads needs a checkpoint of version 2 or later: ";
+	}
+
+	unsigned long long savedDiskSize = getNumber(reader);
+	string savedDiskUnit = getText(reader);
+	unsigned long long savedBlockSize = getNumber(reader);
+	string savedBlockUnit = getText(reader);
+	unsigned long long savedSegmentBlocks = getNumber(reader);
+	if (!reader.failed
+			&& (savedDiskSize != diskSize || savedDiskUnit != diskUnit
+					|| savedBlockSize != blockSize
+					|| savedBlockUnit != blockUnit
+					|| savedSegmentBlocks != segmentBlocks)) {
+		return "Critical error: Disk capacity, block size or segment size differs from checkpoint: ";
+	}
+
+	logSequence = getNumber(reader);
+	checkpointSequence = logSequence;
+	currentFileId = getNumber(reader);
+	logClock = getNumber(reader);
+	currentPos = getNumber(reader);
+	headLimit = getNumber(reader);
+	nextDirectoryId = getNumber(reader);
+	currentDir = getText(reader);
+	currentDirId = getNumber(reader);
+	if (currentPos > headLimit || headLimit > blocksCount) {
+		reader.failed = true;
+	}
+	if (version >= 2) {
+		activeHead = getNumber(reader);
+		for (unsigned long long h = 0; h < maxLogHeads; h++) {
+			heads[h].pos = getNumber(reader);
+			heads[h].limit = getNumber(reader);
+			if (heads[h].pos > heads[h].limit || heads[h].limit > blocksCount) {
+				reader.failed = true;
+			}
+		}
+		if (activeHead >= maxLogHeads) {
+			reader.failed = true;
+		}
+		amplification = getAmplification(reader);
+		windowStart = getAmplification(reader);
+		lastWindow = getAmplification(reader);
+	}
+
+	//Names are saved in id order and are unique
+	unsigned long long count = getNumber(reader);
+	names.clear();
+	nameIds.clear();
+	if (count <= reader.length - reader.pos) {
+		names.reserve(count);
+		nameIds.reserve(count);
+	}
+	for (unsigned long long i = 0; i < count && !reader.failed; i++) {
+		names.push_back(getText(reader));
+		nameIds[names.back()] = i;
+	}
+
+	count = getNumber(reader);
+	directories.clear();
+	if (count <= reader.length - reader.pos) {
+		directories.reserve(count);
+	}
+	for (unsigned long long i = 0; i < count && !reader.failed; i++) {
+		unsigned long long dirId = getNumber(reader);
+		directory dir;
+		dir.parent = getNumber(reader);
+		dir.name = getNumber(reader);
+		dir.created = getNumber(reader) != 0;
+		dir.amplification = amplificationStats();
+		if (version >= 2) {
+			dir.amplification = getAmplification(reader);
+		}
+		directories[dirId] = dir;
+	}
+	for (unordered_map<unsigned long long, directory>::iterator it =
+			directories.begin(); it != directories.end() && !reader.failed;
+			++it) {
+		if (directories.count(it->second.parent) == 0
+				|| it->second.name >= names.size()) {
+			reader.failed = true;
+		} else if (it->first != rootDirectory) {
+			directories[it->second.parent].subdirs[it->second.name] = it->first;
+		}
+	}
+	if (directories.count(rootDirectory) == 0
+			|| directories.count(currentDirId) == 0) {
+		reader.failed = true;
+	}
+
+	count = getNumber(reader);
+	vector<unsigned long long> lastWrites;
+	if (count != segmentsCount) {
+		reader.failed = true;
+	}
+	for (unsigned long long k = 0; k < count && !reader.failed; k++) {
+		lastWrites.push_back(getNumber(reader));
+	}
+
+	count = getNumber(reader);
+	for (unsigned long long i = 0; i < count && !reader.failed; i++) {
+		unsigned long long fileId = getNumber(reader);
+		file f = { };
+		f.parent = getNumber(reader);
+		f.name = getNumber(reader);
+		f.allocatedBlocks = getNumber(reader);
+		f.allocatedFileSize = getNumber(reader);
+		f.modified = getNumber(reader);
+		if (version >= 2) {
+			f.rewrites = getNumber(reader);
+		}
+		unsigned long long extents = getNumber(reader);
+		for (unsigned long long k = 0; k < extents && !reader.failed; k++) {
+			blockExtent e = { getNumber(reader), 0 };
+			e.length = getNumber(reader);
+			if (e.start >= blocksCount || e.length > blocksCount - e.start
+					|| std::count(memory + e.start,
+							memory + e.start + e.length, -1)
+							!= (long long) e.length) {
+				//outside disk or blocks already owned
+				reader.failed = true;
+				break;
+			}
+			std::fill_n(memory + e.start, e.length, (long long) fileId);
+			markFreeMap(e.start, e.length, false);
+			f.extents.push_back(e);
+		}
+		if (reader.failed || directories.count(f.parent) == 0) {
+			reader.failed = true;
+			break;
+		}
+		getFile(fileId) = f;
+		directories[f.parent].children[f.name] = fileId;
+	}
+
+	if (reader.failed
+			|| reader.length - reader.pos != sizeof(checkpointMagic)
+			|| memcmp(reader.data + reader.pos, checkpointMagic,
+					sizeof(checkpointMagic)) != 0) {
+		return "Critical error: Checkpoint is corrupt: ";
+	}
+
+	rebuildFreeExtents(0, blocksCount);
+	recountSegments(0, blocksCount);
+	for (unsigned long long k = 0; k < segmentsCount; k++) {
+		segments[k].lastWrite = lastWrites[k];
+	}
+	freeGeneration++;
+	wakeBackgroundCleaner();
+	return NULL;
+}
+
+/************************************************************************
+ Function: replayOperationLog
+ Description: Executes logged operations newer than checkpoint
+ Args: none
+ Returns: none
+ Notes:
+ Each line of the log is "<number> <command>". Lines already in the
+ checkpoint are skipped. A last line without newline was cut short by
+ a crash and is dropped.
+ On a corrupt log, terminates program.
+ ************************************************************************/
+
+void replayOperationLog() {
+	string logPath = checkpointPath + ".log";
+	int fd = open(logPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			terminate("Critical error: Cannot open operation log: " + logPath);
+		}
+		return;
+	}
+	string text = "";
+	char chunk[1 << 16];
+	ssize_t got = 0;
+	while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			terminate("Critical error: Cannot read operation log: " + logPath);
+		}
+		text.append(chunk, got);
+	}
+	close(fd);
+
+	//Output was given when operations first ran
+	string dropped = "";
+	outputCapture = &dropped;
+
+	string line = "";
+	parsedCommand command;
+	size_t pos = 0;
+	size_t newline = 0;
+	while ((newline = text.find('\n', pos)) != string::npos) {
+		char *end = NULL;
+		unsigned long long number = strtoull(text.c_str() + pos, &end, 10);
+		if (end == text.c_str() + pos || *end != ' ') {
+			outputCapture = NULL;
+			terminate("Critical error: Operation log is corrupt: " + logPath);
+		}
+		size_t start = end + 1 - text.c_str();
+		pos = newline + 1;
+		if (number <= logSequence) {
+			//already in checkpoint
+			continue;
+		}
+		line.assign(text, start, newline - start);
+		if (number != logSequence + 1 || !tokenizeLine(line, command)
+				|| !isLoggedCommand(command.type)) {
+			outputCapture = NULL;
+			terminate("Critical error: Operation log is corrupt: " + logPath);
+		}
+		executeCommand(command);
+		logSequence = number;
+		dropped.clear();
+	}
+	drainWriters();
+	outputCapture = NULL;
+}
+
+/************************************************************************
+ Function: isLoggedCommand
+ Description: Checks if a command changes files or directories
+ Args:
+ command     commandType     command type
+ Returns:
+ true if command is written to operation log
+ Notes:
+ chdir() is logged since later relative paths depend on it.
+ ************************************************************************/
+
+bool isLoggedCommand(commandType command) {
+	switch (command) {
+	case COMMAND_MKDIR:
+	case COMMAND_CHDIR:
+	case COMMAND_WRITE:
+	case COMMAND_APPEND:
+	case COMMAND_RENAME:
+	case COMMAND_RMDIR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/************************************************************************
+ Function: logOperation
+ Description: Appends a command to operation log
+ Args:
+ command     parsedCommand   command about to execute
+ Returns: none
+ Notes:
+ Takes a checkpoint first once checkpointInterval operations are logged.
+ Log is buffered and synced by syncOperationLog() before input is waited
+ for, after each window of a script and at least every operationSyncNs.
+ A crash loses operations logged since the last sync: those of the input
+ read but not yet waited past, and at most operationSyncNs of them.
+ ************************************************************************/
+
+void logOperation(const parsedCommand &command) {
+	if (checkpointInterval != 0
+			&& logSequence - checkpointSequence >= checkpointInterval) {
+		writeCheckpoint();
+	}
+	logSequence++;
+
+	char digits[24];
+	size_t pos = sizeof(digits);
+	unsigned long long value = logSequence;
+	do {
+		digits[--pos] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	operationBuffer.append(digits + pos, sizeof(digits) - pos);
+	operationBuffer.push_back(' ');
+	operationBuffer.append(command.name.data, command.name.length);
+	operationBuffer.push_back('(');
+	operationBuffer.append(command.args.data, command.args.length);
+	operationBuffer.append(")\n");
+
+	if (operationBuffer.length() >= operationBufferBytes) {
+		flushOperationLog();
+	}
+	if (readClock() - operationSyncedAt >= operationSyncNs) {
+		syncOperationLog();
+	}
+}
+
+/************************************************************************
+ Function: flushOperationLog
+ Description: Writes buffered operations to operation log
+ Args: none
+ Returns: none
+ Notes:
+ Does nothing without a checkpoint.
+ ************************************************************************/
+
+void flushOperationLog() {
+	const char *data = operationBuffer.data();
+	size_t length = operationBuffer.length();
+	while (operationLog >= 0 && length > 0) {
+		ssize_t written = write(operationLog, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		data += written;
+		length -= written;
+		operationsUnsynced = true;
+	}
+	operationBuffer.clear();
+}
+
+/************************************************************************
+ Function: syncOperationLog
+ Description: Makes logged operations durable
+ Args: none
+ Returns: none
+ Notes:
+ Writes buffered operations, then fdatasync()s the log if anything was
+ written since the last sync. Does nothing without a checkpoint.
+ On failure, terminates program.
+ ************************************************************************/
+
+void syncOperationLog() {
+	if (operationLog < 0) {
+		return;
+	}
+	flushOperationLog();
+	operationSyncedAt = readClock();
+	if (!operationsUnsynced) {
+		return;
+	}
+	operationsUnsynced = false;
+	if (fdatasync(operationLog) != 0) {
+		terminate(
+				"Critical error: Cannot sync operation log: " + checkpointPath
+						+ ".log");
+	}
+}
+
+/************************************************************************
+ Function: inputPending
+ Description: Checks if standard input can be read without waiting
+ Args: none
+ Returns:
+ true if input is ready or at end
+ false if a read would block
+ Notes:
+ Files are always ready, so syncs of a redirected file come from the
+ operationSyncNs timer.
+ ************************************************************************/
+
+bool inputPending() {
+	struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&input, 1, 0) > 0;
+}
+
+/************************************************************************
+ Function: writeCheckpoint
+ Description: Saves storage to checkpoint file and empties operation log
+ Args: none
+ Returns: none
+ Notes:
+ Waits for outstanding writes. Leases are revoked, leased blocks are
+ not saved.
+ Checkpoint is written to a temporary file and renamed over the old
+ one. If the log cannot be emptied, its operations are skipped on
+ recovery by number.
+ On failure, terminates program.
+ ************************************************************************/
+
+void writeCheckpoint() {
+	drainWriters();
+	flushOperationLog();
+
+	string tempPath = checkpointPath + ".tmp";
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		terminate("Critical error: Cannot write checkpoint: " + tempPath);
+	}
+	bool saved = false;
+	{
+		allocGuard guard;
+		revokeLeases();
+		saved = saveCheckpoint(fd);
+	}
+	if (fsync(fd) != 0) {
+		saved = false;
+	}
+	close(fd);
+	if (!saved || rename(tempPath.c_str(), checkpointPath.c_str()) != 0) {
+		terminate("Critical error: Cannot write checkpoint: " + checkpointPath);
+	}
+
+	checkpointSequence = logSequence;
+	if (ftruncate(operationLog, 0) != 0) {
+		//numbers of logged operations tell recovery to skip them
+		return;
+	}
+}
+
+/************************************************************************
+ Function: saveCheckpoint
+ Description: Writes storage state to a file
+ Args:
+ fd      int     open checkpoint file
+ Returns:
+ true on success
+ false on a write error
+ Notes:
+ Caller holds allocLock and writerLock exclusively (see allocGuard).
+ Block map is saved as extents of files, free space is what is left.
+ Numbers are in native byte order, file is read on the same machine.
+ ************************************************************************/
+
+bool saveCheckpoint(int fd) {
+	checkpointWriter writer = { fd, "", false };
+	writer.buffer.append(checkpointMagic, sizeof(checkpointMagic));
+	putNumber(writer, checkpointVersion);
+
+	putNumber(writer, diskSize);
+	putText(writer, diskUnit);
+	putNumber(writer, blockSize);
+	putText(writer, blockUnit);
+	putNumber(writer, segmentBlocks);
+
+	putNumber(writer, logSequence);
+	putNumber(writer, currentFileId);
+	putNumber(writer, logClock);
+	putNumber(writer, currentPos);
+	putNumber(writer, headLimit);
+	putNumber(writer, nextDirectoryId);
+	putText(writer, currentDir);
+	putNumber(writer, currentDirId);
+
+	putNumber(writer, activeHead);
+	for (unsigned long long h = 0; h < maxLogHeads; h++) {
+		putNumber(writer, heads[h].pos);
+		putNumber(writer, heads[h].limit);
+	}
+	putAmplification(writer, amplification);
+	putAmplification(writer, windowStart);
+	putAmplification(writer, lastWindow);
+
+	putNumber(writer, names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		putText(writer, names[i]);
+	}
+
+	putNumber(writer, directories.size());
+	for (unordered_map<unsigned long long, directory>::iterator it =
+			directories.begin(); it != directories.end(); ++it) {
+		putNumber(writer, it->first);
+		putNumber(writer, it->second.parent);
+		putNumber(writer, it->second.name);
+		putNumber(writer, it->second.created ? 1 : 0);
+		putAmplification(writer, it->second.amplification);
+	}
+
+	putNumber(writer, segmentsCount);
+	for (unsigned long long k = 0; k < segmentsCount; k++) {
+		putNumber(writer, segments[k].lastWrite);
+	}
+
+	unsigned long long count = 0;
+	for (unsigned long long i = 0; i < fileShardCount; i++) {
+		count += fileShards[i].files.size();
+	}
+	putNumber(writer, count);
+	for (unsigned long long i = 0; i < fileShardCount; i++) {
+		map<unsigned long long, file> &files = fileShards[i].files;
+		for (map<unsigned long long, file>::iterator it = files.begin();
+				it != files.end(); ++it) {
+			file &f = it->second;
+			putNumber(writer, it->first);
+			putNumber(writer, f.parent);
+			putNumber(writer, f.name);
+			putNumber(writer, f.allocatedBlocks);
+			putNumber(writer, f.allocatedFileSize);
+			putNumber(writer, f.modified);
+			putNumber(writer, f.rewrites);
+			putNumber(writer, f.extents.size());
+			for (size_t k = 0; k < f.extents.size(); k++) {
+				putNumber(writer, f.extents[k].start);
+				putNumber(writer, f.extents[k].length);
+			}
+		}
+	}
+
+	writer.buffer.append(checkpointMagic, sizeof(checkpointMagic));
+	flushCheckpointWriter(writer);
+	return !writer.failed;
+}
+
+/************************************************************************
+ Function: closeCheckpoint
+ Description: Takes a last checkpoint and closes operation log
+ Args: none
+ Returns: none
+ Notes:
+ Called at exit, after writer threads stopped. Next run recovers
+ without rolling forward. Nothing is saved if no operation was logged.
+ ************************************************************************/
+
+void closeCheckpoint() {
+	if (operationLog < 0) {
+		return;
+	}
+	if (logSequence != checkpointSequence) {
+		writeCheckpoint();
+	}
+	close(operationLog);
+	operationLog = -1;
+}
+
+/************************************************************************
+ Function: putNumber
+ Description: Appends a number to checkpoint
+ Args:
+ writer  checkpointWriter&       checkpoint being written
+ value   unsigned long long      number to append
+ Returns: none
+ ************************************************************************/
+
+void putNumber(checkpointWriter &writer, unsigned long long value) {
+	writer.buffer.append((const char *) &value, sizeof(value));
+	if (writer.buffer.length() >= checkpointBufferBytes) {
+		flushCheckpointWriter(writer);
+	}
+}
+
+/************************************************************************
+ Function: putText
+ Description: Appends a length prefixed string to checkpoint
+ Args:
+ writer  checkpointWriter&       checkpoint being written
+ text    string                  string to append
+ Returns: none
+ ************************************************************************/
+
+void putText(checkpointWriter &writer, const string &text) {
+	putNumber(writer, text.length());
+	writer.buffer.append(text);
+}
+
+/************************************************************************
+ Function: flushCheckpointWriter
+ Description: Writes buffered checkpoint bytes to its file
+ Args:
+ writer  checkpointWriter&       checkpoint being written
+ Returns: none
+ Notes:
+ Sets failed on a write error, later bytes are dropped.
+ ************************************************************************/
+
+void flushCheckpointWriter(checkpointWriter &writer) {
+	const char *data = writer.buffer.data();
+	size_t length = writer.buffer.length();
+	while (!writer.failed && length > 0) {
+		ssize_t written = write(writer.fd, data, length);
+		if (written < 0) {
+			if (errno != EINTR) {
+				writer.failed = true;
+			}
+			continue;
+		}
+		data += written;
+		length -= written;
+	}
+	writer.buffer.clear();
+}
+
+/************************************************************************
+ Function: getNumber
+ Description: Reads a number from checkpoint
+ Args:
+ reader  checkpointReader&       checkpoint being read
+ Returns:
+ unsigned long long      number read, 0 past end of checkpoint
+ Notes:
+ Sets failed when reading past end.
+ ************************************************************************/
+
+unsigned long long getNumber(checkpointReader &reader) {
+	unsigned long long value = 0;
+	if (reader.failed || reader.length - reader.pos < sizeof(value)) {
+		reader.failed = true;
+		return 0;
+	}
+	memcpy(&value, reader.data + reader.pos, sizeof(value));
+	reader.pos += sizeof(value);
+	return value;
+}
+
+/************************************************************************
+ Function: getText
+ Description: Reads a length prefixed string from checkpoint
+ Args:
+ reader  checkpointReader&       checkpoint being read
+ Returns:
+ string      string read, empty past end of checkpoint
+ Notes:
+ Sets failed when reading past end.
+ ************************************************************************/
+
+string getText(checkpointReader &reader) {
+	unsigned long long length = getNumber(reader);
+	if (reader.failed || reader.length - reader.pos < length) {
+		reader.failed = true;
+		return "";
+	}
+	string text(reader.data + reader.pos, length);
+	reader.pos += length;
+	return text;
+}
+
+/************************************************************************
+ Function: putAmplification
+ Description: Appends amplification counters to checkpoint
+ Args:
+ writer  checkpointWriter&       checkpoint being written
+ stats   amplificationStats      counters to append
+ Returns: none
+ ************************************************************************/
+
+void putAmplification(checkpointWriter &writer,
+		const amplificationStats &stats) {
+	putNumber(writer, stats.writes);
+	putNumber(writer, stats.written);
+	putNumber(writer, stats.compacted);
+	putNumber(writer, stats.cleaned);
+	putNumber(writer, stats.scanned);
+}
+
+/************************************************************************
+ Function: getAmplification
+ Description: Reads amplification counters from checkpoint
+ Args:
+ reader  checkpointReader&       checkpoint being read
+ Returns:
+ amplificationStats      counters, zero once reader failed
+ ************************************************************************/
+
+amplificationStats getAmplification(checkpointReader &reader) {
+	amplificationStats stats = { };
+	stats.writes = getNumber(reader);
+	stats.written = getNumber(reader);
+	stats.compacted = getNumber(reader);
+	stats.cleaned = getNumber(reader);
+	stats.scanned = getNumber(reader);
+	return stats;
+}
+
+/************** Disk image ************************************************/
+
+/************************************************************************
+ Function: openImage
+ Description: Opens image file backing the disk and its write buffers
+ Args: none
+ Returns: none
+ Notes:
+ Called once disk capacity and block size are set, with --image only.
+ Image is sized to the disk, holes stay sparse. With --direct-io, block
+ size must be a multiple of imageAlignment.
+ An asynchronous engine splits imageBufferMaxBytes between its requests.
+ On failure, terminates program.
+ ************************************************************************/
+
+void openImage() {
+	if (imagePath.empty()) {
+		return;
+	}
+	imageBlockBytes = convertSize(blockSize, blockUnit, "B");
+	if (imageDirect && imageBlockBytes % imageAlignment != 0) {
+		terminate(
+				"Critical error: Invalid option: --direct-io needs a block size that is a multiple of 4KB");
+	}
+
+	int flags = O_RDWR | O_CREAT;
+	if (imageDirect) {
+		flags |= O_DIRECT;
+	}
+	imageFd = open(imagePath.c_str(), flags, 0644);
+	if (imageFd < 0
+			|| ftruncate(imageFd, blocksCount * imageBlockBytes) != 0) {
+		terminate("Critical error: Cannot open disk image: " + imagePath);
+	}
+
+	unsigned long long buffers = ioEngine == IO_SYNC ? 1 : ioDepth + 1;
+	imageBufferBlocks = std::max((unsigned long long) 1,
+			std::min(segmentBlocks,
+					(unsigned long long) imageBufferMaxBytes / buffers
+							/ imageBlockBytes));
+	imageBufferLength = 0;
+	if (ioEngine != IO_SYNC) {
+		startIoEngine();
+		return;
+	}
+
+	size_t bytes = imageBufferBlocks * imageBlockBytes;
+	void *buffer = NULL;
+	void *copyBuffer = NULL;
+	if (posix_memalign(&buffer, imageAlignment, bytes) != 0
+			|| posix_memalign(&copyBuffer, imageAlignment, bytes) != 0) {
+		terminate("Critical error: Cannot allocate disk image buffers.");
+	}
+	imageBuffer = (char *) buffer;
+	imageCopyBuffer = (char *) copyBuffer;
+}
+
+/************************************************************************
+ Function: closeImage
+ Description: Flushes write buffer and closes image file
+ Args: none
+ Returns: none
+ Notes:
+ Called at exit once background cleaner and writers stopped.
+ Waits for I/O in flight. Image is synced to the device so timing
+ includes the writes.
+ ************************************************************************/
+
+void closeImage() {
+	if (imageFd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&imageLock);
+	drainImage();
+	pthread_mutex_unlock(&imageLock);
+	if (fdatasync(imageFd) != 0 && imageError == 0) {
+		imageError = errno;
+	}
+	if (ioRequests != NULL) {
+		stopIoEngine();
+	} else {
+		free(imageBuffer);
+		free(imageCopyBuffer);
+	}
+	close(imageFd);
+	imageFd = -1;
+	imageBuffer = NULL;
+	imageCopyBuffer = NULL;
+}
+
+/************************************************************************
+ Function: writeImage
+ Description: Writes blocks of a file to disk image
+ Args:
+ start   unsigned long long  first block
+ length  unsigned long long  number of blocks
+ fileId  unsigned long long  owner of the blocks
+ Returns: none
+ Notes:
+ Each block starts with file id and block number, rest is zero.
+ Blocks go through the segment write buffer. Cached blocks are dropped,
+ also without --image.
+ ************************************************************************/
+
+void writeImage(unsigned long long start, unsigned long long length,
+		unsigned long long fileId) {
+	invalidateCache(start, length);
+	if (imageFd < 0) {
+		return;
+	}
+	unsigned long long stamp[2] = { fileId, 0 };
+	size_t stampBytes = std::min((size_t) imageBlockBytes, sizeof(stamp));
+
+	pthread_mutex_lock(&imageLock);
+	for (unsigned long long i = start; i < start + length; i++) {
+		char *block = bufferImage(i);
+		stamp[1] = i;
+		memcpy(block, stamp, stampBytes);
+		std::fill_n(block + stampBytes, imageBlockBytes - stampBytes, 0);
+	}
+	pthread_mutex_unlock(&imageLock);
+}
+
+/************************************************************************
+ Function: copyImage
+ Description: Copies relocated blocks inside disk image
+ Args:
+ from    unsigned long long  first block to copy
+ to      unsigned long long  first block of destination
+ length  unsigned long long  number of blocks
+ Returns: none
+ Notes:
+ Copies in buffer sized pieces from the start, so a destination before
+ an overlapping source is safe, as in defragment().
+ Buffered writes are flushed first when they overlap blocks copied.
+ With an asynchronous engine each piece is a request that reads and
+ then writes its blocks, so pieces of consecutive copies stream without
+ waiting for each other.
+ Cached destination blocks are dropped, also without --image.
+ ************************************************************************/
+
+void copyImage(unsigned long long from, unsigned long long to,
+		unsigned long long length) {
+	if (from == to) {
+		return;
+	}
+	invalidateCache(to, length);
+	if (imageFd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&imageLock);
+	while (length > 0 && imageError == 0) {
+		unsigned long long count = std::min(length, imageBufferBlocks);
+		unsigned long long bufferEnd = imageBufferStart + imageBufferLength;
+		if (imageBufferLength > 0
+				&& ((from < bufferEnd && imageBufferStart < from + count)
+						|| (to < bufferEnd && imageBufferStart < to + count))) {
+			flushImage();
+		}
+
+		if (ioRequests != NULL) {
+			ioRequest *request = acquireRequest();
+			request->write = false;
+			request->start = from;
+			request->length = count;
+			request->target = to;
+			startRequest(request);
+			from += count;
+			to += count;
+			length -= count;
+			continue;
+		}
+
+		int error = transferImage(imageCopyBuffer, count * imageBlockBytes,
+				from * imageBlockBytes, false);
+		if (error != 0) {
+			imageError = error;
+		}
+		for (unsigned long long i = 0; i < count && imageError == 0; i++) {
+			memcpy(bufferImage(to + i), imageCopyBuffer + i * imageBlockBytes,
+					imageBlockBytes);
+		}
+		from += count;
+		to += count;
+		length -= count;
+	}
+	pthread_mutex_unlock(&imageLock);
+}
+
+/************************************************************************
+ Function: bufferImage
+ Description: Adds one block to segment write buffer
+ Args:
+ block   unsigned long long  disk block to write
+ Returns:
+ char*   buffer space for contents of the block
+ Notes:
+ Caller holds imageLock.
+ Buffer holds one run of consecutive blocks. It is flushed when full or
+ when the block does not extend the run. With an asynchronous engine the
+ buffer belongs to a free request, taken when the run starts.
+ ************************************************************************/
+
+char *bufferImage(unsigned long long block) {
+	if (imageBufferLength > 0
+			&& (block != imageBufferStart + imageBufferLength
+					|| imageBufferLength == imageBufferBlocks)) {
+		flushImage();
+	}
+	if (imageBufferLength == 0) {
+		if (ioRequests != NULL) {
+			imageFill = acquireRequest();
+			imageFill->state = IO_FILLING;
+			imageBuffer = imageFill->buffer;
+		}
+		imageBufferStart = block;
+	}
+	return imageBuffer + imageBufferLength++ * imageBlockBytes;
+}
+
+/************************************************************************
+ Function: flushImage
+ Description: Writes segment write buffer to image with one pwrite
+ Args: none
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ With an asynchronous engine the write is submitted and not waited for.
+ A failed write is kept in imageError and reported by executeCommand().
+ ************************************************************************/
+
+void flushImage() {
+	if (imageBufferLength == 0) {
+		return;
+	}
+	if (imageFill != NULL) {
+		imageFill->write = true;
+		imageFill->start = imageBufferStart;
+		imageFill->length = imageBufferLength;
+		startRequest(imageFill);
+		imageFill = NULL;
+		imageBuffer = NULL;
+	} else {
+		int error = transferImage(imageBuffer,
+				imageBufferLength * imageBlockBytes,
+				imageBufferStart * imageBlockBytes, true);
+		if (error != 0) {
+			imageError = error;
+		}
+	}
+	imageBufferLength = 0;
+}
+
+/************************************************************************
+ Function: transferImage
+ Description: Writes or reads image bytes until done
+ Args:
+ buffer  char*               bytes to write or space to read into
+ bytes   size_t              number of bytes
+ offset  unsigned long long  image offset
+ write   bool                pwrite when true, else pread
+ Returns:
+ int     0 on success, else errno
+ Notes:
+ Retries short transfers and EINTR. Used by sync engine and threads of
+ thread pool engine.
+ ************************************************************************/
+
+int transferImage(char *buffer, size_t bytes, unsigned long long offset,
+		bool write) {
+	size_t done = 0;
+	while (done < bytes) {
+		ssize_t moved =
+				write ? pwrite(imageFd, buffer + done, bytes - done,
+								offset + done) :
+						pread(imageFd, buffer + done, bytes - done,
+								offset + done);
+		if (moved < 0 && errno == EINTR) {
+			continue;
+		}
+		if (moved <= 0) {
+			return moved < 0 ? errno : EIO;
+		}
+		done += moved;
+	}
+	return 0;
+}
+
+/************************************************************************
+ Function: readImage
+ Description: Reads blocks from disk image
+ Args:
+ start   unsigned long long  first block
+ length  unsigned long long  number of blocks
+ buffer  char*               space for the blocks, aligned for O_DIRECT
+ Returns:
+ int     0 on success, else errno
+ Notes:
+ Buffered and in flight writes of the blocks are completed first, so
+ the image holds what was last written.
+ ************************************************************************/
+
+int readImage(unsigned long long start, unsigned long long length,
+		char *buffer) {
+	pthread_mutex_lock(&imageLock);
+	if (imageBufferLength > 0 && start < imageBufferStart + imageBufferLength
+			&& imageBufferStart < start + length) {
+		flushImage();
+	}
+	if (ioRequests != NULL) {
+		//target past the disk, probe only reads
+		ioRequest probe = { NULL, IO_FREE, false, start, length, blocksCount,
+				ioSequence + 1, 0 };
+		while (isBlocked(probe)) {
+			reapRequests(true);
+			pumpRequests();
+		}
+	}
+	int error = transferImage(buffer, length * imageBlockBytes,
+			start * imageBlockBytes, false);
+	pthread_mutex_unlock(&imageLock);
+	return error;
+}
+
+/************** I/O engine ************************************************/
+
+/************************************************************************
+ Function: startIoEngine
+ Description: Sets up requests of an asynchronous I/O engine
+ Args: none
+ Returns: none
+ Notes:
+ Called by openImage() with --io-engine=uring or threads.
+ There are ioDepth + 1 requests, so one can hold the segment write
+ buffer while ioDepth are in flight. When io_uring cannot be set up,
+ the thread pool is used instead.
+ On failure, terminates program.
+ ************************************************************************/
+
+void startIoEngine() {
+	ioRequests = new ioRequest[ioDepth + 1];
+	for (unsigned long long k = 0; k <= ioDepth; k++) {
+		void *buffer = NULL;
+		if (posix_memalign(&buffer, imageAlignment,
+				imageBufferBlocks * imageBlockBytes) != 0) {
+			terminate("Critical error: Cannot allocate disk image buffers.");
+		}
+		ioRequests[k].buffer = (char *) buffer;
+		ioRequests[k].state = IO_FREE;
+		ioRequests[k].sequence = 0;
+	}
+
+	if (ioEngine == IO_URING && !setupRing()) {
+		ioEngine = IO_THREADS;
+	}
+	if (ioEngine == IO_THREADS) {
+		ioThreadsCount = std::min(ioDepth, maxIoThreads);
+		ioThreads = new pthread_t[ioThreadsCount];
+		ioStop = false;
+		for (unsigned long long k = 0; k < ioThreadsCount; k++) {
+			if (pthread_create(&ioThreads[k], NULL, runIoThread, NULL) != 0) {
+				terminate("Critical error: Cannot start I/O threads.");
+			}
+		}
+	}
+}
+
+/************************************************************************
+ Function: setupRing
+ Description: Creates io_uring and maps its rings
+ Args: none
+ Returns:
+ bool    true when ring is ready
+ Notes:
+ Uses the system calls directly, no liburing. Needs IORING_OP_READ and
+ IORING_OP_WRITE, available since IORING_FEAT_RW_CUR_POS.
+ ************************************************************************/
+
+bool setupRing() {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, (unsigned) ioDepth + 1, &params);
+	if (fd < 0) {
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		return false;
+	}
+
+	ring.fd = fd;
+	ring.sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cqBytes = params.cq_off.cqes
+			+ params.cq_entries * sizeof(io_uring_cqe);
+	ring.sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+	bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMap) {
+		ring.sqBytes = ring.cqBytes = std::max(ring.sqBytes, ring.cqBytes);
+	}
+	ring.sqMap = mmap(NULL, ring.sqBytes, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring.cqMap =
+			singleMap ?
+					ring.sqMap :
+					mmap(NULL, ring.cqBytes, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, ring.sqesBytes, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sqMap == MAP_FAILED || ring.cqMap == MAP_FAILED
+			|| sqes == MAP_FAILED) {
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, ring.sqesBytes);
+		}
+		if (!singleMap && ring.cqMap != MAP_FAILED) {
+			munmap(ring.cqMap, ring.cqBytes);
+		}
+		if (ring.sqMap != MAP_FAILED) {
+			munmap(ring.sqMap, ring.sqBytes);
+		}
+		close(fd);
+		ring.fd = -1;
+		return false;
+	}
+
+	char *sq = (char *) ring.sqMap;
+	char *cq = (char *) ring.cqMap;
+	ring.sqHead = (unsigned *) (sq + params.sq_off.head);
+	ring.sqTail = (unsigned *) (sq + params.sq_off.tail);
+	ring.sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned *) (sq + params.sq_off.array);
+	ring.cqHead = (unsigned *) (cq + params.cq_off.head);
+	ring.cqTail = (unsigned *) (cq + params.cq_off.tail);
+	ring.cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring.sqes = (io_uring_sqe *) sqes;
+	ring.cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+	return true;
+}
+
+/************************************************************************
+ Function: stopIoEngine
+ Description: Stops thread pool, unmaps io_uring and frees requests
+ Args: none
+ Returns: none
+ Notes:
+ Called by closeImage() once all requests are done.
+ ************************************************************************/
+
+void stopIoEngine() {
+	if (ioThreads != NULL) {
+		pthread_mutex_lock(&ioQueueLock);
+		ioStop = true;
+		pthread_cond_broadcast(&ioQueued);
+		pthread_mutex_unlock(&ioQueueLock);
+		for (unsigned long long k = 0; k < ioThreadsCount; k++) {
+			pthread_join(ioThreads[k], NULL);
+		}
+		delete[] ioThreads;
+		ioThreads = NULL;
+	}
+	if (ring.fd >= 0) {
+		munmap(ring.sqes, ring.sqesBytes);
+		if (ring.cqMap != ring.sqMap) {
+			munmap(ring.cqMap, ring.cqBytes);
+		}
+		munmap(ring.sqMap, ring.sqBytes);
+		close(ring.fd);
+		ring.fd = -1;
+	}
+	for (unsigned long long k = 0; k <= ioDepth; k++) {
+		free(ioRequests[k].buffer);
+	}
+	delete[] ioRequests;
+	ioRequests = NULL;
+	imageFill = NULL;
+}
+
+/************************************************************************
+ Function: acquireRequest
+ Description: Takes a free request, waiting for one to complete if needed
+ Args: none
+ Returns:
+ ioRequest*  free request, filled and started by caller
+ Notes:
+ Caller holds imageLock.
+ ************************************************************************/
+
+ioRequest *acquireRequest() {
+	for (;;) {
+		for (unsigned long long k = 0; k <= ioDepth; k++) {
+			if (ioRequests[k].state == IO_FREE) {
+				return &ioRequests[k];
+			}
+		}
+		pumpRequests();
+		reapRequests(true);
+	}
+}
+
+/************************************************************************
+ Function: startRequest
+ Description: Submits a write or relocation read in order
+ Args:
+ request     ioRequest*  request with its blocks set
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ The engine may complete requests in any order, so a request waits for
+ earlier ones touching the same blocks, unless both only read them.
+ Completions are reaped first so relocation writes keep flowing.
+ ************************************************************************/
+
+void startRequest(ioRequest *request) {
+	reapRequests(false);
+	pumpRequests();
+	request->sequence = ++ioSequence;
+	while (isBlocked(*request)) {
+		reapRequests(true);
+		pumpRequests();
+	}
+	submitRequest(request);
+}
+
+/************************************************************************
+ Function: isBlocked
+ Description: Checks for an earlier request touching the same blocks
+ Args:
+ request     ioRequest&  request to submit
+ Returns:
+ bool    true while an earlier request in flight or ready conflicts
+ Notes:
+ Caller holds imageLock.
+ A relocation read conflicts through its source and its target.
+ ************************************************************************/
+
+bool isBlocked(const ioRequest &request) {
+	for (unsigned long long k = 0; k <= ioDepth; k++) {
+		const ioRequest &other = ioRequests[k];
+		if (&other == &request || other.sequence > request.sequence
+				|| (other.state != IO_INFLIGHT && other.state != IO_READY)) {
+			continue;
+		}
+		if (overlapsRequest(request, other.start, other.length, other.write)
+				|| (!other.write
+						&& overlapsRequest(request, other.target,
+								other.length, true))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/************************************************************************
+ Function: overlapsRequest
+ Description: Checks whether a request conflicts with a block access
+ Args:
+ request     ioRequest&          request to check
+ start       unsigned long long  first block accessed
+ length      unsigned long long  number of blocks
+ write       bool                access writes the blocks
+ Returns:
+ bool    true when blocks overlap and either side writes them
+ Notes: none
+ ************************************************************************/
+
+bool overlapsRequest(const ioRequest &request, unsigned long long start,
+		unsigned long long length, bool write) {
+	if (request.start < start + length && start < request.start + request.length
+			&& (write || request.write)) {
+		return true;
+	}
+	return !request.write && request.target < start + length
+			&& start < request.target + request.length;
+}
+
+/************************************************************************
+ Function: submitRequest
+ Description: Hands a request to the engine
+ Args:
+ request     ioRequest*  request no earlier request conflicts with
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ A failed io_uring submission takes the entry back from the ring, and is
+ kept in imageError and reported by executeCommand().
+ ************************************************************************/
+
+void submitRequest(ioRequest *request) {
+	request->state = IO_INFLIGHT;
+	ioInFlight++;
+	if (ioEngine == IO_THREADS) {
+		pthread_mutex_lock(&ioQueueLock);
+		ioQueue.push_back(request);
+		pthread_cond_signal(&ioQueued);
+		pthread_mutex_unlock(&ioQueueLock);
+		return;
+	}
+
+	unsigned tail = *ring.sqTail;
+	unsigned index = tail & *ring.sqMask;
+	io_uring_sqe *entry = &ring.sqes[index];
+	memset(entry, 0, sizeof(*entry));
+	entry->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+	entry->fd = imageFd;
+	entry->addr = (unsigned long long) request->buffer;
+	entry->len = request->length * imageBlockBytes;
+	entry->off = request->start * imageBlockBytes;
+	entry->user_data = (unsigned long long) request;
+	ring.sqArray[index] = index;
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+	while (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			//nothing was consumed when io_uring_enter fails
+			long long error = errno;
+			__atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+			completeRequest(request, -error);
+			return;
+		}
+		reapRequests(false);
+	}
+}
+
+/************************************************************************
+ Function: pumpRequests
+ Description: Submits relocation writes whose reads completed
+ Args: none
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ Writes still blocked by earlier requests stay ready for a later call.
+ ************************************************************************/
+
+void pumpRequests() {
+	for (unsigned long long k = 0; k <= ioDepth; k++) {
+		if (ioRequests[k].state == IO_READY && !isBlocked(ioRequests[k])) {
+			submitRequest(&ioRequests[k]);
+		}
+	}
+}
+
+/************************************************************************
+ Function: reapRequests
+ Description: Collects completed requests from the engine
+ Args:
+ wait    bool    wait for one completion when none is there
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ Does not wait when nothing is in flight.
+ A failed io_uring wait is kept in imageError and reported by
+ executeCommand(). Requests in flight are then given up, so callers
+ waiting for them go on.
+ ************************************************************************/
+
+void reapRequests(bool wait) {
+	if (ioEngine == IO_THREADS) {
+		pthread_mutex_lock(&ioQueueLock);
+		while (wait && ioDone.empty() && ioInFlight > 0) {
+			pthread_cond_wait(&ioCompleted, &ioQueueLock);
+		}
+		deque<ioRequest *> done;
+		done.swap(ioDone);
+		pthread_mutex_unlock(&ioQueueLock);
+		for (size_t k = 0; k < done.size(); k++) {
+			completeRequest(done[k], done[k]->result);
+		}
+		return;
+	}
+
+	for (;;) {
+		unsigned head = *ring.cqHead;
+		unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			while (head != tail) {
+				io_uring_cqe *entry = &ring.cqes[head & *ring.cqMask];
+				ioRequest *request = (ioRequest *) entry->user_data;
+				long long result = entry->res;
+				__atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);
+				completeRequest(request, result);
+			}
+			return;
+		}
+		if (!wait || ioInFlight == 0) {
+			return;
+		}
+		if (syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			long long error = errno;
+			for (unsigned long long k = 0; k <= ioDepth; k++) {
+				if (ioRequests[k].state == IO_INFLIGHT) {
+					completeRequest(&ioRequests[k], -error);
+				}
+			}
+			return;
+		}
+	}
+}
+
+/************************************************************************
+ Function: completeRequest
+ Description: Finishes a request reaped from the engine
+ Args:
+ request     ioRequest*  completed request
+ result      long long   bytes transferred or -errno
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ A short transfer is finished synchronously. A relocation read becomes
+ a ready write of the same buffer to its target, else request is freed.
+ A failed request is kept in imageError and reported by executeCommand().
+ ************************************************************************/
+
+void completeRequest(ioRequest *request, long long result) {
+	ioInFlight--;
+	size_t bytes = request->length * imageBlockBytes;
+	int error = 0;
+	if (result < 0) {
+		error = -result;
+	} else if ((size_t) result < bytes) {
+		error = transferImage(request->buffer + result, bytes - result,
+				request->start * imageBlockBytes + result, request->write);
+	}
+	if (error != 0) {
+		imageError = error;
+		request->state = IO_FREE;
+		return;
+	}
+
+	if (!request->write) {
+		request->write = true;
+		request->start = request->target;
+		request->state = IO_READY;
+	} else {
+		request->state = IO_FREE;
+	}
+}
+
+/************************************************************************
+ Function: drainImage
+ Description: Flushes write buffer and waits for all requests
+ Args: none
+ Returns: none
+ Notes:
+ Caller holds imageLock.
+ ************************************************************************/
+
+void drainImage() {
+	flushImage();
+	if (ioRequests == NULL) {
+		return;
+	}
+	for (;;) {
+		pumpRequests();
+		if (ioInFlight == 0) {
+			break;
+		}
+		reapRequests(true);
+	}
+}
+
+/************************************************************************
+ Function: runIoThread
+ Description: Thread of thread pool engine
+ Args: none
+ Returns: none
+ Notes:
+ Takes submitted requests in order and completes them with pwrite or
+ pread, until stopIoEngine() is called.
+ ************************************************************************/
+
+void *runIoThread(void *) {
+	pthread_mutex_lock(&ioQueueLock);
+	for (;;) {
+		while (ioQueue.empty() && !ioStop) {
+			pthread_cond_wait(&ioQueued, &ioQueueLock);
+		}
+		if (ioQueue.empty()) {
+			break;
+		}
+		ioRequest *request = ioQueue.front();
+		ioQueue.pop_front();
+		pthread_mutex_unlock(&ioQueueLock);
+
+		size_t bytes = request->length * imageBlockBytes;
+		int error = transferImage(request->buffer, bytes,
+				request->start * imageBlockBytes, request->write);
+		request->result = error != 0 ? -(long long) error : (long long) bytes;
+
+		pthread_mutex_lock(&ioQueueLock);
+		ioDone.push_back(request);
+		pthread_cond_signal(&ioCompleted);
+	}
+	pthread_mutex_unlock(&ioQueueLock);
+	return NULL;
+}
+
+/************** Block cache ***********************************************/
+
+/************************************************************************
+ Function: initCache
+ Description: Sizes block cache and its shards
+ Args: none
+ Returns: none
+ Notes:
+ Called once disk capacity and block size are set.
+ Capacity is cacheSize MB of blocks, split evenly between shards. Block
+ data is allocated as blocks are cached.
+ ************************************************************************/
+
+void initCache() {
+	cacheBlockBytes = convertSize(blockSize, blockUnit, "B");
+	cacheReadBlocks = std::max((unsigned long long) 1,
+			(unsigned long long) cacheReadMaxBytes / cacheBlockBytes);
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, imageAlignment,
+			cacheReadBlocks * cacheBlockBytes) != 0) {
+		terminate("Critical error: Cannot allocate block cache.");
+	}
+	cacheReadBuffer = (char *) buffer;
+
+	unsigned long long capacity = (cacheSize << 20) / cacheBlockBytes;
+	if (capacity == 0) {
+		return;
+	}
+	cacheShardsUsed = std::min(cacheShardCount, capacity);
+	cacheShards = new cacheShard[cacheShardsUsed];
+	for (unsigned long long k = 0; k < cacheShardsUsed; k++) {
+		pthread_mutex_init(&cacheShards[k].lock, NULL);
+		cacheShards[k].capacity = capacity / cacheShardsUsed
+				+ (k < capacity % cacheShardsUsed ? 1 : 0);
+		cacheShards[k].recentTarget = 0;
+	}
+}
+
+/************************************************************************
+ Function: getCacheShard
+ Description: Gets shard caching a block
+ Args:
+ block   unsigned long long  disk block
+ Returns:
+ cacheShard&     shard of the block
+ Notes:
+ Consecutive blocks go to different shards.
+ ************************************************************************/
+
+cacheShard &getCacheShard(unsigned long long block) {
+	return cacheShards[block % cacheShardsUsed];
+}
+
+/************************************************************************
+ Function: lookupCache
+ Description: Checks whether a block is cached
+ Args:
+ block   unsigned long long  disk block
+ touch   bool                count as a read of the block
+ Returns:
+ bool    true if block data is cached
+ Notes:
+ A touched block becomes most recent. With ARC it moves to the frequent
+ list, as it is read a second time, unless readahead brought it in.
+ ************************************************************************/
+
+bool lookupCache(unsigned long long block, bool touch) {
+	if (cacheShards == NULL) {
+		return false;
+	}
+	cacheShard &shard = getCacheShard(block);
+	pthread_mutex_lock(&shard.lock);
+	unordered_map<unsigned long long, list<cacheEntry>::iterator>::iterator found =
+			shard.entries.find(block);
+	bool cached = found != shard.entries.end()
+			&& found->second->data != NULL;
+	if (cached && touch) {
+		cacheListType to = cachePolicy == CACHE_ARC && !found->second->ahead ?
+				CACHE_FREQUENT : CACHE_RECENT;
+		found->second->ahead = false;
+		moveCacheEntry(shard, found->second, to, NULL);
+	}
+	pthread_mutex_unlock(&shard.lock);
+	return cached;
+}
+
+/************************************************************************
+ Function: insertCache
+ Description: Adds a block read from disk to cache
+ Args:
+ block   unsigned long long  disk block
+ data    const char*         block contents
+ ahead   bool                fetched by readahead
+ Returns: none
+ Notes:
+ LRU evicts its least recently read block when full.
+ ARC follows Megiddo and Modha: a block evicted not long ago (a ghost)
+ comes back to the frequent list and moves recentTarget towards the list
+ it was evicted from. Ghost lists remember up to capacity blocks each
+ side without their data.
+ ************************************************************************/
+
+void insertCache(unsigned long long block, const char *data, bool ahead) {
+	if (cacheShards == NULL) {
+		return;
+	}
+	cacheUsed = true;
+	cacheShard &shard = getCacheShard(block);
+	pthread_mutex_lock(&shard.lock);
+	list<cacheEntry> *lists = shard.lists;
+	unsigned long long capacity = shard.capacity;
+	unordered_map<unsigned long long, list<cacheEntry>::iterator>::iterator found =
+			shard.entries.find(block);
+
+	if (found != shard.entries.end() && found->second->data != NULL) {
+		memcpy(found->second->data, data, cacheBlockBytes);
+		found->second->ahead = found->second->ahead && ahead;
+	} else if (cachePolicy == CACHE_LRU) {
+		if (lists[CACHE_RECENT].size() >= capacity) {
+			dropCacheEntry(shard, --lists[CACHE_RECENT].end());
+		}
+		cacheEntry entry = { block, CACHE_RECENT, NULL, ahead };
+		lists[CACHE_RECENT].push_front(entry);
+		shard.entries[block] = lists[CACHE_RECENT].begin();
+		moveCacheEntry(shard, lists[CACHE_RECENT].begin(), CACHE_RECENT,
+				data);
+	} else if (found != shard.entries.end()) {
+		//Ghost hit, adapt towards the list that lost the block
+		unsigned long long recentGhosts = lists[CACHE_RECENT_GHOST].size();
+		unsigned long long frequentGhosts =
+				lists[CACHE_FREQUENT_GHOST].size();
+		bool frequentGhost = found->second->list == CACHE_FREQUENT_GHOST;
+		if (!frequentGhost) {
+			unsigned long long step = std::max((unsigned long long) 1,
+					frequentGhosts / recentGhosts);
+			shard.recentTarget = std::min(capacity,
+					shard.recentTarget + step);
+		} else {
+			unsigned long long step = std::max((unsigned long long) 1,
+					recentGhosts / frequentGhosts);
+			shard.recentTarget =
+					shard.recentTarget > step ?
+							shard.recentTarget - step : 0;
+		}
+		replaceCache(shard, frequentGhost);
+		found->second->ahead = ahead;
+		moveCacheEntry(shard, found->second, CACHE_FREQUENT, data);
+	} else {
+		unsigned long long recent = lists[CACHE_RECENT].size()
+				+ lists[CACHE_RECENT_GHOST].size();
+		unsigned long long total = recent + lists[CACHE_FREQUENT].size()
+				+ lists[CACHE_FREQUENT_GHOST].size();
+		if (recent >= capacity) {
+			if (lists[CACHE_RECENT].size() < capacity) {
+				dropCacheEntry(shard, --lists[CACHE_RECENT_GHOST].end());
+				replaceCache(shard, false);
+			} else {
+				dropCacheEntry(shard, --lists[CACHE_RECENT].end());
+			}
+		} else if (total >= capacity) {
+			if (total >= 2 * capacity
+					&& !lists[CACHE_FREQUENT_GHOST].empty()) {
+				dropCacheEntry(shard, --lists[CACHE_FREQUENT_GHOST].end());
+			}
+			replaceCache(shard, false);
+		}
+		cacheEntry entry = { block, CACHE_RECENT, NULL, ahead };
+		lists[CACHE_RECENT].push_front(entry);
+		shard.entries[block] = lists[CACHE_RECENT].begin();
+		moveCacheEntry(shard, lists[CACHE_RECENT].begin(), CACHE_RECENT,
+				data);
+	}
+	pthread_mutex_unlock(&shard.lock);
+}
+
+/************************************************************************
+ Function: replaceCache
+ Description: Evicts one block of ARC to its ghost list
+ Args:
+ shard           cacheShard&     shard to make room in
+ frequentGhost   bool            block being cached is a ghost of T2
+ Returns: none
+ Notes:
+ Caller holds shard lock.
+ Evicts from T1 while it is above recentTarget, else from T2. Does
+ nothing while cached blocks are below capacity, as after invalidation.
+ ************************************************************************/
+
+void replaceCache(cacheShard &shard, bool frequentGhost) {
+	list<cacheEntry> *lists = shard.lists;
+	unsigned long long recent = lists[CACHE_RECENT].size();
+	if (recent + lists[CACHE_FREQUENT].size() < shard.capacity) {
+		return;
+	}
+	if (recent > 0
+			&& (recent > shard.recentTarget
+					|| (frequentGhost && recent == shard.recentTarget)
+					|| lists[CACHE_FREQUENT].empty())) {
+		moveCacheEntry(shard, --lists[CACHE_RECENT].end(),
+				CACHE_RECENT_GHOST, NULL);
+	} else {
+		moveCacheEntry(shard, --lists[CACHE_FREQUENT].end(),
+				CACHE_FREQUENT_GHOST, NULL);
+	}
+}
+
+/************************************************************************
+ Function: moveCacheEntry
+ Description: Moves an entry to the front of a list
+ Args:
+ shard   cacheShard&                 shard of the entry
+ entry   list<cacheEntry>::iterator  entry to move
+ to      cacheListType               list to move to
+ data    const char*                 contents to store, NULL to keep
+ Returns: none
+ Notes:
+ Caller holds shard lock.
+ Entries moved to a ghost list give their data buffer to spare buffers.
+ Entries given data take a spare buffer or a new one.
+ ************************************************************************/
+
+void moveCacheEntry(cacheShard &shard, list<cacheEntry>::iterator entry,
+		cacheListType to, const char *data) {
+	shard.lists[to].splice(shard.lists[to].begin(), shard.lists[entry->list],
+			entry);
+	entry->list = to;
+	if (to == CACHE_RECENT_GHOST || to == CACHE_FREQUENT_GHOST) {
+		if (entry->data != NULL) {
+			shard.spare.push_back(entry->data);
+			entry->data = NULL;
+			cacheBlocks--;
+		}
+		return;
+	}
+	if (data == NULL) {
+		return;
+	}
+	if (entry->data == NULL) {
+		if (!shard.spare.empty()) {
+			entry->data = shard.spare.back();
+			shard.spare.pop_back();
+		} else {
+			entry->data = new char[cacheBlockBytes];
+		}
+		cacheBlocks++;
+	}
+	memcpy(entry->data, data, cacheBlockBytes);
+}
+
+/************************************************************************
+ Function: dropCacheEntry
+ Description: Removes an entry from cache
+ Args:
+ shard   cacheShard&                 shard of the entry
+ entry   list<cacheEntry>::iterator  entry to remove
+ Returns: none
+ Notes:
+ Caller holds shard lock.
+ ************************************************************************/
+
+void dropCacheEntry(cacheShard &shard, list<cacheEntry>::iterator entry) {
+	if (entry->data != NULL) {
+		shard.spare.push_back(entry->data);
+		cacheBlocks--;
+	}
+	shard.entries.erase(entry->block);
+	shard.lists[entry->list].erase(entry);
+}
+
+/************************************************************************
+ Function: invalidateCache
+ Description: Drops blocks being written from cache
+ Args:
+ start   unsigned long long  first block written
+ length  unsigned long long  number of blocks
+ Returns: none
+ Notes:
+ Called by writers and cleaner as they write, shards are locked one at
+ a time. Ghosts are dropped too, written blocks start a new history.
+ Does nothing until a block was cached.
+ ************************************************************************/
+
+void invalidateCache(unsigned long long start, unsigned long long length) {
+	if (!cacheUsed) {
+		return;
+	}
+	for (unsigned long long b = start; b < start + length; b++) {
+		cacheShard &shard = getCacheShard(b);
+		pthread_mutex_lock(&shard.lock);
+		unordered_map<unsigned long long, list<cacheEntry>::iterator>::iterator found =
+				shard.entries.find(b);
+		if (found != shard.entries.end()) {
+			dropCacheEntry(shard, found->second);
+		}
+		pthread_mutex_unlock(&shard.lock);
+	}
+}
+
+/************************************************************************
+ Function: fetchFileBlocks
+ Description: Reads logical blocks of a file through the cache
+ Args:
+ fileId  unsigned long long  file to read
+ f       file&               the file
+ first   unsigned long long  first logical block
+ count   unsigned long long  number of logical blocks
+ ahead   bool                readahead, not counted as hits or misses
+ stats   readStats&          hits, misses and blocks read ahead
+ Returns: none
+ Notes:
+ Caller holds allocGuard.
+ Logical blocks are mapped to disk blocks through the file extents.
+ ************************************************************************/
+
+void fetchFileBlocks(unsigned long long fileId, const file &f,
+		unsigned long long first, unsigned long long count, bool ahead,
+		readStats &stats) {
+	unsigned long long logical = 0;
+	for (size_t i = 0; i < f.extents.size() && count > 0; i++) {
+		const blockExtent &e = f.extents[i];
+		if (first >= logical + e.length) {
+			logical += e.length;
+			continue;
+		}
+		unsigned long long skip = first - logical;
+		unsigned long long take = std::min(e.length - skip, count);
+		fetchBlocks(fileId, e.start + skip, take, ahead, stats);
+		first += take;
+		count -= take;
+		logical += e.length;
+	}
+}
+
+/************************************************************************
+ Function: fetchBlocks
+ Description: Reads consecutive disk blocks of a file through the cache
+ Args:
+ fileId  unsigned long long  owner of the blocks
+ start   unsigned long long  first disk block
+ length  unsigned long long  number of blocks
+ ahead   bool                readahead, not counted as hits or misses
+ stats   readStats&          hits, misses and blocks read ahead
+ Returns: none
+ Notes:
+ Caller holds allocGuard.
+ Each run of blocks not cached is loaded with one read.
+ ************************************************************************/
+
+void fetchBlocks(unsigned long long fileId, unsigned long long start,
+		unsigned long long length, bool ahead, readStats &stats) {
+	unsigned long long missStart = start;
+	unsigned long long missLength = 0;
+	for (unsigned long long b = start; b < start + length; b++) {
+		if (lookupCache(b, !ahead)) {
+			if (!ahead) {
+				stats.hits++;
+			}
+			if (missLength > 0) {
+				loadBlocks(fileId, missStart, missLength, ahead);
+				missLength = 0;
+			}
+			continue;
+		}
+		if (missLength == 0) {
+			missStart = b;
+		}
+		missLength++;
+		if (ahead) {
+			stats.ahead++;
+		} else {
+			stats.misses++;
+		}
+	}
+	if (missLength > 0) {
+		loadBlocks(fileId, missStart, missLength, ahead);
+	}
+}
+
+/************************************************************************
+ Function: loadBlocks
+ Description: Reads blocks from backing store into cache
+ Args:
+ fileId  unsigned long long  owner of the blocks
+ start   unsigned long long  first disk block
+ length  unsigned long long  number of blocks
+ ahead   bool                fetched by readahead
+ Returns: none
+ Notes:
+ Caller holds allocGuard.
+ Reads disk image in pieces of cacheReadBuffer. Without --image, blocks
+ hold what writeImage() would have written.
+ On image read failure, terminates program.
+ ************************************************************************/
+
+void loadBlocks(unsigned long long fileId, unsigned long long start,
+		unsigned long long length, bool ahead) {
+	while (length > 0) {
+		unsigned long long count = std::min(length, cacheReadBlocks);
+		if (imageFd >= 0) {
+			int error = readImage(start, count, cacheReadBuffer);
+			if (error != 0) {
+				terminate(
+						string("Critical error: Cannot read disk image: ")
+								+ strerror(error));
+			}
+		} else {
+			unsigned long long stamp[2] = { fileId, 0 };
+			size_t stampBytes = std::min((size_t) cacheBlockBytes,
+					sizeof(stamp));
+			std::fill_n(cacheReadBuffer, count * cacheBlockBytes, 0);
+			for (unsigned long long i = 0; i < count; i++) {
+				stamp[1] = start + i;
+				memcpy(cacheReadBuffer + i * cacheBlockBytes, stamp,
+						stampBytes);
+			}
+		}
+		for (unsigned long long i = 0; i < count; i++) {
+			insertCache(start + i, cacheReadBuffer + i * cacheBlockBytes,
+					ahead);
+		}
+		start += count;
+		length -= count;
+	}
+}
+
+/************** Trace *****************************************************/
+
+/************************************************************************
+ Function: traceCommand
+ Description: Executes a command and appends it to the trace
+ Args:
+ command     parsedCommand   tokenized command, not a comment
+ step        int             number of first two commands done, 2 after them
+ Returns:
+ unsigned long long      latency in nanoseconds
+ Notes:
+ Latency of commands after the first two is added to their stats()
+ timer. Trace line: <start ns> <latency ns> <1 if defragmented, else 0> <command>
+ Start is counted from the first traced command. With --writers, a
+ write is timed until it is handed to a writer, and a defragmentation
+ is counted for whichever command was running when it happened.
+ On failure, terminates program.
+ ************************************************************************/
+
+unsigned long long traceCommand(const parsedCommand &command, int step) {
+	if (!recordPath.empty() && traceFile < 0) {
+		traceFile = open(recordPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+				0644);
+		if (traceFile < 0) {
+			terminate("Critical error: Cannot write trace: " + recordPath);
+		}
+	}
+
+	unsigned long long defragments = defragmentCount;
+	unsigned long long started = readClock();
+	if (traceOrigin == 0) {
+		traceOrigin = started;
+	}
+	if (step < 2) {
+		executeInitCommand(command, step);
+	} else {
+		executeCommand(command);
+	}
+	unsigned long long latency = readClock() - started;
+	if (step == 2 && command.type >= COMMAND_MKDIR
+			&& command.type <= COMMAND_RMDIR) {
+		addStatsTime((statsTimerType) (TIMER_MKDIR + command.type - COMMAND_MKDIR),
+				latency);
+	} else if (step == 2 && command.type == COMMAND_APPEND) {
+		addStatsTime(TIMER_APPEND, latency);
+	}
+
+	if (traceFile >= 0) {
+		char numbers[64];
+		int length = snprintf(numbers, sizeof(numbers), "%llu %llu %d ",
+				started - traceOrigin, latency,
+				defragmentCount != defragments ? 1 : 0);
+		traceBuffer.append(numbers, length);
+		traceBuffer.append(command.name.data, command.name.length);
+		traceBuffer.push_back('(');
+		traceBuffer.append(command.args.data, command.args.length);
+		traceBuffer.append(")\n");
+		if (traceBuffer.length() >= traceBufferBytes) {
+			flushTrace();
+		}
+	}
+	return latency;
+}
+
+/************************************************************************
+ Function: flushTrace
+ Description: Writes buffered trace lines to trace file
+ Args: none
+ Returns: none
+ Notes:
+ Does nothing without --record.
+ ************************************************************************/
+
+void flushTrace() {
+	const char *data = traceBuffer.data();
+	size_t length = traceBuffer.length();
+	while (traceFile >= 0 && length > 0) {
+		ssize_t written = write(traceFile, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		data += written;
+		length -= written;
+	}
+	traceBuffer.clear();
+}
+
+/************************************************************************
+ Function: closeTrace
+ Description: Writes remaining trace lines and closes trace file
+ Args: none
+ Returns: none
+ ************************************************************************/
+
+void closeTrace() {
+	flushTrace();
+	if (traceFile >= 0) {
+		close(traceFile);
+		traceFile = -1;
+	}
+}
+
+/************************************************************************
+ Function: runReplay
+ Description: Executes commands of a recorded trace
+ Args:
+ path    string      trace file written by --record
+ Returns: none
+ Notes:
+ Trace is read line by line, so it can be larger than memory.
+ As fast as possible by default. With --replay-timing=original, each
+ command waits until its recorded start, counted from the first
+ command; a command running late starts at once.
+ Prints throughput and latency of recording and replay to standard
+ error when done, command results go to output as usual.
+ On failure, terminates program.
+ ************************************************************************/
+
+void runReplay(const string &path) {
+	ifstream trace(path.c_str());
+	if (!trace.is_open()) {
+		terminate("Critical error: Cannot open trace: " + path);
+	}
+
+	vector<latencyHistogram> recorded(COMMAND_UNKNOWN + 1);
+	vector<latencyHistogram> replayed(COMMAND_UNKNOWN + 1);
+	unsigned long long recordedDefragments = 0;
+	unsigned long long replayedDefragments = 0;
+	unsigned long long firstStart = 0;
+	unsigned long long recordedEnd = 0;
+	unsigned long long replayStart = 0;
+
+	string line = "";
+	string text = "";
+	parsedCommand command;
+	int step = 0;
+	while (std::getline(trace, line)) {
+		unsigned long long fields[3] = { 0, 0, 0 };
+		const char *pos = line.c_str();
+		for (int i = 0; i < 3; i++) {
+			char *end = NULL;
+			fields[i] = strtoull(pos, &end, 10);
+			if (end == pos || *end != ' ' || (i == 2 && fields[i] > 1)) {
+				terminate("Critical error: Trace is corrupt: " + path);
+			}
+			pos = end + 1;
+		}
+		text.assign(pos);
+		if (!tokenizeLine(text, command)) {
+			terminate("Critical error: Trace is corrupt: " + path);
+		}
+
+		if (replayStart == 0) {
+			firstStart = fields[0];
+			replayStart = readClock();
+		} else if (replayOriginal && fields[0] >= firstStart) {
+			unsigned long long due = replayStart + fields[0] - firstStart;
+			if (due > readClock()) {
+				syncOperationLog();
+			}
+			struct timespec wake = { (time_t) (due / 1000000000ULL),
+					(long) (due % 1000000000ULL) };
+			while (due > readClock()
+					&& clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+							NULL) == EINTR) {
+			}
+		}
+
+		unsigned long long defragments = defragmentCount;
+		unsigned long long latency = executeLine(command, step);
+		replayedDefragments += defragmentCount - defragments;
+		recordedDefragments += fields[2];
+		recordedEnd = std::max(recordedEnd, fields[0] + fields[1]);
+		addLatency(recorded[command.type], fields[1]);
+		addLatency(recorded[COMMAND_UNKNOWN], fields[1]);
+		addLatency(replayed[command.type], latency);
+		addLatency(replayed[COMMAND_UNKNOWN], latency);
+	}
+	if (step < 2) {
+		terminate(
+				"Critical error: Trace must start with diskCapacity and blockSize: "
+						+ path);
+	}
+	drainWriters();
+
+	printReplayReport(recorded, replayed, recordedEnd - firstStart,
+			readClock() - replayStart, recordedDefragments,
+			replayedDefragments);
+}
+
+/************************************************************************
+ Function: readClock
+ Description: Reads monotonic clock
+ Args: none
+ Returns:
+ unsigned long long      nanoseconds since an arbitrary start, not 0
+ ************************************************************************/
+
+unsigned long long readClock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec + 1;
+}
+
+/************************************************************************
+ Function: addLatency
+ Description: Counts a latency in a histogram
+ Args:
+ histogram   latencyHistogram&   histogram to update
+ ns          unsigned long long  latency in nanoseconds
+ Returns: none
+ ************************************************************************/
+
+void addLatency(latencyHistogram &histogram, unsigned long long ns) {
+	histogram.counts[getLatencyBucket(ns)]++;
+	histogram.samples++;
+	histogram.totalNs += ns;
+	histogram.maxNs = std::max(histogram.maxNs, ns);
+}
+
+/************************************************************************
+ Function: getLatencyBucket
+ Description: Finds histogram bucket of a latency
+ Args:
+ ns      unsigned long long  latency in nanoseconds
+ Returns:
+ unsigned    bucket index, below latencyBuckets
+ Notes:
+ Below 8ns each nanosecond has a bucket. Above, each power of two is
+ split into latencyBucketSteps equal buckets, so a bucket is at most
+ 1/8 wider than its lower bound.
+ ************************************************************************/
+
+unsigned getLatencyBucket(unsigned long long ns) {
+	if (ns < latencyBucketSteps) {
+		return ns;
+	}
+	unsigned exponent = 63 - __builtin_clzll(ns);
+	return (exponent - 2) * latencyBucketSteps
+			+ ((ns >> (exponent - 3)) & (latencyBucketSteps - 1));
+}
+
+/************************************************************************
+ Function: getLatencyBucketStart
+ Description: Gets smallest latency of a histogram bucket
+ Args:
+ bucket  unsigned    bucket index, below latencyBuckets
+ Returns:
+ unsigned long long  lower bound in nanoseconds
+ ************************************************************************/
+
+unsigned long long getLatencyBucketStart(unsigned bucket) {
+	if (bucket < latencyBucketSteps) {
+		return bucket;
+	}
+	unsigned exponent = bucket / latencyBucketSteps + 2;
+	return (unsigned long long) (latencyBucketSteps + bucket % latencyBucketSteps)
+			<< (exponent - 3);
+}
+
+/************************************************************************
+ Function: getLatencyPercentile
+ Description: Estimates a percentile of a histogram
+ Args:
+ histogram   latencyHistogram&   histogram to read
+ fraction    double              0.5 for median, 0.99 for p99
+ Returns:
+ unsigned long long      upper bound of bucket holding the percentile,
+ at most the largest latency, 0 without samples
+ ************************************************************************/
+
+unsigned long long getLatencyPercentile(const latencyHistogram &histogram,
+		double fraction) {
+	unsigned long long rank = (unsigned long long) ceil(
+			fraction * histogram.samples);
+	unsigned long long seen = 0;
+	for (unsigned i = 0; i < latencyBuckets && rank > 0; i++) {
+		seen += histogram.counts[i];
+		if (seen >= rank) {
+			unsigned long long upper =
+					i + 1 < latencyBuckets ? getLatencyBucketStart(i + 1) - 1 :
+							ULLONG_MAX;
+			return std::min(upper, histogram.maxNs);
+		}
+	}
+	return 0;
+}
+
+/************************************************************************
+ Function: printReplayReport
+ Description: Prints recorded and replayed throughput and latency
+ Args:
+ recorded            vector<latencyHistogram>&   recorded latency per commandType,
+ COMMAND_UNKNOWN holds all commands
+ replayed            vector<latencyHistogram>&   replayed latency, same layout
+ recordedNs          unsigned long long          start of first to end of last recorded command
+ replayedNs          unsigned long long          same for replay, including waits
+ recordedDefragments unsigned long long          recorded commands that defragmented
+ replayedDefragments unsigned long long          defragmentations during replay
+ Returns: none
+ Notes:
+ Goes to standard error so output stays comparable to the recorded run.
+ Delta is change of replay from recording in percent.
+ Percentiles are bucket bounds, see getLatencyPercentile.
+ ************************************************************************/
+
+void printReplayReport(const vector<latencyHistogram> &recorded,
+		const vector<latencyHistogram> &replayed,
+		unsigned long long recordedNs, unsigned long long replayedNs,
+		unsigned long long recordedDefragments,
+		unsigned long long replayedDefragments) {
+	const latencyHistogram &all = recorded[COMMAND_UNKNOWN];
+	const latencyHistogram &allReplayed = replayed[COMMAND_UNKNOWN];
+	double recordedRate = recordedNs ? all.samples * 1e9 / recordedNs : 0;
+	double replayedRate = replayedNs ? all.samples * 1e9 / replayedNs : 0;
+
+	fprintf(stderr, "Replay of %s: %llu commands, %s timing\n",
+			replayPath.c_str(), all.samples,
+			replayOriginal ? "original" : "fast");
+	fprintf(stderr, "%-14s %14s %14s %9s\n", "", "recorded", "replayed",
+			"delta");
+	double rows[4][2] = { { recordedNs / 1e6, replayedNs / 1e6 }, {
+			recordedRate, replayedRate }, { all.totalNs / 1e6,
+			allReplayed.totalNs / 1e6 }, { (double) recordedDefragments,
+			(double) replayedDefragments } };
+	const char *rowNames[4] = { "elapsed ms", "commands/s", "busy ms",
+			"defragments" };
+	for (int i = 0; i < 4; i++) {
+		fprintf(stderr, i == 3 ? "%-14s %14.0f %14.0f" : "%-14s %14.3f %14.3f",
+				rowNames[i], rows[i][0], rows[i][1]);
+		if (rows[i][0] > 0) {
+			fprintf(stderr, " %+8.1f%%\n",
+					(rows[i][1] - rows[i][0]) * 100 / rows[i][0]);
+		} else {
+			fprintf(stderr, " %9s\n", "-");
+		}
+	}
+
+	fprintf(stderr, "%-14s %10s", "latency ns", "count");
+	const char *percentileNames[4] = { "p50 recorded", "p99 recorded",
+			"p999 recorded", "max recorded" };
+	double percentiles[4] = { 0.5, 0.99, 0.999, 1 };
+	for (int p = 0; p < 4; p++) {
+		fprintf(stderr, " %13s %12s %8s", percentileNames[p], "replayed",
+				"delta");
+	}
+	fputc('\n', stderr);
+	for (int row = 0; row <= COMMAND_UNKNOWN; row++) {
+		//all commands first, then each command
+		int type = row == 0 ? COMMAND_UNKNOWN : row - 1;
+		if (recorded[type].samples == 0) {
+			continue;
+		}
+		fprintf(stderr, "%-14s %10llu",
+				type == COMMAND_UNKNOWN ? "all" :
+						getCommandName((commandType) type),
+				recorded[type].samples);
+		for (int p = 0; p < 4; p++) {
+			unsigned long long before = getLatencyPercentile(recorded[type],
+					percentiles[p]);
+			unsigned long long after = getLatencyPercentile(replayed[type],
+					percentiles[p]);
+			fprintf(stderr, " %13llu %12llu", before, after);
+			if (before > 0) {
+				fprintf(stderr, " %+7.1f%%",
+						((double) after - before) * 100 / before);
+			} else {
+				fprintf(stderr, " %8s", "-");
+			}
+		}
+		fputc('\n', stderr);
+	}
+}
+
+/************** Stats *****************************************************/
+
+/************************************************************************
+ Function: showStats
+ Description: Outputs call counts and latency of commands and timed
+ functions, and block cache counters
+ Args:
+ args    string      args of stats(), must be empty
+ Returns: none
+ Notes:
+ Counts since start. Each timer outputs calls, total time, percentiles
+ and a histogram line with one bucket per power of two of nanoseconds
+ that has calls. Eg: write: 3 calls, 9000ns total, p50 3071ns, p99 3583ns,
+ p999 3583ns, max 3500ns  write histogram: 2048-4095ns 3
+ With json, one record per timer and one for the cache. With binary,
+ one record per timer: first reserved byte is index of timer in order
+ of output, id is calls, address is total and size is p99 in nanoseconds.
+ Times of writes committed by --writers are the time to hand them over.
+ Outstanding writes are done first, so merging threads' timers is safe.
+ ************************************************************************/
+
+void showStats(string args) {
+	if (!args.empty()) {
+		out << "Error: stats() takes no arguments. " << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_STATS, RESULT_REFUSED, "",
+				"stats() takes no arguments");
+		return;
+	}
+
+	statsBlock total = statsBlock();
+	mergeStats(total);
+	for (unsigned i = 0; i < TIMER_COUNT; i++) {
+		const latencyHistogram &timer = total.timers[i];
+		out << timerNames[i] << ": " << timer.samples << " calls";
+		if (timer.samples != 0) {
+			out << ", " << timer.totalNs << "ns total, p50 "
+					<< getLatencyPercentile(timer, 0.5) << "ns, p99 "
+					<< getLatencyPercentile(timer, 0.99) << "ns, p999 "
+					<< getLatencyPercentile(timer, 0.999) << "ns, max "
+					<< timer.maxNs << "ns" << endLine;
+			out << timerNames[i] << " histogram:";
+			const char *separator = " ";
+			for (unsigned b = 0; b < latencyBuckets; b += latencyBucketSteps) {
+				//first latencyBucketSteps buckets are below 8ns, then each
+				//latencyBucketSteps buckets are one power of two
+				unsigned long long count = 0;
+				for (unsigned k = b; k < b + latencyBucketSteps; k++) {
+					count += timer.counts[k];
+				}
+				if (count != 0) {
+					out << separator << getLatencyBucketStart(b) << "-"
+							<< (b + latencyBucketSteps < latencyBuckets ?
+									getLatencyBucketStart(b + latencyBucketSteps) - 1 :
+									ULLONG_MAX) << "ns " << count;
+					separator = ", ";
+				}
+			}
+		}
+		out << endLine;
+		if (outputFormat == OUTPUT_BINARY) {
+			outputRecord record = { COMMAND_STATS, RESULT_OK, NULL, NULL, NULL,
+					timer.samples, timer.totalNs,
+					getLatencyPercentile(timer, 0.99), NULL, i, NULL, NULL,
+					NULL, NULL, NULL, NULL };
+			writeRecord(record);
+		} else {
+			emitStatsRecord(timerNames[i], &timer, NULL);
+		}
+	}
+
+	readStats cache = { cacheBlocks, cacheHits, cacheMisses, cacheReadahead };
+	out << "cache: " << cache.blocks << " blocks, " << cache.hits << " hits, "
+			<< cache.misses << " misses, " << cache.ahead << " read ahead"
+			<< endLine;
+	if (outputFormat == OUTPUT_JSON) {
+		emitStatsRecord("cache", NULL, &cache);
+	}
+}
+
+/************************************************************************
+ Function: emitStatsRecord
+ Description: Outputs a result record of stats()
+ Args:
+ name        const char*         timer name or "cache"
+ latency     latencyHistogram*   histogram of timer, NULL for cache
+ cache       readStats*          cache counters, NULL for a timer
+ Returns: none
+ Notes:
+ Does nothing unless output format is json.
+ ************************************************************************/
+
+void emitStatsRecord(const char *name, const latencyHistogram *latency,
+		const readStats *cache) {
+	if (outputFormat != OUTPUT_JSON) {
+		return;
+	}
+	outputRecord record = { COMMAND_STATS, RESULT_OK, NULL, NULL, NULL, 0, 0,
+			0, NULL, 0, cache, name, latency, NULL, NULL, NULL };
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: statsTimer::statsTimer
+ Description: Starts timing
+ Args:
+ timer   statsTimerType  timer to add time to when destroyed
+ Returns: none
+ ************************************************************************/
+
+statsTimer::statsTimer(statsTimerType timer) :
+		timer(timer), started(readClock()) {
+}
+
+/************************************************************************
+ Function: statsTimer::~statsTimer
+ Description: Adds time since construction to timer
+ Args: none
+ Returns: none
+ ************************************************************************/
+
+statsTimer::~statsTimer() {
+	addStatsTime(timer, readClock() - started);
+}
+
+/************************************************************************
+ Function: addStatsTime
+ Description: Counts a call and its time in a timer of current thread
+ Args:
+ timer   statsTimerType      timer to update
+ ns      unsigned long long  time of call in nanoseconds
+ Returns: none
+ Notes:
+ Each thread counts in its own statsBlock without locks or atomics,
+ the block is registered once on first use (see mergeStats).
+ ************************************************************************/
+
+void addStatsTime(statsTimerType timer, unsigned long long ns) {
+	if (threadStats == NULL) {
+		threadStats = new statsBlock();
+		pthread_mutex_lock(&statsLock);
+		statsBlocks.push_back(threadStats);
+		pthread_mutex_unlock(&statsLock);
+	}
+	addLatency(threadStats->timers[timer], ns);
+}
+
+/************************************************************************
+ Function: mergeStats
+ Description: Adds timers of every thread
+ Args:
+ total   statsBlock&     zeroed block to add to
+ Returns: none
+ Notes:
+ Caller makes sure other threads are not timing anything, eg. after
+ drainWriters(). Blocks of finished threads are kept, so their calls
+ still count.
+ ************************************************************************/
+
+void mergeStats(statsBlock &total) {
+	pthread_mutex_lock(&statsLock);
+	for (size_t k = 0; k < statsBlocks.size(); k++) {
+		for (unsigned i = 0; i < TIMER_COUNT; i++) {
+			const latencyHistogram &from = statsBlocks[k]->timers[i];
+			latencyHistogram &to = total.timers[i];
+			for (unsigned b = 0; b < latencyBuckets; b++) {
+				to.counts[b] += from.counts[b];
+			}
+			to.samples += from.samples;
+			to.totalNs += from.totalNs;
+			to.maxNs = std::max(to.maxNs, from.maxNs);
+		}
+	}
+	pthread_mutex_unlock(&statsLock);
+}
+
+/************** Fragmentation *********************************************/
+
+/************************************************************************
+ Function: showFragmentation
+ Description: Shows how files and free space are split in runs
+ Args:
+ args    string      file path, empty for totals
+ Returns: none
+ Notes:
+ Without a path, shows number of files, files in more than one extent,
+ extents of all files, free runs and largest free run in blocks.
+ With a path, shows extents of the file in logical order: first address
+ and number of blocks of each.
+ On failure, skips to next command.
+ ************************************************************************/
+
+void showFragmentation(string args) {
+	//Background cleaner must not split extents while they are read
+	allocGuard guard;
+	unsigned long long blockBytes = convertSize(blockSize, blockUnit, "B");
+
+	if (args.empty()) {
+		fragmentationStats stats = { };
+		for (unsigned long long i = 0; i < fileShardCount; i++) {
+			for (map<unsigned long long, file>::iterator it =
+					fileShards[i].files.begin();
+					it != fileShards[i].files.end(); ++it) {
+				stats.files++;
+				stats.extents += it->second.extents.size();
+				if (it->second.extents.size() > 1) {
+					stats.fragmented++;
+				}
+			}
+		}
+		stats.freeRuns = freeExtents.size();
+		if (!freeExtentsBySize.empty()) {
+			stats.largestFreeRun = freeExtentsBySize.rbegin()->first;
+		}
+		out << "Fragmentation: " << stats.files << " files, "
+				<< stats.fragmented << " in more than one extent, "
+				<< stats.extents << " extents, " << stats.freeRuns
+				<< " free runs, largest " << stats.largestFreeRun << " blocks"
+				<< endLine;
+		if (outputFormat != OUTPUT_TEXT) {
+			outputRecord record = { COMMAND_FRAGMENTATION, RESULT_OK, NULL,
+					NULL, NULL, 0, 0, 0, NULL, 0, NULL, NULL, NULL, NULL, &stats,
+					NULL };
+			writeRecord(record);
+		}
+		return;
+	}
+
+	string path = getAbsolutePath(args);
+	unsigned long long fileId = findFile(path);
+	if (fileId == 0) {
+		out << "File not found: " << path << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_FRAGMENTATION, RESULT_NOT_FOUND, path,
+				"File not found");
+		return;
+	}
+
+	const file &f = getFile(fileId);
+	out << path << ", " << fileId << ", "
+			<< (unsigned long long) f.extents.size() << " extents:";
+	for (size_t i = 0; i < f.extents.size(); i++) {
+		out << (i == 0 ? " 0x" : ", 0x")
+				<< hexNumber(f.extents[i].start * blockBytes) << " ("
+				<< f.extents[i].length << " blocks)";
+	}
+	out << endLine;
+	if (outputFormat != OUTPUT_TEXT) {
+		outputRecord record = { COMMAND_FRAGMENTATION, RESULT_OK, &path, NULL,
+				NULL, fileId, 0, f.allocatedFileSize, &blockUnit, 0, NULL, NULL,
+				NULL, NULL, NULL, &f.extents };
+		getStartingAddress(fileId, record.address);
+		writeRecord(record);
+	}
+}
+
+/************** Write amplification ***************************************/
+
+/************************************************************************
+ Function: showAmplification
+ Description: Outputs blocks written, relocated and scanned, and write
+ amplification derived from them
+ Args:
+ args    string      directory path, empty for whole run
+ Returns: none
+ Notes:
+ Write amplification is (written + compacted + cleaned) / written.
+ Without a path, outputs totals since start, then the last complete
+ window of --amplification-window writes (the current one until a
+ window is complete), then the prefix report of root.
+ Prefix report: totals of files under the directory, then totals under
+ each of its subdirectories by path. Relocated blocks count for the
+ directory of the file when they moved, removed directories count for
+ their parent.
+ Eg: amplification(/d0) Output:
+ /d0/: 1.500 (100 blocks written by 10 writes, 50 compacted, 0 cleaned)
+ ************************************************************************/
+
+void showAmplification(string args) {
+	//Background cleaner must not count while counters are read
+	allocGuard guard;
+	string path = "/";
+	if (!args.empty()) {
+		path = getAbsolutePath(args);
+		if (path[path.length() - 1] != '/') {
+			path += "/";
+		}
+	}
+	unsigned long long dirId = resolveDirectory(path, path.length(), false);
+	if (dirId == noEntry) {
+		out << "Directory doesn't exist: " << path << endLine;
+		out << "Skipping to next command..." << endLine;
+		emitRecord(COMMAND_AMPLIFICATION, RESULT_NOT_FOUND, path,
+				"Directory doesn't exist");
+		return;
+	}
+
+	if (args.empty()) {
+		outputAmplification("Write amplification", "run", amplification);
+		amplificationStats window =
+				lastWindow.writes != 0 ?
+						lastWindow :
+						subtractAmplification(amplification, windowStart);
+		outputAmplification("Last " + std::to_string(window.writes) + " writes",
+				"window", window);
+	}
+
+	amplificationStats total = { };
+	sumAmplification(dirId, total);
+	outputAmplification(path, NULL, total);
+
+	map<string, unsigned long long> subdirs;
+	directory &dir = directories[dirId];
+	for (unordered_map<unsigned long long, unsigned long long>::iterator it =
+			dir.subdirs.begin(); it != dir.subdirs.end(); ++it) {
+		subdirs[path + names[it->first] + "/"] = it->second;
+	}
+	for (map<string, unsigned long long>::iterator it = subdirs.begin();
+			it != subdirs.end(); ++it) {
+		amplificationStats subtotal = { };
+		sumAmplification(it->second, subtotal);
+		outputAmplification(it->first, NULL, subtotal);
+	}
+}
+
+/************************************************************************
+ Function: countWritten
+ Description: Counts blocks written by a write() command
+ Args:
+ dirId   unsigned long long  directory of written file
+ blocks  unsigned long long  blocks written
+ Returns: none
+ Notes:
+ Caller holds allocGuard or namespaceLock.
+ Closes the window once it has amplificationWindow writes.
+ ************************************************************************/
+
+void countWritten(unsigned long long dirId, unsigned long long blocks) {
+	amplificationStats &dir = directories[dirId].amplification;
+	dir.writes++;
+	dir.written += blocks;
+	amplification.writes++;
+	amplification.written += blocks;
+	if (amplification.writes - windowStart.writes >= amplificationWindow) {
+		lastWindow = subtractAmplification(amplification, windowStart);
+		windowStart = amplification;
+	}
+}
+
+/************************************************************************
+ Function: countRelocated
+ Description: Counts blocks of a file moved by compaction or cleaning
+ Args:
+ fileId      unsigned long long  owner of moved blocks
+ blocks      unsigned long long  blocks moved
+ cleaning    bool                true if copied by cleaner, false if compacted
+ Returns: none
+ Notes:
+ Caller holds allocGuard.
+ ************************************************************************/
+
+void countRelocated(unsigned long long fileId, unsigned long long blocks,
+		bool cleaning) {
+	amplificationStats &dir =
+			directories[getFile(fileId).parent].amplification;
+	if (cleaning) {
+		dir.cleaned += blocks;
+		amplification.cleaned += blocks;
+	} else {
+		dir.compacted += blocks;
+		amplification.compacted += blocks;
+	}
+}
+
+/************************************************************************
+ Function: addAmplification
+ Description: Adds counters
+ Args:
+ total   amplificationStats&     counters to add to
+ stats   amplificationStats&     counters to add
+ Returns: none
+ ************************************************************************/
+
+void addAmplification(amplificationStats &total,
+		const amplificationStats &stats) {
+	total.writes += stats.writes;
+	total.written += stats.written;
+	total.compacted += stats.compacted;
+	total.cleaned += stats.cleaned;
+	total.scanned += stats.scanned;
+}
+
+/************************************************************************
+ Function: subtractAmplification
+ Description: Gets counters between two points of time
+ Args:
+ to      amplificationStats&     later counters
+ from    amplificationStats&     earlier counters
+ Returns:
+ amplificationStats      counted after from up to to
+ ************************************************************************/
+
+amplificationStats subtractAmplification(const amplificationStats &to,
+		const amplificationStats &from) {
+	amplificationStats window = { to.writes - from.writes, to.written
+			- from.written, to.compacted - from.compacted, to.cleaned
+			- from.cleaned, to.scanned - from.scanned };
+	return window;
+}
+
+/************************************************************************
+ Function: sumAmplification
+ Description: Adds counters of a directory and everything below it
+ Args:
+ dirId   unsigned long long      directory id
+ total   amplificationStats&     counters to add to
+ Returns: none
+ ************************************************************************/
+
+void sumAmplification(unsigned long long dirId, amplificationStats &total) {
+	directory &dir = directories[dirId];
+	addAmplification(total, dir.amplification);
+	for (unordered_map<unsigned long long, unsigned long long>::iterator it =
+			dir.subdirs.begin(); it != dir.subdirs.end(); ++it) {
+		sumAmplification(it->second, total);
+	}
+}
+
+/************************************************************************
+ Function: outputAmplification
+ Description: Outputs one line of amplification()
+ Args:
+ label   string                  directory path or name of totals
+ name    const char*             "run" or "window" for totals, NULL for a directory
+ stats   amplificationStats&     counters to output
+ Returns: none
+ Notes:
+ Scanned bytes are only output for totals. Amplification is n/a
+ without written blocks.
+ With json, one record per line: path or name, writes, written,
+ compacted, cleaned, scanned_bytes for totals and amplification (null
+ without written blocks). With binary, first reserved byte is 0 for
+ run, 1 for window and 2 for a directory, id is written, address is
+ compacted plus cleaned and size is scanned bytes.
+ ************************************************************************/
+
+void outputAmplification(const string &label, const char *name,
+		const amplificationStats &stats) {
+	string ratio = formatRatio(
+			stats.written + stats.compacted + stats.cleaned, stats.written);
+	out << label << ": " << (ratio.empty() ? "n/a" : ratio) << " ("
+			<< stats.written << " blocks written by " << stats.writes
+			<< " writes, " << stats.compacted << " compacted, "
+			<< stats.cleaned << " cleaned";
+	unsigned long long scannedBytes = stats.scanned
+			* (unsigned long long) convertSize(blockSize, blockUnit, "B");
+	if (name != NULL) {
+		out << ", " << scannedBytes << "B scanned";
+	}
+	out << ")" << endLine;
+
+	if (outputFormat != OUTPUT_TEXT) {
+		outputRecord record = { COMMAND_AMPLIFICATION, RESULT_OK,
+				name == NULL ? &label : NULL, NULL, NULL, stats.written,
+				stats.compacted + stats.cleaned, scannedBytes, NULL,
+				name == NULL ? 2ULL : strcmp(name, "run") == 0 ? 0ULL : 1ULL,
+				NULL, name, NULL, &stats, NULL, NULL };
+		writeRecord(record);
+	}
+}
+
+/************************************************************************
+ Function: formatRatio
+ Description: Formats a ratio with three decimals
+ Args:
+ numerator       unsigned long long
+ denominator     unsigned long long
+ Returns:
+ string      eg. 1.500, empty if denominator is 0
+ ************************************************************************/
+
+string formatRatio(unsigned long long numerator,
+		unsigned long long denominator) {
+	if (denominator == 0) {
+		return "";
+	}
+	unsigned long long thousandths = (numerator * 1000 + denominator / 2)
+			/ denominator;
+	char text[32];
+	snprintf(text, sizeof(text), "%llu.%03llu", thousandths / 1000,
+			thousandths % 1000);
+	return text;
+}
+
+/************** Output ****************************************************/
+
+/************************************************************************
+ Function: outputSink::operator<<
+ Description: Appends text or a number to output buffer
+ Args:
+ text/value/number/manipulator       item to output
+ Returns:
+ outputSink&     sink, to chain items
+ Notes:
+ Text output is dropped when output format is json or binary, results
+ are then written as records (see writeRecord).
+ Numbers are formatted without stream state.
+ ************************************************************************/
+
+outputSink &outputSink::operator<<(const char *text) {
+	if (outputFormat == OUTPUT_TEXT) {
+		appendOutput(text, strlen(text));
+	}
+	return *this;
+}
+
+outputSink &outputSink::operator<<(const string &text) {
+	if (outputFormat == OUTPUT_TEXT) {
+		appendOutput(text.data(), text.length());
+	}
+	return *this;
+}
+
+outputSink &outputSink::operator<<(unsigned long long value) {
+	if (outputFormat == OUTPUT_TEXT) {
+		appendNumber(value, 10);
+	}
+	return *this;
+}
+
+outputSink &outputSink::operator<<(hexNumber number) {
+	if (outputFormat == OUTPUT_TEXT) {
+		appendNumber(number.value, 16);
+	}
+	return *this;
+}
+
+outputSink &outputSink::operator<<(
+		outputSink &(*manipulator)(outputSink &)) {
+	return manipulator(*this);
+}
+
+/************************************************************************
+ Function: endLine
+ Description: Ends a line of text output
+ Args:
+ sink    outputSink&     sink to end line on
+ Returns:
+ outputSink&     sink, to chain items
+ Notes:
+ Replaces endl. Flushes only when output is a terminal, else output is
+ flushed when buffer is full and on exit.
+ ************************************************************************/
+
+outputSink &endLine(outputSink &sink) {
+	if (outputFormat == OUTPUT_TEXT) {
+		appendOutput("\n", 1);
+		if (outputLineFlush) {
+			flushOutput();
+		}
+	}
+	return sink;
+}
+
+/************************************************************************
+ Function: appendOutput
+ Description: Appends bytes to output buffer
+ Args:
+ data    const char*     bytes to append
+ length  size_t          number of bytes
+ Returns: none
+ Notes:
+ Flushes buffer first if bytes do not fit. Data larger than buffer is
+ written directly.
+ In a writer thread, bytes go to output of the current write instead.
+ ************************************************************************/
+
+void appendOutput(const char *data, size_t length) {
+	if (outputCapture != NULL) {
+		outputCapture->append(data, length);
+		return;
+	}
+	if (outputLength + length > outputBufferSize) {
+		flushOutput();
+		if (length > outputBufferSize) {
+			writeOutput(data, length);
+			return;
+		}
+	}
+	memcpy(outputBuffer + outputLength, data, length);
+	outputLength += length;
+}
+
+/************************************************************************
+ Function: appendNumber
+ Description: Appends a number to output buffer
+ Args:
+ value   unsigned long long      number to append
+ base    unsigned                10 or 16
+ Returns: none
+ Notes:
+ Hex digits are lower case without prefix, same as std::hex.
+ ************************************************************************/
+
+void appendNumber(unsigned long long value, unsigned base) {
+	char digits[24];
+	size_t pos = sizeof(digits);
+	do {
+		digits[--pos] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value > 0);
+	appendOutput(digits + pos, sizeof(digits) - pos);
+}
+
+/************************************************************************
+ Function: appendJsonString
+ Description: Appends a string member to a JSON object in output buffer
+ Args:
+ key     const char*     member name
+ value   string          member value, escaped as needed
+ Returns: none
+ Notes:
+ Member is preceded by ','.
+ ************************************************************************/
+
+void appendJsonString(const char *key, const string &value) {
+	appendOutput(",\"", 2);
+	appendOutput(key, strlen(key));
+	appendOutput("\":\"", 3);
+	for (size_t i = 0; i < value.length(); i++) {
+		unsigned char c = value[i];
+		if (c == '"' || c == '\\') {
+			char escaped[2] = { '\\', (char) c };
+			appendOutput(escaped, 2);
+		} else if (c < 0x20) {
+			char escaped[6] = { '\\', 'u', '0', '0', "0123456789abcdef"[c >> 4],
+					"0123456789abcdef"[c & 15] };
+			appendOutput(escaped, 6);
+		} else {
+			appendOutput(value.data() + i, 1);
+		}
+	}
+	appendOutput("\"", 1);
+}
+
+/************************************************************************
+ Function: appendJsonNumber
+ Description: Appends a number member to a JSON object in output buffer
+ Args:
+ key     const char*             member name
+ value   unsigned long long      member value
+ Returns: none
+ Notes:
+ Member is preceded by ','.
+ ************************************************************************/
+
+void appendJsonNumber(const char *key, unsigned long long value) {
+	appendOutput(",\"", 2);
+	appendOutput(key, strlen(key));
+	appendOutput("\":", 2);
+	appendNumber(value, 10);
+}
+
+/************************************************************************
+ Function: writeOutput
+ Description: Writes bytes to standard output
+ Args:
+ data    const char*     bytes to write
+ length  size_t          number of bytes
+ Returns: none
+ Notes:
+ Retries partial and interrupted writes. Stops on other errors.
+ ************************************************************************/
+
+void writeOutput(const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(STDOUT_FILENO, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+/************************************************************************
+ Function: flushOutput
+ Description: Writes buffered output to standard output
+ Args: none
+ Returns: none
+ Notes:
+ Does nothing in a writer thread, drainWriters() collects its output.
+ ************************************************************************/
+
+void flushOutput() {
+	if (outputCapture != NULL) {
+		return;
+	}
+	writeOutput(outputBuffer, outputLength);
+	outputLength = 0;
+}
+
+/************************************************************************
+ Function: getCommandName
+ Description: Gets name of a command type for records
+ Args:
+ command     commandType     command type
+ Returns:
+ const char*     command name, "unknown" if not a supported command
+ Notes:
+ rename() and mv() are both named rename.
+ ************************************************************************/
+
+const char *getCommandName(commandType command) {
+	for (size_t i = 0; i < commandsCount; i++) {
+		if (commandsList[i].type == command) {
+			return commandsList[i].name;
+		}
+	}
+	return "unknown";
+}
+
+/************************************************************************
+ Function: emitRecord
+ Description: Outputs a result record without file info
+ Args:
+ command     commandType         command of result
+ status      resultStatusType    result
+ path        string              path of result, empty if none
+ error       const char*         error message, NULL on success
+ Returns: none
+ Notes:
+ Does nothing when output format is text.
+ ************************************************************************/
+
+void emitRecord(commandType command, resultStatusType status,
+		const string &path, const char *error) {
+	if (outputFormat == OUTPUT_TEXT) {
+		return;
+	}
+	outputRecord record = { command, status, path.empty() ? NULL : &path,
+			NULL, error, 0, 0, 0, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL };
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: emitFileRecord
+ Description: Outputs a result record with file info
+ Args:
+ command     commandType         command of result
+ status      resultStatusType    result
+ path        string              absolute file path
+ fileId      unsigned long long  Id of the file
+ Returns: none
+ Notes:
+ Address and size are taken from file list. A deleted file has size 0.
+ Does nothing when output format is text.
+ ************************************************************************/
+
+void emitFileRecord(commandType command, resultStatusType status,
+		const string &path, unsigned long long fileId) {
+	if (outputFormat == OUTPUT_TEXT) {
+		return;
+	}
+	outputRecord record = { command, status, &path, NULL, NULL, fileId, 0, 0,
+			&blockUnit, 0, NULL, NULL, NULL, NULL, NULL, NULL };
+	file *f = lookupFile(fileId);
+	if (f != NULL) {
+		getStartingAddress(fileId, record.address);
+		record.size = f->allocatedFileSize;
+	}
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: emitReadRecord
+ Description: Outputs a result record of read() with a byte range
+ Args:
+ path    string              absolute file path
+ fileId  unsigned long long  Id of the file
+ stats   readStats           blocks read, hits and misses
+ Returns: none
+ Notes:
+ Does nothing when output format is text.
+ ************************************************************************/
+
+void emitReadRecord(const string &path, unsigned long long fileId,
+		const readStats &stats) {
+	if (outputFormat == OUTPUT_TEXT) {
+		return;
+	}
+	outputRecord record = { COMMAND_READ, RESULT_OK, &path, NULL, NULL,
+			fileId, 0, getFile(fileId).allocatedFileSize, &blockUnit, 0,
+			&stats, NULL, NULL, NULL, NULL, NULL };
+	getStartingAddress(fileId, record.address);
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: emitRenameRecord
+ Description: Outputs a result record of a successful rename
+ Args:
+ source  string      old path
+ target  string      new path
+ Returns: none
+ Notes:
+ Does nothing when output format is text.
+ ************************************************************************/
+
+void emitRenameRecord(const string &source, const string &target) {
+	if (outputFormat == OUTPUT_TEXT) {
+		return;
+	}
+	outputRecord record = { COMMAND_RENAME, RESULT_OK, &source, &target, NULL,
+			0, 0, 0, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL };
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: emitSizeRecord
+ Description: Outputs a result record of diskCapacity() or blockSize()
+ Args:
+ command     commandType         command of result
+ size        unsigned long long  size set
+ unit        string              unit of size
+ blocks      unsigned long long  number of blocks, for blockSize()
+ Returns: none
+ Notes:
+ Does nothing when output format is text.
+ ************************************************************************/
+
+void emitSizeRecord(commandType command, unsigned long long size,
+		const string &unit, unsigned long long blocks) {
+	if (outputFormat == OUTPUT_TEXT) {
+		return;
+	}
+	outputRecord record = { command, RESULT_OK, NULL, NULL, NULL, 0, 0, size,
+			&unit, blocks, NULL, NULL, NULL, NULL, NULL, NULL };
+	writeRecord(record);
+}
+
+/************************************************************************
+ Function: writeRecord
+ Description: Writes a result record in json or binary output format
+ Args:
+ record  outputRecord    result to write
+ Returns: none
+ Notes:
+ json: one object per line. Members: command, status, then path, target,
+ id, address, size, unit, blocks, cache counters of a ranged read,
+ stats, amplification and fragmentation members and error when they
+ apply. Sizes are in their unit, address in bytes.
+ binary: one binaryRecord in native byte order. Sizes are in bytes.
+ Paths and messages are not part of binary records.
+ ************************************************************************/
+
+void writeRecord(const outputRecord &record) {
+
+	if (outputFormat == OUTPUT_BINARY) {
+		binaryRecord values;
+		memset(&values, 0, sizeof(values));
+		values.command = record.command;
+		values.status = record.status;
+		values.id =
+				record.command == COMMAND_BLOCK_SIZE ? record.blocks : record.id;
+		if (record.command == COMMAND_STATS
+				|| record.command == COMMAND_AMPLIFICATION) {
+			values.reserved[0] = record.blocks;
+			values.size = record.size;
+		}
+		values.address = record.address;
+		if (record.unit != NULL) {
+			values.size = convertSize(record.size, *record.unit, "B");
+		}
+		if (record.fragmentation != NULL) {
+			values.id = record.fragmentation->files;
+			values.address = record.fragmentation->extents;
+			values.size = record.fragmentation->largestFreeRun
+					* (unsigned long long) convertSize(blockSize, blockUnit,
+							"B");
+		} else if (record.extents != NULL) {
+			values.reserved[0] = 1;
+			values.address = record.extents->size();
+		}
+		appendOutput((const char *) &values, sizeof(values));
+	} else {
+		const char *command = getCommandName(record.command);
+		const char *status = statusNames[record.status];
+		appendOutput("{\"command\":\"", 12);
+		appendOutput(command, strlen(command));
+		appendOutput("\",\"status\":\"", 12);
+		appendOutput(status, strlen(status));
+		appendOutput("\"", 1);
+		if (record.path != NULL) {
+			appendJsonString("path", *record.path);
+		}
+		if (record.target != NULL) {
+			appendJsonString("target", *record.target);
+		}
+		if (record.id != 0 && record.command != COMMAND_AMPLIFICATION) {
+			appendJsonNumber("id", record.id);
+			appendJsonNumber("address", record.address);
+		}
+		if (record.unit != NULL) {
+			appendJsonNumber("size", record.size);
+			appendJsonString("unit", *record.unit);
+		}
+		if (record.command == COMMAND_BLOCK_SIZE && record.blocks != 0) {
+			appendJsonNumber("blocks", record.blocks);
+		}
+		if (record.name != NULL) {
+			appendJsonString("name", record.name);
+		}
+		if (record.latency != NULL) {
+			appendJsonNumber("calls", record.latency->samples);
+			appendJsonNumber("total_ns", record.latency->totalNs);
+			appendJsonNumber("p50_ns", getLatencyPercentile(*record.latency, 0.5));
+			appendJsonNumber("p99_ns",
+					getLatencyPercentile(*record.latency, 0.99));
+			appendJsonNumber("p999_ns",
+					getLatencyPercentile(*record.latency, 0.999));
+			appendJsonNumber("max_ns", record.latency->maxNs);
+			appendOutput(",\"histogram\":[", 14);
+			const char *separator = "";
+			for (unsigned b = 0; b < latencyBuckets; b++) {
+				if (record.latency->counts[b] != 0) {
+					appendOutput(separator, strlen(separator));
+					appendOutput("[", 1);
+					appendNumber(getLatencyBucketStart(b), 10);
+					appendOutput(",", 1);
+					appendNumber(record.latency->counts[b], 10);
+					appendOutput("]", 1);
+					separator = ",";
+				}
+			}
+			appendOutput("]", 1);
+		}
+		if (record.amplification != NULL) {
+			const amplificationStats &stats = *record.amplification;
+			appendJsonNumber("writes", stats.writes);
+			appendJsonNumber("written", stats.written);
+			appendJsonNumber("compacted", stats.compacted);
+			appendJsonNumber("cleaned", stats.cleaned);
+			if (record.name != NULL) {
+				appendJsonNumber("scanned_bytes", record.size);
+			}
+			string ratio = formatRatio(
+					stats.written + stats.compacted + stats.cleaned,
+					stats.written);
+			appendOutput(",\"amplification\":", 17);
+			if (ratio.empty()) {
+				appendOutput("null", 4);
+			} else {
+				appendOutput(ratio.data(), ratio.length());
+			}
+		}
+		if (record.fragmentation != NULL) {
+			const fragmentationStats &stats = *record.fragmentation;
+			appendJsonNumber("files", stats.files);
+			appendJsonNumber("fragmented", stats.fragmented);
+			appendJsonNumber("extents", stats.extents);
+			appendJsonNumber("free_runs", stats.freeRuns);
+			appendJsonNumber("largest_free_run", stats.largestFreeRun);
+		}
+		if (record.extents != NULL) {
+			unsigned long long blockBytes = convertSize(blockSize, blockUnit,
+					"B");
+			appendJsonNumber("extents", record.extents->size());
+			appendOutput(",\"runs\":[", 9);
+			for (size_t i = 0; i < record.extents->size(); i++) {
+				appendOutput(i == 0 ? "[" : ",[", i == 0 ? 1 : 2);
+				appendNumber((*record.extents)[i].start * blockBytes, 10);
+				appendOutput(",", 1);
+				appendNumber((*record.extents)[i].length, 10);
+				appendOutput("]", 1);
+			}
+			appendOutput("]", 1);
+		}
+		if (record.read != NULL) {
+			appendJsonNumber("blocks", record.read->blocks);
+			appendJsonNumber("hits", record.read->hits);
+			appendJsonNumber("misses", record.read->misses);
+			appendJsonNumber("readahead", record.read->ahead);
+		}
+		if (record.error != NULL) {
+			appendJsonString("error", record.error);
+		}
+		appendOutput("}\n", 2);
+	}
+
+	if (outputLineFlush) {
+		flushOutput();
+	}
+}
+
+/*******************  Cleanup  **************************************************/
+
+/************************************************************************
+ Function: terminate
+ Description: Terminates the program and cleanups memory.
+ Args:
+ message     string      message to output before terminating
+ Returns: none
+ Notes:
+ Controlled termination
+ Cleanups memory and prevents leaks.
+ Flushes buffered output.
+ When allocLock is held, by the caller or by the background cleaner in a
+ pass, the cleaner cannot be stopped, so memory is left to the system.
+ Exits with EXIT_FAILURE
+ ************************************************************************/
+
+void terminate(string message) {
+	out << message << endLine;
+	out << "Terminating..." << endLine;
+	emitRecord(COMMAND_UNKNOWN, RESULT_FATAL, "", message.c_str());
+	flushOutput();
+	flushOperationLog();
+	flushTrace();
+	if (cleanerRunning) {
+		if (pthread_mutex_trylock(&allocLock) != 0) {
+			exit (EXIT_FAILURE);
+		}
+		pthread_mutex_unlock(&allocLock);
+		stopBackgroundCleaner();
+	}
+	if (memory) {
+		delete[] memory;
+	}
+	if (freeMap) {
+		delete[] freeMap;
+	}
+	if (segments) {
+		delete[] segments;
 	}
 	exit (EXIT_FAILURE);
 }
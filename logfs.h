@@ -15,27 +15,163 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <list>
 #include <regex.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <cmath>
 #include <algorithm>
 #include <cstring>
+#include <getopt.h>
+#include <climits>
+#include <sched.h>
+#include <atomic>
+#include <unistd.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <linux/io_uring.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 /*Global Variables and constants*/
 
 string currentDir = "/"; //We start with root as current directory
+unsigned long long currentDirId = 0; //directory id of currentDir
+
+struct blockExtent {
+	unsigned long long start; //first block of the run
+	unsigned long long length; //number of blocks in the run
+};
 
 struct file {
-	string path;
+	unsigned long long parent; //directory id
+	unsigned long long name; //interned name component
 	unsigned long long allocatedBlocks;
 	unsigned long long allocatedFileSize;
+	vector<blockExtent> extents; //blocks owned by file in logical order
+	unsigned long long modified; //log clock of last write
+	unsigned long long readNext; //logical block after last ranged read(), for readahead
+	unsigned long long rewrites; //times file was overwritten, for --head-classifier=rewrites
+};
+
+struct amplificationStats {
+	unsigned long long writes; //write() commands that wrote blocks
+	unsigned long long written; //blocks written by write()
+	unsigned long long compacted; //blocks moved by compactBlocks()
+	unsigned long long cleaned; //blocks copied by cleanSegment()
+	unsigned long long scanned; //blocks examined by compaction and cleaning, not kept per directory
+};
+
+struct fragmentationStats {
+	unsigned long long files;
+	unsigned long long fragmented; //files in more than one extent
+	unsigned long long extents; //extents of all files
+	unsigned long long freeRuns; //runs of empty blocks
+	unsigned long long largestFreeRun; //in blocks
+};
+
+struct directory {
+	unsigned long long parent; //directory id, root is its own parent
+	unsigned long long name; //interned name component
+	bool created; //made by mkdir() and not only implied by a file path
+	unordered_map<unsigned long long, unsigned long long> subdirs; //key: name id; value: directory id
+	unordered_map<unsigned long long, unsigned long long> children; //key: name id; value: file id
+	amplificationStats amplification; //of files directly in directory and of removed subdirectories
+};
+
+struct segment {
+	unsigned long long liveBlocks; //occupied blocks in segment
+	unsigned long long lastWrite; //log clock of youngest data in segment
+};
+
+enum allocationPolicyType {
+	ALLOCATION_LOG, //always write at log head
+	ALLOCATION_THRESHOLD //fill a hole when log head cannot fit a write
+};
+
+enum cleanerPolicyType {
+	CLEANER_NONE, //whole disk defragment only
+	CLEANER_GREEDY, //least utilized segment first
+	CLEANER_COST_BENEFIT //age * free / (1 + utilization)
+};
+
+enum commandType {
+	COMMAND_DISK_CAPACITY,
+	COMMAND_BLOCK_SIZE,
+	COMMAND_MKDIR,
+	COMMAND_CHDIR,
+	COMMAND_READ,
+	COMMAND_WRITE,
+	COMMAND_RENAME, //rename() and mv()
+	COMMAND_RMDIR,
+	COMMAND_STATS,
+	COMMAND_AMPLIFICATION,
+	COMMAND_APPEND,
+	COMMAND_FRAGMENTATION,
+	COMMAND_UNKNOWN
+};
+
+enum sizeUnitType {
+	UNIT_NONE, //only for size 0
+	UNIT_B,
+	UNIT_KB,
+	UNIT_MB,
+	UNIT_GB
+};
+
+struct textSlice {
+	const char *data; //points into input line, not terminated
+	size_t length;
+};
+
+struct parsedCommand {
+	textSlice line; //whole line without spaces
+	const char *syntaxError; //syntax error message, NULL if syntax is valid
+	commandType type;
+	textSlice name; //text before '('
+	textSlice args; //text between '(' and ')'
+	textSlice path; //write: file path before ','
+	unsigned long long size; //write: whole number size
+	sizeUnitType unit; //write: unit of size
+	long long hint; //write: log head hint, noHint if none, LLONG_MAX for hot
+	const char *argsError; //write: syntax error message, NULL if args are valid
 };
 
-map<unsigned long long, file> files; //key: non negative file id; value : fileinfo
+struct fileShard {
+	map<unsigned long long, file> files; //key: non negative file id; value : fileinfo
+	pthread_mutex_t lock; //taken by concurrent writers only, see appendToLease
+};
+const unsigned long long fileShardCount = 64;
+fileShard fileShards[fileShardCount]; //file list, file id modulo fileShardCount picks shard
+
+unordered_map<unsigned long long, directory> directories; //key: directory id, 0 is root; value: directory info
+unsigned long long nextDirectoryId = 1;
+vector<string> names; //interned path components, index is name id
+unordered_map<string, unsigned long long> nameIds; //key: path component; value: name id
+const unsigned long long rootDirectory = 0;
+const unsigned long long noEntry = ULLONG_MAX; //not found marker for ids
 long long *memory; //Diskspace divided into blocks 0,1,2 reserved for system. >2 is file id. -1 is empty.
+unsigned long long *freeMap; //Free space bitmap. One bit per block, set bit is empty block.
+unsigned long long freeMapWords; //Number of 64 bit words in freeMap
+map<unsigned long long, unsigned long long> freeExtents; //key: first block of free run; value: length
+set<pair<unsigned long long, unsigned long long> > freeExtentsBySize; //(length, first block) of every free run
+allocationPolicyType allocationPolicy = ALLOCATION_LOG;
+unsigned long long maxExtents = 1; //most extents a write may be split in, 1 for one continuous run
+bool extentsCapped = false; //--max-extents given, cleaner also keeps files within maxExtents
 
 unsigned long long diskSize;
 unsigned long long blockSize;
@@ -43,46 +179,493 @@ string diskUnit = "";
 string blockUnit = "";
 unsigned long long blocksCount;
 
-unsigned long long currentFileId = 3; // 0,1,2 reserved for system
+std::atomic<unsigned long long> currentFileId(3); // 0,1,2 reserved for system
 unsigned long long currentPos = 0; //current write position
+unsigned long long headLimit = 0; //log head is free from currentPos up to headLimit
+
+segment *segments; //Diskspace divided into fixed groups of blocks
+unsigned long long segmentsCount;
+unsigned long long segmentBlocks = 256; //blocks per segment
+std::atomic<unsigned long long> logClock(0); //incremented on every file write
+unsigned long long cleanBlocks = 0; //blocks in segments without live blocks
+unsigned long long freeGeneration = 0; //incremented whenever blocks are freed
+cleanerPolicyType cleanerPolicy = CLEANER_NONE;
+
+/* Log heads */
+enum headClassifierType {
+	CLASSIFY_REWRITES, //head from number of overwrites of file
+	CLASSIFY_AGE //head from writes since file was last written, relative to number of files
+};
+
+struct logHead {
+	//Free run a head appends to. Saved while head is inactive, checked again when it is active
+	unsigned long long pos;
+	unsigned long long limit;
+};
+
+const unsigned long long maxLogHeads = 16;
+const long long noHint = -1;
+unsigned long long logHeads = 1; //head 0 is coldest
+headClassifierType headClassifier = CLASSIFY_REWRITES;
+logHead heads[maxLogHeads] = { }; //only used with more than one head
+unsigned long long activeHead = 0; //head whose run is currentPos to headLimit
+
+/* Background cleaner */
+bool backgroundCleaner = false; //clean in a separate thread
+unsigned long long lowWatermark = 10; //% of disk free for log, start cleaning below it
+unsigned long long highWatermark = 20; //% of disk free for log, stop cleaning at it
+pthread_t cleanerThread;
+bool cleanerRunning = false;
+bool cleanerStop = false;
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER; //guards blocks, extents and log head
+pthread_cond_t cleanerWake = PTHREAD_COND_INITIALIZER;
+pthread_rwlock_t writerLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP; //shared while appending to a lease
+
+struct allocGuard {
+	//Holds allocLock and excludes writers appending to leases for the lifetime of the guard
+	allocGuard() {
+		pthread_mutex_lock(&allocLock);
+		pthread_rwlock_wrlock(&writerLock);
+	}
+	~allocGuard() {
+		pthread_rwlock_unlock(&writerLock);
+		pthread_mutex_unlock(&allocLock);
+	}
+};
+
+struct commandName {
+	const char *name;
+	size_t length;
+	commandType type;
+};
+const commandName commandsList[] = {
+		{ "diskCapacity", 12, COMMAND_DISK_CAPACITY },
+		{ "blockSize", 9, COMMAND_BLOCK_SIZE },
+		{ "mkdir", 5, COMMAND_MKDIR },
+		{ "chdir", 5, COMMAND_CHDIR },
+		{ "read", 4, COMMAND_READ },
+		{ "write", 5, COMMAND_WRITE },
+		{ "rename", 6, COMMAND_RENAME },
+		{ "mv", 2, COMMAND_RENAME },
+		{ "rmdir", 5, COMMAND_RMDIR },
+		{ "stats", 5, COMMAND_STATS },
+		{ "amplification", 13, COMMAND_AMPLIFICATION },
+		{ "append", 6, COMMAND_APPEND },
+		{ "fragmentation", 13, COMMAND_FRAGMENTATION } };
+const size_t commandsCount = sizeof(commandsList) / sizeof(commandsList[0]);
+const string unitNames[] = { "", "B", "KB", "MB", "GB" }; //index is sizeUnitType
+
+/* Batch input */
+struct batchChunk {
+	char *begin; //first line
+	char *end; //after last newline
+	vector<parsedCommand> commands; //one per line
+};
+
+struct batchWorker {
+	vector<batchChunk> *chunks;
+	size_t first; //first chunk of worker
+	size_t count; //chunks in window
+	size_t step; //number of workers
+};
+
+string scriptPath = ""; //script file, empty to read standard input
+unsigned long long parseThreads = 0; //threads tokenizing script, 0 for one per cpu
+const size_t batchChunkBytes = 1 << 20; //chunk size before aligning to a newline
+const size_t batchWindowChunks = 4; //chunks per thread tokenized before executing
+
+/* Pipelined input */
+struct pipelineSlot {
+	string line; //input line, command slices point into it
+	parsedCommand command;
+};
+
+struct commandRing {
+	//Single producer single consumer ring of tokenized lines
+	pipelineSlot *slots;
+	size_t mask; //number of slots - 1, number of slots is a power of 2
+	std::atomic<size_t> head; //next slot to execute, moved by executor
+	std::atomic<size_t> tail; //next slot to fill, moved by parser
+	std::atomic<bool> done; //parser reached end of input
+	bool started; //parser runs in its own thread
+};
+
+bool pipelineInput = false; //tokenize standard input in a separate thread
+unsigned long long pipelineDepth = 1024; //lines tokenized ahead of execution
+const unsigned pipelineSpins = 256; //busy waits before yielding cpu
+const unsigned pipelineSleep = 50; //microseconds to sleep once yielding did not help
+
+/* Concurrent writers */
+struct pendingWrite {
+	string path; //absolute file path
+	unsigned long long size;
+	sizeUnitType unit;
+	string output; //output of the write, collected in command order
+};
+
+struct writerState {
+	pthread_t thread;
+	pthread_mutex_t lock; //guards queue
+	pthread_cond_t wake;
+	deque<pendingWrite *> queue; //writes in command order
+	unsigned long long leaseNext; //next unwritten leased block
+	unsigned long long leaseEnd; //end of lease, leaseNext if none
+};
+
+unsigned long long writersCount = 1; //writer threads, 1 writes in main thread
+unsigned long long leaseBlocks = 64; //blocks leased from log head at a time
+const unsigned long long maxWriters = 1024;
+const size_t writerBacklog = 4096; //writes dispatched before waiting for them
+const long long leasedBlock = 2; //owner of leased blocks not written yet
+unsigned long long writeBudget = 0; //blocks dispatched writes can take in any order
+writerState *writers = NULL; //set while writer threads run
+deque<pendingWrite> pendingWrites; //dispatched and not yet collected
+size_t completedWrites = 0; //guarded by writersLock
+std::atomic<bool> writersStop(false);
+pthread_mutex_t writersLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writersDone = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t namespaceLock = PTHREAD_MUTEX_INITIALIZER; //taken by writers appending to leases
+pthread_mutex_t segmentLock = PTHREAD_MUTEX_INITIALIZER; //taken by writers appending to leases
+thread_local long long writerIndex = -1; //writer of current thread, -1 for main
+thread_local string *outputCapture = NULL; //output of current write in a writer
+
+/* Checkpoint */
+struct checkpointWriter {
+	int fd;
+	string buffer; //bytes not written yet
+	bool failed; //write error
+};
+
+struct checkpointReader {
+	const char *data;
+	size_t length;
+	size_t pos; //next byte to read
+	bool failed; //read past end
+};
+
+string checkpointPath = ""; //checkpoint file, empty for none. Operation log is checkpointPath + ".log"
+unsigned long long checkpointInterval = 100000; //logged operations between checkpoints, 0 only at exit
+unsigned long long logSequence = 0; //number of last logged operation
+unsigned long long checkpointSequence = 0; //number of last operation in checkpoint
+int operationLog = -1; //appended while storage runs with a checkpoint
+string operationBuffer = ""; //logged operations not written yet
+bool operationsUnsynced = false; //operation log written since last fdatasync
+unsigned long long operationSyncedAt = 0; //clock of last sync of operation log
+const char checkpointMagic[8] = { 'L', 'O', 'G', 'F', 'S', 'C', 'P', '\n' };
+const unsigned long long checkpointVersion = 2; //2 adds log heads, rewrites and amplification counters
+const size_t checkpointBufferBytes = 1 << 20;
+const size_t operationBufferBytes = 1 << 16;
+const unsigned long long operationSyncNs = 100000000; //longest a logged operation waits for a sync
+
+/* Disk image */
+string imagePath = ""; //image file backing the disk, empty to only simulate
+bool imageDirect = false; //open image with O_DIRECT
+int imageFd = -1;
+unsigned long long imageBlockBytes = 0;
+char *imageBuffer = NULL; //segment write buffer, flushed as one pwrite
+char *imageCopyBuffer = NULL; //blocks read back when data is relocated, sync engine only
+unsigned long long imageBufferBlocks = 0; //capacity of buffers, one segment
+unsigned long long imageBufferStart = 0; //disk block of first buffered block
+unsigned long long imageBufferLength = 0; //blocks buffered
+std::atomic<int> imageError(0); //errno of a failed image write, reported by main thread
+pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER; //guards buffers, writers append in parallel
+const size_t imageAlignment = 4096; //O_DIRECT buffer, offset and length alignment
+const size_t imageBufferMaxBytes = 64 << 20; //shared by all requests of an asynchronous engine
+
+/* I/O engine */
+enum ioEngineType {
+	IO_SYNC, //pwrite and pread in calling thread
+	IO_URING, //io_uring submission and completion rings
+	IO_THREADS //pool of threads doing pwrite and pread
+};
+
+enum ioStateType {
+	IO_FREE,
+	IO_FILLING, //holds segment write buffer
+	IO_INFLIGHT, //submitted to engine
+	IO_READY //relocation read done, its write not submitted yet
+};
 
-map<string, string> initializeCommands() {
-	map < string, string > m;
-	m["diskCapacity"] = "diskCapacity";
-	m["blockSize"] = "blockSize";
-	m["mkdir"] = "mkdir";
-	m["chdir"] = "chdir";
-	m["read"] = "read";
-	m["write"] = "write";
-	return m;
-}
-map<string, string> commandsList = initializeCommands();
-string validCommandStartPattern = "abcdefghijklmnopqrstuvwxyz"; //Extend this if commands increase.
-
-map<string, string> directoryMap;
+struct ioRequest {
+	char *buffer; //imageBufferBlocks blocks
+	ioStateType state;
+	bool write; //pwrite of start, else pread of start then pwrite to target
+	unsigned long long start; //first block
+	unsigned long long length; //blocks
+	unsigned long long target; //destination of a relocation read
+	unsigned long long sequence; //submission order
+	long long result; //bytes transferred or -errno, set by thread pool
+};
+
+struct ioRing {
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	io_uring_sqe *sqes;
+	io_uring_cqe *cqes;
+	void *sqMap; //mapped rings, cqMap may be the same mapping
+	void *cqMap;
+	size_t sqBytes;
+	size_t cqBytes;
+	size_t sqesBytes;
+};
+
+ioEngineType ioEngine = IO_SYNC;
+unsigned long long ioDepth = 32; //requests in flight with an asynchronous engine
+const unsigned long long maxIoDepth = 1024;
+const unsigned long long maxIoThreads = 64;
+ioRequest *ioRequests = NULL; //ioDepth + 1, guarded by imageLock
+ioRequest *imageFill = NULL; //request holding segment write buffer
+unsigned long long ioSequence = 0; //last submitted request
+unsigned long long ioInFlight = 0; //requests submitted and not reaped
+ioRing ring = { -1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+		NULL, NULL, 0, 0, 0 };
+pthread_t *ioThreads = NULL; //thread pool engine
+unsigned long long ioThreadsCount = 0;
+deque<ioRequest *> ioQueue; //submitted to thread pool
+deque<ioRequest *> ioDone; //completed by thread pool
+bool ioStop = false; //guarded by ioQueueLock
+pthread_mutex_t ioQueueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ioQueued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t ioCompleted = PTHREAD_COND_INITIALIZER;
+
+/* Block cache */
+enum cachePolicyType {
+	CACHE_LRU,
+	CACHE_ARC //adaptive replacement, balances recently and frequently read blocks
+};
+
+enum cacheListType {
+	CACHE_RECENT, //only list of LRU, T1 of ARC
+	CACHE_FREQUENT, //T2 of ARC, blocks read again while cached
+	CACHE_RECENT_GHOST, //B1 of ARC, evicted from T1, no data
+	CACHE_FREQUENT_GHOST //B2 of ARC, evicted from T2, no data
+};
+
+struct cacheEntry {
+	unsigned long long block; //disk block
+	cacheListType list;
+	char *data; //NULL for ghosts
+	bool ahead; //read ahead and not read yet, first read keeps it in T1
+};
+
+struct cacheShard {
+	pthread_mutex_t lock;
+	list<cacheEntry> lists[4]; //most recent first, index is cacheListType
+	unordered_map<unsigned long long, list<cacheEntry>::iterator> entries; //key: disk block
+	unsigned long long capacity; //blocks with data
+	unsigned long long recentTarget; //ARC: preferred number of blocks in T1
+	vector<char *> spare; //data of evicted blocks, reused
+};
+
+struct readStats {
+	unsigned long long blocks; //blocks of the range
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long ahead; //blocks fetched by readahead
+};
+
+cachePolicyType cachePolicy = CACHE_LRU;
+unsigned long long cacheSize = 64; //MB, 0 to read every block from disk
+unsigned long long readaheadBlocks = 16; //blocks fetched after a sequential read, 0 for none
+const unsigned long long cacheShardCount = 16; //shard of a block is block % cacheShardsUsed
+cacheShard *cacheShards = NULL; //set once block size is known, NULL without cache
+unsigned long long cacheShardsUsed = 0;
+unsigned long long cacheBlockBytes = 0;
+char *cacheReadBuffer = NULL; //blocks read from image, used under allocGuard
+unsigned long long cacheReadBlocks = 0; //capacity of cacheReadBuffer
+const size_t cacheReadMaxBytes = 1 << 20;
+std::atomic<bool> cacheUsed(false); //writes invalidate blocks once anything is cached
+std::atomic<unsigned long long> cacheBlocks(0); //blocks with data in all shards
+std::atomic<unsigned long long> cacheHits(0);
+std::atomic<unsigned long long> cacheMisses(0);
+std::atomic<unsigned long long> cacheReadahead(0);
+
+/* Trace */
+const unsigned latencyBucketSteps = 8; //linear steps per power of two of nanoseconds
+const unsigned latencyBuckets = 8 + 61 * latencyBucketSteps; //below 8ns, then 2^3 to 2^63
+
+struct latencyHistogram {
+	unsigned long long counts[latencyBuckets]; //see getLatencyBucket
+	unsigned long long samples;
+	unsigned long long totalNs;
+	unsigned long long maxNs;
+};
+
+string recordPath = ""; //trace of executed commands, empty for none
+string replayPath = ""; //trace to execute instead of standard input, empty for none
+bool replayOriginal = false; //wait for recorded inter-arrival times instead of running as fast as possible
+int traceFile = -1; //opened on first traced command
+string traceBuffer = ""; //trace lines not written yet
+unsigned long long traceOrigin = 0; //clock of first traced command
+std::atomic<unsigned long long> defragmentCount(0); //calls of defragment() that ran compaction
+const size_t traceBufferBytes = 1 << 16;
+
+/* Stats */
+enum statsTimerType {
+	TIMER_MKDIR, //commands in same order as commandType
+	TIMER_CHDIR,
+	TIMER_READ,
+	TIMER_WRITE,
+	TIMER_RENAME,
+	TIMER_RMDIR,
+	TIMER_APPEND, //not in commandType order, added after other commands
+	TIMER_DEFRAGMENT,
+	TIMER_FIND_FILE,
+	TIMER_STARTING_ADDRESS,
+	TIMER_COUNT
+};
+const char *const timerNames[] = { "mkdir", "chdir", "read", "write",
+		"rename", "rmdir", "append", "defragment", "findFile",
+		"getStartingAddress" }; //index is statsTimerType
+
+struct statsBlock {
+	latencyHistogram timers[TIMER_COUNT];
+};
+
+struct statsTimer {
+	//Adds time from construction to destruction to a timer of current thread
+	explicit statsTimer(statsTimerType timer);
+	~statsTimer();
+	statsTimerType timer;
+	unsigned long long started;
+};
+
+bool statsAtExit = false; //output stats() and amplification() once all commands are done
+thread_local statsBlock *threadStats = NULL; //timers of current thread, registered on first use
+vector<statsBlock *> statsBlocks; //timers of every thread that timed anything, guarded by statsLock
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write amplification */
+//Counters are updated under allocGuard, or namespaceLock by writers appending to leases
+amplificationStats amplification = { }; //since start
+amplificationStats windowStart = { }; //totals when current window started
+amplificationStats lastWindow = { }; //last complete window, writes is 0 before first one
+unsigned long long amplificationWindow = 10000; //write() commands per window
+
+/* Output */
+enum outputFormatType {
+	OUTPUT_TEXT, //human readable lines
+	OUTPUT_JSON, //one JSON object per line per result
+	OUTPUT_BINARY //one fixed size binaryRecord per result
+};
+
+enum resultStatusType {
+	RESULT_OK,
+	RESULT_DELETED, //write() with size 0
+	RESULT_EXISTS,
+	RESULT_NOT_FOUND,
+	RESULT_NO_SPACE,
+	RESULT_REFUSED, //not allowed for given path or state
+	RESULT_FATAL //program terminates
+};
+const char *const statusNames[] = { "ok", "deleted", "exists", "not_found",
+		"no_space", "refused", "fatal" }; //index is resultStatusType
+
+struct outputRecord {
+	commandType command;
+	resultStatusType status;
+	const string *path; //NULL if none
+	const string *target; //rename(): new path
+	const char *error; //NULL on success
+	unsigned long long id; //file id
+	unsigned long long address; //first block address in bytes
+	unsigned long long size; //in unit
+	const string *unit; //NULL if no size
+	unsigned long long blocks; //blockSize(): number of blocks
+	const readStats *read; //read() with a byte range, stats() cache counters, NULL otherwise
+	const char *name; //stats(): timer name or "cache", NULL otherwise
+	const latencyHistogram *latency; //stats(): histogram of timer, NULL otherwise
+	const amplificationStats *amplification; //amplification(): counters, NULL otherwise
+	const fragmentationStats *fragmentation; //fragmentation(): totals, NULL otherwise
+	const vector<blockExtent> *extents; //fragmentation() of a file: its extents, NULL otherwise
+};
+
+struct binaryRecord {
+	unsigned char command; //commandType
+	unsigned char status; //resultStatusType
+	unsigned char reserved[6];
+	unsigned long long id; //file id, number of blocks for blockSize()
+	unsigned long long address; //first block address in bytes
+	unsigned long long size; //in bytes
+};
+
+struct hexNumber {
+	//Prints value in hex through outputSink
+	explicit hexNumber(unsigned long long v) :
+			value(v) {
+	}
+	unsigned long long value;
+};
+
+struct outputSink {
+	//Buffered text output, ignored unless output format is text
+	outputSink &operator<<(const char *text);
+	outputSink &operator<<(const string &text);
+	outputSink &operator<<(unsigned long long value);
+	outputSink &operator<<(hexNumber number);
+	outputSink &operator<<(outputSink &(*manipulator)(outputSink &));
+};
+
+outputFormatType outputFormat = OUTPUT_TEXT;
+outputSink out;
+const size_t outputBufferSize = 1 << 16; //flush threshold in bytes
+char outputBuffer[outputBufferSize];
+size_t outputLength = 0;
+bool outputLineFlush = false; //flush every line, set when output is a terminal
 
 /* Prototypes */
 
 /* Main */
+void parseOptions(int argc, char *argv[]);
 void init();
+void executeInitCommand(const parsedCommand &command, int step);
+void initStorage();
+unsigned long long executeLine(const parsedCommand &command, int &step);
+void executeCommand(const parsedCommand &command);
 void setDiskCapacity(string args);
 void setBlockSize(string args);
 void createDirectory(string args);
 void changeDirectory(string args);
-void writeFile(string args);
-void commitFile(string file, unsigned long long fileSize, string unit);
-void defragment();
+void writeFile(const parsedCommand &command);
+void commitFile(const string &file, unsigned long long fileSize,
+		const string &unit, long long hint);
+bool findWriteSpace(unsigned long long requiredBlocks,
+		unsigned long long maxPieces, vector<blockExtent> &pieces);
+bool findScatteredSpace(unsigned long long requiredBlocks,
+		unsigned long long maxPieces, vector<blockExtent> &pieces);
+void placeBlocks(const vector<blockExtent> &pieces, unsigned long long fileId,
+		unsigned long long modified);
+void appendFile(const parsedCommand &command);
+unsigned long long defragment();
+unsigned long long compactBlocks(unsigned long long maxBlocks);
 void resetMemory(unsigned long long fileId);
 void readFile(string args);
+void readRange(unsigned long long fileId, unsigned long long offset,
+		unsigned long long length, readStats &stats);
+void renamePath(string args);
+void removeDirectory(string args);
 
 /* Validators */
 bool isComment(string line);
-bool isValidCommand(string command);
-bool isValidSyntax(string line, string &command, string &args);
 bool isNumber(string number);
 
+/* Tokenizer */
+bool tokenizeLine(string &line, parsedCommand &command);
+bool tokenizeText(char *text, size_t length, parsedCommand &command);
+commandType lookupCommand(textSlice name);
+void parseWriteArgs(parsedCommand &command);
+bool parseWholeNumber(const char *text, size_t length,
+		unsigned long long &value);
+bool parseByteCount(string text, unsigned long long &bytes);
+string sliceToString(textSlice slice);
+
 /* Helpers */
-void removeSpaces(string &line);
 void ltrim(string &line);
 string moveUpDir(string path, int levels);
 string getAbsolutePath(string path);
@@ -90,9 +673,238 @@ unsigned long long convertSize(unsigned long long size, string fromUnit,
 		string toUnit);
 bool isMemoryFull();
 bool isMemoryEmpty();
-unsigned long long findFile(string filepath);
+unsigned long long findFile(const string &filepath);
 unsigned long long getTotalAvailableBlocks();
 void getStartingAddress(unsigned long long fileId, unsigned long long &address);
+unsigned long long relocateExtent(unsigned long long fileId, unsigned long long oldStart,
+		unsigned long long newStart);
+
+/* Namespace */
+unsigned long long internName(const string &name);
+unsigned long long findName(const string &name);
+unsigned long long makeDirectory(unsigned long long parent,
+		unsigned long long name);
+unsigned long long resolveDirectory(const string &path, size_t end,
+		bool create);
+bool addDirectory(const string &path);
+unsigned long long findDirectory(const string &path);
+void linkFile(unsigned long long fileId, unsigned long long dirId,
+		unsigned long long name);
+void unlinkFile(unsigned long long fileId);
+void pruneDirectory(unsigned long long dirId);
+bool isAncestor(unsigned long long ancestor, unsigned long long dirId);
+string getDirectoryPath(unsigned long long dirId);
+string getFilePath(unsigned long long fileId);
+
+/* File table */
+fileShard &getFileShard(unsigned long long fileId);
+file &getFile(unsigned long long fileId);
+file *lookupFile(unsigned long long fileId);
+void eraseFile(unsigned long long fileId);
+
+/* Free space bitmap */
+void assignBlocks(unsigned long long start, unsigned long long length,
+		long long owner);
+void markFreeMap(unsigned long long start, unsigned long long length,
+		bool isFree);
+unsigned long long countFreeBlocks();
+unsigned long long countFreeRange(unsigned long long start,
+		unsigned long long end);
+unsigned long long findNextBlock(unsigned long long from, bool isFree);
+unsigned long long findPrevBlock(unsigned long long from, bool isFree);
+unsigned long long findFreeRun(unsigned long long from,
+		unsigned long long minLength);
+
+/* Free extent index */
+void addFreeExtent(unsigned long long start, unsigned long long length);
+void removeFreeExtent(unsigned long long start, unsigned long long length);
+void rebuildFreeExtents(unsigned long long start, unsigned long long end);
+bool findHole(unsigned long long requiredBlocks, unsigned long long &start);
+
+/* Segments and cleaner */
+void setSegmentLive(unsigned long long k, unsigned long long liveBlocks);
+void recountSegments(unsigned long long start, unsigned long long end);
+void ageSegments(unsigned long long start, unsigned long long length,
+		unsigned long long modified);
+unsigned long long findCleanRun(unsigned long long minLength);
+long long selectVictim(vector<bool> &visited);
+unsigned long long cleanSegment(unsigned long long victim,
+		unsigned long long &cursor);
+bool findEvacuationSpace(unsigned long long length,
+		unsigned long long maxPieces, unsigned long long victim,
+		unsigned long long &cursor, vector<blockExtent> &pieces);
+unsigned long long cleanSegments(unsigned long long requiredBlocks);
+
+/* Log heads */
+unsigned long long classifyWrite(unsigned long long fileId, long long hint);
+void selectLogHead(unsigned long long head, unsigned long long requiredBlocks);
+
+/* Background cleaner */
+unsigned long long getLogFreeBlocks();
+bool cleanerStep(vector<bool> &visited, unsigned long long &cursor);
+void *runBackgroundCleaner(void *arg);
+void startBackgroundCleaner();
+void wakeBackgroundCleaner();
+void stopBackgroundCleaner();
+
+/* Batch input */
+void runBatch(const string &path);
+void parseChunks(vector<batchChunk> &chunks, size_t count,
+		unsigned long long threads);
+void *parseChunkRange(void *arg);
+
+/* Pipelined input */
+void runPipeline();
+void *runParser(void *arg);
+void waitForRing(unsigned &spins);
+
+/* Concurrent writers */
+void startWriters();
+void stopWriters();
+void dispatchWrite(const string &path, unsigned long long size,
+		sizeUnitType unit);
+void drainWriters();
+void *runWriter(void *arg);
+bool commitToLease(const string &filepath, unsigned long long requiredBlocks,
+		unsigned long long allocatedFileSize);
+bool takeLease(writerState &writer, unsigned long long requiredBlocks);
+void appendToLease(writerState &writer, const string &filepath,
+		unsigned long long requiredBlocks,
+		unsigned long long allocatedFileSize);
+void revokeLease(writerState &writer);
+unsigned long long countLeasedBlocks();
+void revokeLeases();
+
+/* Checkpoint */
+void recoverCheckpoint();
+const char *restoreCheckpoint(checkpointReader &reader);
+void replayOperationLog();
+bool isLoggedCommand(commandType command);
+void logOperation(const parsedCommand &command);
+void flushOperationLog();
+void syncOperationLog();
+bool inputPending();
+void writeCheckpoint();
+bool saveCheckpoint(int fd);
+void closeCheckpoint();
+void putNumber(checkpointWriter &writer, unsigned long long value);
+void putText(checkpointWriter &writer, const string &text);
+void flushCheckpointWriter(checkpointWriter &writer);
+unsigned long long getNumber(checkpointReader &reader);
+string getText(checkpointReader &reader);
+void putAmplification(checkpointWriter &writer,
+		const amplificationStats &stats);
+amplificationStats getAmplification(checkpointReader &reader);
+
+/* Disk image */
+void openImage();
+void closeImage();
+void writeImage(unsigned long long start, unsigned long long length,
+		unsigned long long fileId);
+void copyImage(unsigned long long from, unsigned long long to,
+		unsigned long long length);
+char *bufferImage(unsigned long long block);
+void flushImage();
+int transferImage(char *buffer, size_t bytes, unsigned long long offset,
+		bool write);
+int readImage(unsigned long long start, unsigned long long length,
+		char *buffer);
+
+/* I/O engine */
+void startIoEngine();
+bool setupRing();
+void stopIoEngine();
+ioRequest *acquireRequest();
+void startRequest(ioRequest *request);
+bool isBlocked(const ioRequest &request);
+bool overlapsRequest(const ioRequest &request, unsigned long long start,
+		unsigned long long length, bool write);
+void submitRequest(ioRequest *request);
+void pumpRequests();
+void reapRequests(bool wait);
+void completeRequest(ioRequest *request, long long result);
+void drainImage();
+void *runIoThread(void *);
+
+/* Block cache */
+void initCache();
+cacheShard &getCacheShard(unsigned long long block);
+bool lookupCache(unsigned long long block, bool touch);
+void insertCache(unsigned long long block, const char *data, bool ahead);
+void replaceCache(cacheShard &shard, bool frequentGhost);
+void moveCacheEntry(cacheShard &shard, list<cacheEntry>::iterator entry,
+		cacheListType to, const char *data);
+void dropCacheEntry(cacheShard &shard, list<cacheEntry>::iterator entry);
+void invalidateCache(unsigned long long start, unsigned long long length);
+void fetchFileBlocks(unsigned long long fileId, const file &f,
+		unsigned long long first, unsigned long long count, bool ahead,
+		readStats &stats);
+void fetchBlocks(unsigned long long fileId, unsigned long long start,
+		unsigned long long length, bool ahead, readStats &stats);
+void loadBlocks(unsigned long long fileId, unsigned long long start,
+		unsigned long long length, bool ahead);
+
+/* Trace */
+unsigned long long traceCommand(const parsedCommand &command, int step);
+void flushTrace();
+void closeTrace();
+void runReplay(const string &path);
+unsigned long long readClock();
+void addLatency(latencyHistogram &histogram, unsigned long long ns);
+unsigned getLatencyBucket(unsigned long long ns);
+unsigned long long getLatencyBucketStart(unsigned bucket);
+unsigned long long getLatencyPercentile(const latencyHistogram &histogram,
+		double fraction);
+void printReplayReport(const vector<latencyHistogram> &recorded,
+		const vector<latencyHistogram> &replayed,
+		unsigned long long recordedNs, unsigned long long replayedNs,
+		unsigned long long recordedDefragments,
+		unsigned long long replayedDefragments);
+
+/* Stats */
+void showStats(string args);
+void addStatsTime(statsTimerType timer, unsigned long long ns);
+void mergeStats(statsBlock &total);
+void emitStatsRecord(const char *name, const latencyHistogram *latency,
+		const readStats *cache);
+
+/* Fragmentation */
+void showFragmentation(string args);
+
+/* Write amplification */
+void showAmplification(string args);
+void countWritten(unsigned long long dirId, unsigned long long blocks);
+void countRelocated(unsigned long long fileId, unsigned long long blocks,
+		bool cleaning);
+void addAmplification(amplificationStats &total,
+		const amplificationStats &stats);
+amplificationStats subtractAmplification(const amplificationStats &to,
+		const amplificationStats &from);
+void sumAmplification(unsigned long long dirId, amplificationStats &total);
+void outputAmplification(const string &label, const char *name,
+		const amplificationStats &stats);
+string formatRatio(unsigned long long numerator,
+		unsigned long long denominator);
+
+/* Output */
+void appendOutput(const char *data, size_t length);
+void appendNumber(unsigned long long value, unsigned base);
+void appendJsonString(const char *key, const string &value);
+void appendJsonNumber(const char *key, unsigned long long value);
+void writeOutput(const char *data, size_t length);
+void flushOutput();
+outputSink &endLine(outputSink &sink);
+const char *getCommandName(commandType command);
+void emitRecord(commandType command, resultStatusType status,
+		const string &path, const char *error);
+void emitFileRecord(commandType command, resultStatusType status,
+		const string &path, unsigned long long fileId);
+void emitReadRecord(const string &path, unsigned long long fileId,
+		const readStats &stats);
+void emitRenameRecord(const string &source, const string &target);
+void emitSizeRecord(commandType command, unsigned long long size,
+		const string &unit, unsigned long long blocks);
+void writeRecord(const outputRecord &record);
 
 /* Cleanup */
 void terminate(string message);
@@ -0,0 +1,610 @@
+/*
+ * Synthetic workload generator for logfs
+ *
+ * More info:
+ * https://github.com/saikishu/logfs/blob/master/README.md
+ *
+ * Copyright (c) 2015 Sai Kishore
+ * Free to use under the MIT license
+ * https://github.com/saikishu/logfs/blob/master/LICENSE
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+using namespace std;
+
+/* Workload spec */
+enum accessPatternType {
+	ACCESS_UNIFORM, //every file equally likely
+	ACCESS_ZIPF, //file of rank r chosen with probability proportional to 1/r^theta
+	ACCESS_HOT_COLD //hotAccess of operations go to hotFraction of files
+};
+
+enum sizeDistributionType {
+	SIZE_FIXED, //always sizeMean
+	SIZE_UNIFORM, //sizeMin to sizeMax
+	SIZE_EXPONENTIAL //mean sizeMean, clamped to sizeMin and sizeMax
+};
+
+struct workloadSpec {
+	unsigned long long seed;
+	string disk; //diskCapacity() args
+	string block; //blockSize() args
+	unsigned long long operations; //commands after setup
+	unsigned long long files; //distinct file names
+	unsigned long long directories; //files are spread over /d<n>/
+	accessPatternType pattern;
+	double zipfTheta;
+	double hotFraction;
+	double hotAccess;
+	sizeDistributionType sizes;
+	unsigned long long sizeMin; //bytes
+	unsigned long long sizeMax; //bytes
+	unsigned long long sizeMean; //bytes
+	double readRatio; //share of operations that read
+	double deleteRatio; //share of operations that delete
+	double utilization; //share of disk blocks live files may hold
+};
+
+struct zipfState {
+	//Gray et al. "Quickly generating billion-record synthetic databases"
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+	double half; //1 + 0.5^theta
+};
+
+struct workloadState {
+	unsigned long long random; //xorshift64* state, never 0
+	unsigned long long diskBlocks;
+	unsigned long long blockBytes;
+	unsigned long long liveLimit; //blocks live files may hold
+	unsigned long long liveBlocks; //blocks held by live files
+	vector<unsigned long long> fileBlocks; //blocks of each file, 0 if not live
+	vector<unsigned long long> live; //live files, any order
+	vector<unsigned long long> livePos; //index of each live file in live
+	unsigned long long permute; //rank to file multiplier, coprime to files
+	zipfState zipf;
+};
+
+workloadSpec spec = { 1, "1GB", "4KB", 100000, 10000, 16, ACCESS_UNIFORM,
+		0.99, 0.1, 0.9, SIZE_UNIFORM, 4096, 1 << 20, 64 << 10, 0.2, 0.1, 0.8 };
+const size_t outputBufferBytes = 1 << 20;
+const unsigned long long noFile = ~0ULL;
+
+bool parseSpecLine(const string &line);
+bool parseBytes(const string &text, unsigned long long &bytes);
+bool parseRatio(const string &text, double &ratio);
+bool parseCount(const string &text, unsigned long long &count);
+void generate();
+unsigned long long pickFile(workloadState &state);
+unsigned long long pickSize(workloadState &state);
+void writeFile(workloadState &state, unsigned long long fileId,
+		unsigned long long bytes);
+void deleteFile(workloadState &state, unsigned long long fileId);
+void printPath(unsigned long long fileId);
+void printSize(unsigned long long bytes);
+unsigned long long nextRandom(workloadState &state);
+double nextUnit(workloadState &state);
+void initZipf(zipfState &zipf, unsigned long long n, double theta);
+unsigned long long nextZipf(workloadState &state, unsigned long long n);
+
+/************************************************************************
+ Function: main
+ Description: Entry point of workload generator.
+ Args:
+ argc    int         number of command line arguments
+ argv    char*[]     --spec=<file> and --<key>=<value> settings
+ Returns: 0 on success, 1 on invalid spec.
+ Notes:
+ Spec file has one <key>=<value> per line. Arguments apply in order, so
+ settings after --spec override the file. The script goes
+ to standard output as it is generated, memory does not grow with the
+ number of operations.
+ ************************************************************************/
+
+int main(int argc, char *argv[]) {
+	bool valid = true;
+	for (int i = 1; i < argc && valid; i++) {
+		string arg = argv[i];
+		if (arg.compare(0, 7, "--spec=") == 0) {
+			ifstream specFile(arg.substr(7).c_str());
+			string line;
+			valid = specFile.good();
+			while (valid && std::getline(specFile, line)) {
+				valid = parseSpecLine(line);
+				if (!valid) {
+					fprintf(stderr, "Invalid spec line: %s\n", line.c_str());
+				}
+			}
+		} else {
+			valid = arg.compare(0, 2, "--") == 0 && parseSpecLine(arg.substr(2));
+			if (!valid) {
+				fprintf(stderr, "Invalid setting: %s\n", arg.c_str());
+			}
+		}
+	}
+
+	unsigned long long diskBytes = 0;
+	unsigned long long blockBytes = 0;
+	valid = valid && parseBytes(spec.disk, diskBytes)
+			&& parseBytes(spec.block, blockBytes) && blockBytes > 0
+			&& diskBytes % blockBytes == 0 && spec.files > 0
+			&& spec.directories > 0 && spec.sizeMin > 0
+			&& spec.sizeMin <= spec.sizeMax && spec.sizeMean > 0
+			&& spec.readRatio + spec.deleteRatio <= 1
+			&& spec.utilization > 0;
+	if (!valid) {
+		fprintf(stderr,
+				"Usage: logfs_workload [--spec=<file>] [--<key>=<value> ...]\n"
+						"Keys: seed, disk, block, operations, files, directories,\n"
+						"pattern=<uniform|zipf|hot-cold>, zipf-theta, hot-fraction, hot-access,\n"
+						"sizes=<fixed|uniform|exponential>, size-min, size-max, size-mean,\n"
+						"read-ratio, delete-ratio, utilization\n");
+		return 1;
+	}
+
+	generate();
+	return 0;
+}
+
+/************************************************************************
+ Function: parseSpecLine
+ Description: Applies one key=value setting of the spec
+ Args:
+ line    string      setting, empty or starting with # is ignored
+ Returns:
+ bool    false for unknown key or invalid value
+ Notes:
+ Sizes take B|KB|MB|GB (disk also TB), ratios are fractions from 0 to 1.
+ ************************************************************************/
+
+bool parseSpecLine(const string &line) {
+	size_t begin = line.find_first_not_of(" \t\r");
+	if (begin == string::npos || line[begin] == '#') {
+		return true;
+	}
+	size_t equals = line.find('=', begin);
+	if (equals == string::npos) {
+		return false;
+	}
+	string key = line.substr(begin, equals - begin);
+	string value = line.substr(equals + 1);
+	key = key.substr(0, key.find_last_not_of(" \t") + 1);
+	size_t valueBegin = value.find_first_not_of(" \t");
+	value = valueBegin == string::npos ? "" :
+			value.substr(valueBegin,
+					value.find_last_not_of(" \t\r") - valueBegin + 1);
+
+	unsigned long long bytes = 0;
+	if (key == "seed") {
+		return parseCount(value, spec.seed);
+	} else if (key == "disk") {
+		spec.disk = value;
+		return parseBytes(value, bytes) && bytes > 0;
+	} else if (key == "block") {
+		spec.block = value;
+		return parseBytes(value, bytes) && bytes > 0;
+	} else if (key == "operations") {
+		return parseCount(value, spec.operations);
+	} else if (key == "files") {
+		return parseCount(value, spec.files);
+	} else if (key == "directories") {
+		return parseCount(value, spec.directories);
+	} else if (key == "pattern") {
+		if (value == "uniform") {
+			spec.pattern = ACCESS_UNIFORM;
+		} else if (value == "zipf") {
+			spec.pattern = ACCESS_ZIPF;
+		} else if (value == "hot-cold") {
+			spec.pattern = ACCESS_HOT_COLD;
+		} else {
+			return false;
+		}
+		return true;
+	} else if (key == "zipf-theta") {
+		return parseRatio(value, spec.zipfTheta) && spec.zipfTheta < 1;
+	} else if (key == "hot-fraction") {
+		return parseRatio(value, spec.hotFraction);
+	} else if (key == "hot-access") {
+		return parseRatio(value, spec.hotAccess);
+	} else if (key == "sizes") {
+		if (value == "fixed") {
+			spec.sizes = SIZE_FIXED;
+		} else if (value == "uniform") {
+			spec.sizes = SIZE_UNIFORM;
+		} else if (value == "exponential") {
+			spec.sizes = SIZE_EXPONENTIAL;
+		} else {
+			return false;
+		}
+		return true;
+	} else if (key == "size-min") {
+		return parseBytes(value, spec.sizeMin);
+	} else if (key == "size-max") {
+		return parseBytes(value, spec.sizeMax);
+	} else if (key == "size-mean") {
+		return parseBytes(value, spec.sizeMean);
+	} else if (key == "read-ratio") {
+		return parseRatio(value, spec.readRatio);
+	} else if (key == "delete-ratio") {
+		return parseRatio(value, spec.deleteRatio);
+	} else if (key == "utilization") {
+		return parseRatio(value, spec.utilization);
+	}
+	return false;
+}
+
+/************************************************************************
+ Function: parseBytes
+ Description: Parses a size with unit
+ Args:
+ text    string                  whole number followed by B|KB|MB|GB|TB
+ bytes   unsigned long long&     size in bytes
+ Returns:
+ bool    false if text is not a size or overflows
+ ************************************************************************/
+
+bool parseBytes(const string &text, unsigned long long &bytes) {
+	size_t digits = text.find_first_not_of("0123456789");
+	if (digits == 0 || digits == string::npos || digits > 15) {
+		return false;
+	}
+	string unit = text.substr(digits);
+	const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+	for (int i = 0; i < 5; i++) {
+		if (unit == units[i]) {
+			bytes = strtoull(text.substr(0, digits).c_str(), NULL, 10) << (10 * i);
+			return (bytes >> (10 * i)) == strtoull(text.c_str(), NULL, 10);
+		}
+	}
+	return false;
+}
+
+/************************************************************************
+ Function: parseRatio
+ Description: Parses a fraction
+ Args:
+ text    string      decimal number from 0 to 1
+ ratio   double&     parsed fraction
+ Returns:
+ bool    false if text is not a number from 0 to 1
+ ************************************************************************/
+
+bool parseRatio(const string &text, double &ratio) {
+	char *end = NULL;
+	ratio = strtod(text.c_str(), &end);
+	return !text.empty() && *end == '\0' && ratio >= 0 && ratio <= 1;
+}
+
+/************************************************************************
+ Function: parseCount
+ Description: Parses a whole number
+ Args:
+ text    string                  digits
+ count   unsigned long long&     parsed number
+ Returns:
+ bool    false if text is not digits or too long
+ ************************************************************************/
+
+bool parseCount(const string &text, unsigned long long &count) {
+	if (text.empty() || text.length() > 18
+			|| text.find_first_not_of("0123456789") != string::npos) {
+		return false;
+	}
+	count = strtoull(text.c_str(), NULL, 10);
+	return true;
+}
+
+/************************************************************************
+ Function: generate
+ Description: Writes the script to standard output
+ Args: none
+ Returns: none
+ Notes:
+ Setup: diskCapacity(), blockSize() and one mkdir() per directory.
+ Then each operation reads, deletes or writes a file picked by the
+ access pattern. Reads and deletes of a file that does not exist write
+ it instead, so every command does work. Before a write would push
+ live blocks over the target utilization, random live files are deleted
+ until it fits.
+ Same spec and seed give the same script.
+ ************************************************************************/
+
+void generate() {
+	static char buffer[outputBufferBytes];
+	setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+	workloadState state;
+	state.random = spec.seed * 0x9E3779B97F4A7C15ULL + 1;
+	if (state.random == 0) {
+		state.random = 1;
+	}
+	unsigned long long diskBytes = 0;
+	parseBytes(spec.disk, diskBytes);
+	parseBytes(spec.block, state.blockBytes);
+	state.diskBlocks = diskBytes / state.blockBytes;
+	state.liveLimit = std::max(1.0, floor(spec.utilization * state.diskBlocks));
+	state.liveBlocks = 0;
+	state.fileBlocks.assign(spec.files, 0);
+	state.livePos.assign(spec.files, noFile);
+	state.permute = 2654435761ULL;
+	while (spec.files > 1) {
+		unsigned long long a = state.permute, b = spec.files;
+		while (b != 0) {
+			unsigned long long t = a % b;
+			a = b;
+			b = t;
+		}
+		if (a == 1) {
+			break;
+		}
+		state.permute += 2;
+	}
+	if (spec.pattern == ACCESS_ZIPF) {
+		initZipf(state.zipf, spec.files, spec.zipfTheta);
+	}
+
+	printf("diskCapacity(%s)\nblockSize(%s)\n", spec.disk.c_str(),
+			spec.block.c_str());
+	for (unsigned long long d = 0; d < spec.directories; d++) {
+		printf("mkdir(/d%llu)\n", d);
+	}
+
+	for (unsigned long long op = 0; op < spec.operations; op++) {
+		unsigned long long fileId = pickFile(state);
+		double kind = nextUnit(state);
+		bool exists = state.fileBlocks[fileId] != 0;
+		if (exists && kind < spec.readRatio) {
+			fputs("read(", stdout);
+			printPath(fileId);
+			fputs(")\n", stdout);
+		} else if (exists && kind < spec.readRatio + spec.deleteRatio) {
+			deleteFile(state, fileId);
+		} else {
+			writeFile(state, fileId, pickSize(state));
+		}
+	}
+	fflush(stdout);
+}
+
+/************************************************************************
+ Function: pickFile
+ Description: Picks the file of next operation
+ Args:
+ state   workloadState&  generator state
+ Returns:
+ unsigned long long  file number, below spec.files
+ Notes:
+ Zipf and hot-cold pick a rank, ranks are spread over files by a
+ multiplier coprime to the file count, so hot files are in every
+ directory.
+ ************************************************************************/
+
+unsigned long long pickFile(workloadState &state) {
+	unsigned long long rank = 0;
+	if (spec.pattern == ACCESS_UNIFORM) {
+		return nextRandom(state) % spec.files;
+	} else if (spec.pattern == ACCESS_ZIPF) {
+		rank = nextZipf(state, spec.files);
+	} else {
+		unsigned long long hot = std::max(1.0,
+				floor(spec.hotFraction * spec.files));
+		if (hot >= spec.files || nextUnit(state) < spec.hotAccess) {
+			rank = nextRandom(state) % hot;
+		} else {
+			rank = hot + nextRandom(state) % (spec.files - hot);
+		}
+	}
+	return (unsigned long long) ((unsigned __int128) rank * state.permute
+			% spec.files);
+}
+
+/************************************************************************
+ Function: pickSize
+ Description: Picks size of a write
+ Args:
+ state   workloadState&  generator state
+ Returns:
+ unsigned long long  bytes, at least 1
+ ************************************************************************/
+
+unsigned long long pickSize(workloadState &state) {
+	if (spec.sizes == SIZE_FIXED) {
+		return spec.sizeMean;
+	}
+	if (spec.sizes == SIZE_UNIFORM) {
+		return spec.sizeMin + nextRandom(state) % (spec.sizeMax - spec.sizeMin + 1);
+	}
+	double size = -log(1 - nextUnit(state)) * spec.sizeMean;
+	return std::min((double) spec.sizeMax,
+			std::max((double) spec.sizeMin, floor(size)));
+}
+
+/************************************************************************
+ Function: writeFile
+ Description: Outputs a write and tracks live blocks
+ Args:
+ state   workloadState&      generator state
+ fileId  unsigned long long  file to write
+ bytes   unsigned long long  size of the write
+ Returns: none
+ Notes:
+ A write larger than the utilization target is cut to it. Random other
+ live files are deleted first while the write would not fit.
+ ************************************************************************/
+
+void writeFile(workloadState &state, unsigned long long fileId,
+		unsigned long long bytes) {
+	unsigned long long blocks = (bytes + state.blockBytes - 1)
+			/ state.blockBytes;
+	if (blocks > state.liveLimit) {
+		blocks = state.liveLimit;
+		bytes = blocks * state.blockBytes;
+	}
+	unsigned long long old = state.fileBlocks[fileId];
+	while (state.liveBlocks - old + blocks > state.liveLimit) {
+		unsigned long long victim = state.live[nextRandom(state)
+				% state.live.size()];
+		if (victim != fileId) {
+			deleteFile(state, victim);
+		}
+	}
+
+	fputs("write(", stdout);
+	printPath(fileId);
+	fputs(", ", stdout);
+	printSize(bytes);
+	fputs(")\n", stdout);
+
+	state.liveBlocks = state.liveBlocks - old + blocks;
+	state.fileBlocks[fileId] = blocks;
+	if (state.livePos[fileId] == noFile) {
+		state.livePos[fileId] = state.live.size();
+		state.live.push_back(fileId);
+	}
+}
+
+/************************************************************************
+ Function: deleteFile
+ Description: Outputs a write of size 0 and tracks live blocks
+ Args:
+ state   workloadState&      generator state
+ fileId  unsigned long long  live file to delete
+ Returns: none
+ ************************************************************************/
+
+void deleteFile(workloadState &state, unsigned long long fileId) {
+	fputs("write(", stdout);
+	printPath(fileId);
+	fputs(", 0)\n", stdout);
+
+	state.liveBlocks -= state.fileBlocks[fileId];
+	state.fileBlocks[fileId] = 0;
+	unsigned long long pos = state.livePos[fileId];
+	unsigned long long last = state.live.back();
+	state.live[pos] = last;
+	state.livePos[last] = pos;
+	state.live.pop_back();
+	state.livePos[fileId] = noFile;
+}
+
+/************************************************************************
+ Function: printPath
+ Description: Outputs absolute path of a file
+ Args:
+ fileId  unsigned long long  file number
+ Returns: none
+ Notes:
+ Path is /d<file % directories>/f<file>.
+ ************************************************************************/
+
+void printPath(unsigned long long fileId) {
+	printf("/d%llu/f%llu", fileId % spec.directories, fileId);
+}
+
+/************************************************************************
+ Function: printSize
+ Description: Outputs a size in write() syntax
+ Args:
+ bytes   unsigned long long  size, at least 1
+ Returns: none
+ Notes:
+ Uses the largest of KB|MB|GB that divides the size, else B.
+ ************************************************************************/
+
+void printSize(unsigned long long bytes) {
+	const char *units[] = { "B", "KB", "MB", "GB" };
+	int unit = 0;
+	while (unit < 3 && bytes % 1024 == 0) {
+		bytes /= 1024;
+		unit++;
+	}
+	printf("%llu%s", bytes, units[unit]);
+}
+
+/************************************************************************
+ Function: nextRandom
+ Description: Next number of a xorshift64* generator
+ Args:
+ state   workloadState&  generator state
+ Returns:
+ unsigned long long  pseudo random number
+ ************************************************************************/
+
+unsigned long long nextRandom(workloadState &state) {
+	state.random ^= state.random >> 12;
+	state.random ^= state.random << 25;
+	state.random ^= state.random >> 27;
+	return state.random * 2685821657736338717ULL;
+}
+
+/************************************************************************
+ Function: nextUnit
+ Description: Next pseudo random fraction
+ Args:
+ state   workloadState&  generator state
+ Returns:
+ double  from 0 to below 1
+ ************************************************************************/
+
+double nextUnit(workloadState &state) {
+	return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/************************************************************************
+ Function: initZipf
+ Description: Precomputes constants of the Zipf sampler
+ Args:
+ zipf    zipfState&          sampler to set up
+ n       unsigned long long  number of ranks
+ theta   double              skew, from 0 to below 1
+ Returns: none
+ Notes:
+ Computing zeta(n) takes one pass over the ranks, sampling is constant
+ time afterwards.
+ ************************************************************************/
+
+void initZipf(zipfState &zipf, unsigned long long n, double theta) {
+	zipf.theta = theta;
+	zipf.zetan = 0;
+	for (unsigned long long i = 1; i <= n; i++) {
+		zipf.zetan += 1 / pow((double) i, theta);
+	}
+	double zeta2 = 1 + 1 / pow(2.0, theta);
+	zipf.alpha = 1 / (1 - theta);
+	zipf.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf.zetan);
+	zipf.half = 1 + pow(0.5, theta);
+}
+
+/************************************************************************
+ Function: nextZipf
+ Description: Next Zipf distributed rank
+ Args:
+ state   workloadState&      generator state
+ n       unsigned long long  number of ranks
+ Returns:
+ unsigned long long  rank from 0 (most frequent) to n - 1
+ ************************************************************************/
+
+unsigned long long nextZipf(workloadState &state, unsigned long long n) {
+	double u = nextUnit(state);
+	double uz = u * state.zipf.zetan;
+	if (uz < 1) {
+		return 0;
+	}
+	if (uz < state.zipf.half) {
+		return n > 1 ? 1 : 0;
+	}
+	unsigned long long rank = (unsigned long long) (n
+			* pow(state.zipf.eta * u - state.zipf.eta + 1, state.zipf.alpha));
+	return std::min(rank, n - 1);
+}